@@ -26,8 +26,6 @@ BuildRequires:  pkgconfig(pixman-1)
 BuildRequires:  pkgconfig(cairo)
 BuildRequires:  pkgconfig(cairo-egl)
 BuildRequires:  pkgconfig(cairo-glesv2)
-BuildRequires:  pkgconfig(glib-2.0)
-BuildRequires:  pkgconfig(gio-2.0)
 
 %if !%{with wayland}
 ExclusiveArch:
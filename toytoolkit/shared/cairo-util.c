@@ -32,6 +32,9 @@
 #include "cairo-util.h"
 
 #include "image-loader.h"
+#include "image-cache.h"
+#include "glyph-cache.h"
+#include "cpu-features.h"
 //#include "config-parser.h"
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
@@ -46,95 +49,268 @@ surface_flush_device(cairo_surface_t *surface)
 		cairo_device_flush(device);
 }
 
+/*
+ * The shadow blur is a triple box blur approximating the gaussian
+ * (sigma ~ 6) of the former 71-tap kernel.  Every pass is a running sum
+ * down the columns of a 16-bit-per-channel copy of the image, so the
+ * horizontal passes run on a transposed copy.  Pixels outside the image
+ * count as transparent.  The vector kernels only spread the same integer
+ * arithmetic over 8 channels (two pixels) at a time, so all paths give
+ * bit-identical results.
+ */
+
+#define BLUR_STRIP	64	/* channels per column strip, 16 pixels */
+
+static const int blur_radius[] = { 5, 5, 6 };
+
+typedef void (*blur_columns_func_t)(uint16_t *dst, const uint16_t *src,
+				    int x0, int x1, int n, int rows,
+				    int radius, uint16_t mul);
+
+/* Box filter channels x0..x1-1 of each of "rows" rows of "n" channels.
+ * The division by the box width is a 16.16 multiply, (sum * mul) >> 16. */
+static void
+blur_columns_c(uint16_t *dst, const uint16_t *src, int x0, int x1,
+	       int n, int rows, int radius, uint16_t mul)
+{
+	uint16_t acc[BLUR_STRIP];
+	int x, y, len = x1 - x0;
+
+	src += x0;
+	dst += x0;
+
+	memset(acc, 0, sizeof acc);
+	for (y = 0; y < radius && y < rows; y++)
+		for (x = 0; x < len; x++)
+			acc[x] += src[y * n + x];
+
+	for (y = 0; y < rows; y++) {
+		if (y + radius < rows)
+			for (x = 0; x < len; x++)
+				acc[x] += src[(y + radius) * n + x];
+		for (x = 0; x < len; x++)
+			dst[y * n + x] = ((uint32_t) acc[x] * mul) >> 16;
+		if (y - radius >= 0)
+			for (x = 0; x < len; x++)
+				acc[x] -= src[(y - radius) * n + x];
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+
+__attribute__((target("sse2")))
+static void
+blur_columns_sse2(uint16_t *dst, const uint16_t *src, int x0, int x1,
+		  int n, int rows, int radius, uint16_t mul)
+{
+	__m128i acc[BLUR_STRIP / 8];
+	__m128i m = _mm_set1_epi16(mul);
+	int x, y, len = (x1 - x0) / 8;
+
+	src += x0;
+	dst += x0;
+
+	for (x = 0; x < len; x++)
+		acc[x] = _mm_setzero_si128();
+	for (y = 0; y < radius && y < rows; y++)
+		for (x = 0; x < len; x++)
+			acc[x] = _mm_add_epi16(acc[x],
+				_mm_loadu_si128((const __m128i *)
+						(src + y * n) + x));
+
+	for (y = 0; y < rows; y++) {
+		if (y + radius < rows)
+			for (x = 0; x < len; x++)
+				acc[x] = _mm_add_epi16(acc[x],
+					_mm_loadu_si128((const __m128i *)
+						(src + (y + radius) * n) + x));
+		for (x = 0; x < len; x++)
+			_mm_storeu_si128((__m128i *) (dst + y * n) + x,
+					 _mm_mulhi_epu16(acc[x], m));
+		if (y - radius >= 0)
+			for (x = 0; x < len; x++)
+				acc[x] = _mm_sub_epi16(acc[x],
+					_mm_loadu_si128((const __m128i *)
+						(src + (y - radius) * n) + x));
+	}
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static void
+blur_columns_neon(uint16_t *dst, const uint16_t *src, int x0, int x1,
+		  int n, int rows, int radius, uint16_t mul)
+{
+	uint16x8_t acc[BLUR_STRIP / 8];
+	uint16x4_t m = vdup_n_u16(mul);
+	uint32x4_t lo, hi;
+	int x, y, len = (x1 - x0) / 8;
+
+	src += x0;
+	dst += x0;
+
+	for (x = 0; x < len; x++)
+		acc[x] = vdupq_n_u16(0);
+	for (y = 0; y < radius && y < rows; y++)
+		for (x = 0; x < len; x++)
+			acc[x] = vaddq_u16(acc[x],
+					   vld1q_u16(src + y * n + x * 8));
+
+	for (y = 0; y < rows; y++) {
+		if (y + radius < rows)
+			for (x = 0; x < len; x++)
+				acc[x] = vaddq_u16(acc[x],
+					vld1q_u16(src + (y + radius) * n + x * 8));
+		for (x = 0; x < len; x++) {
+			lo = vmull_u16(vget_low_u16(acc[x]), m);
+			hi = vmull_u16(vget_high_u16(acc[x]), m);
+			vst1q_u16(dst + y * n + x * 8,
+				  vcombine_u16(vshrn_n_u32(lo, 16),
+					       vshrn_n_u32(hi, 16)));
+		}
+		if (y - radius >= 0)
+			for (x = 0; x < len; x++)
+				acc[x] = vsubq_u16(acc[x],
+					vld1q_u16(src + (y - radius) * n + x * 8));
+	}
+}
+#endif
+
+static blur_columns_func_t
+blur_columns_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (cpu_features() & CPU_FEATURE_SSE2)
+		return blur_columns_sse2;
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	if (cpu_features() & CPU_FEATURE_NEON)
+		return blur_columns_neon;
+#endif
+	return blur_columns_c;
+}
+
+/* Run the three box passes over the columns of "rows" x "n" channels,
+ * one cache-sized strip at a time.  The result ends up in "a". */
+static void
+blur_boxes(uint16_t *a, uint16_t *b, int n, int rows)
+{
+	blur_columns_func_t columns = blur_columns_select();
+	uint16_t *src, *dst, *tmp;
+	int i, x, end, split, r;
+	uint16_t mul;
+
+	src = a;
+	dst = b;
+	for (i = 0; i < (int) ARRAY_LENGTH(blur_radius); i++) {
+		r = blur_radius[i];
+		mul = (65536 + 2 * r) / (2 * r + 1);
+		for (x = 0; x < n; x += BLUR_STRIP) {
+			end = x + BLUR_STRIP < n ? x + BLUR_STRIP : n;
+			split = x + ((end - x) & ~7);
+			if (split > x)
+				columns(dst, src, x, split, n, rows, r, mul);
+			if (split < end)
+				blur_columns_c(dst, src, split, end, n, rows,
+					       r, mul);
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (src != a)
+		memcpy(a, src, n * rows * sizeof *a);
+}
+
+/* Transpose a "width" x "height" image of 4-channel pixels in 8x8 tiles. */
+static void
+blur_transpose(uint16_t *dst, const uint16_t *src, int width, int height)
+{
+	int i, j, x, y;
+
+	for (i = 0; i < height; i += 8)
+		for (j = 0; j < width; j += 8)
+			for (y = i; y < i + 8 && y < height; y++)
+				for (x = j; x < j + 8 && x < width; x++)
+					memcpy(dst + (x * height + y) * 4,
+					       src + (y * width + x) * 4,
+					       4 * sizeof *src);
+}
+
 static int
 blur_surface(cairo_surface_t *surface, int margin)
 {
-	int32_t width, height, stride, x, y, z, w;
-	uint8_t *src, *dst;
-	uint32_t *s, *d, a, p;
-	int i, j, k, size, half;
-	uint32_t kernel[71];
-	double f;
-
-	size = ARRAY_LENGTH(kernel);
+	int32_t width, height, stride;
+	uint8_t *data, *p;
+	uint16_t *image, *horizontal, *tmp, *q;
+	int i, j, k, size;
+
 	width = cairo_image_surface_get_width(surface);
 	height = cairo_image_surface_get_height(surface);
 	stride = cairo_image_surface_get_stride(surface);
-	src = cairo_image_surface_get_data(surface);
+	data = cairo_image_surface_get_data(surface);
 
-	dst = malloc(height * stride);
-	if (dst == NULL)
+	size = width * height * 4;
+	image = malloc(3 * size * sizeof *image);
+	if (image == NULL)
 		return -1;
+	horizontal = image + size;
+	tmp = horizontal + size;
 
-	half = size / 2;
-	a = 0;
-	for (i = 0; i < size; i++) {
-		f = (i - half);
-		kernel[i] = exp(- f * f / ARRAY_LENGTH(kernel)) * 10000;
-		a += kernel[i];
-	}
-
+	cairo_surface_flush(surface);
 	for (i = 0; i < height; i++) {
-		s = (uint32_t *) (src + i * stride);
-		d = (uint32_t *) (dst + i * stride);
-		for (j = 0; j < width; j++) {
-			if (margin < j && j < width - margin) {
-				d[j] = s[j];
-				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (j - half + k < 0 || j - half + k >= width)
-					continue;
-				p = s[j - half + k];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
-		}
+		p = data + i * stride;
+		q = image + i * width * 4;
+		for (k = 0; k < width * 4; k++)
+			q[k] = p[k];
 	}
 
+	/* Horizontal passes on the transposed image, columns strictly
+	 * inside the margins are kept. */
+	blur_transpose(tmp, image, width, height);
+	blur_boxes(tmp, horizontal, height * 4, width);
+	blur_transpose(horizontal, tmp, height, width);
+	for (i = 0; i < height; i++)
+		for (j = margin + 1; j < width - margin; j++)
+			memcpy(horizontal + (i * width + j) * 4,
+			       image + (i * width + j) * 4, 4 * sizeof *image);
+
+	/* Vertical passes, rows inside the margins are kept. */
+	memcpy(image, horizontal, size * sizeof *image);
+	blur_boxes(image, tmp, width * 4, height);
+	for (i = margin; i < height - margin; i++)
+		memcpy(image + i * width * 4, horizontal + i * width * 4,
+		       width * 4 * sizeof *image);
+
 	for (i = 0; i < height; i++) {
-		s = (uint32_t *) (dst + i * stride);
-		d = (uint32_t *) (src + i * stride);
-		for (j = 0; j < width; j++) {
-			if (margin <= i && i < height - margin) {
-				d[j] = s[j];
-				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (i - half + k < 0 || i - half + k >= height)
-					continue;
-				s = (uint32_t *) (dst + (i - half + k) * stride);
-				p = s[j];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
-		}
+		p = data + i * stride;
+		q = image + i * width * 4;
+		for (k = 0; k < width * 4; k++)
+			p[k] = q[k];
 	}
 
-	free(dst);
+	free(image);
 	cairo_surface_mark_dirty(surface);
 
 	return 0;
 }
 
+/* Mask inside one rectangle, intersected with the caller's clip. */
+static void
+mask_rectangle(cairo_t *cr, cairo_pattern_t *pattern,
+	       int x, int y, int width, int height)
+{
+	cairo_save(cr);
+	cairo_rectangle(cr, x, y, width, height);
+	cairo_clip(cr);
+	cairo_mask(cr, pattern);
+	cairo_restore(cr);
+}
+
 void
 tile_mask(cairo_t *cr, cairo_surface_t *surface,
 	  int x, int y, int width, int height, int margin, int top_margin)
@@ -161,13 +337,10 @@ tile_mask(cairo_t *cr, cairo_surface_t *surface,
 		else
 			vmargin = top_margin;
 
-		cairo_reset_clip(cr);
-		cairo_rectangle(cr,
-				x + fx * (width - margin),
-				y + fy * (height - vmargin),
-				margin, vmargin);
-		cairo_clip (cr);
-		cairo_mask(cr, pattern);
+		mask_rectangle(cr, pattern,
+			       x + fx * (width - margin),
+			       y + fy * (height - vmargin),
+			       margin, vmargin);
 	}
 
 	/* Top stretch */
@@ -175,47 +348,28 @@ tile_mask(cairo_t *cr, cairo_surface_t *surface,
 	cairo_matrix_scale(&matrix, 8.0 / width, 1);
 	cairo_matrix_translate(&matrix, -x - width / 2, -y);
 	cairo_pattern_set_matrix(pattern, &matrix);
-	cairo_rectangle(cr, x + margin, y, width - 2 * margin, margin);
-
-	cairo_reset_clip(cr);
-	cairo_rectangle(cr,
-			x + margin,
-			y,
-			width - 2 * margin, margin);
-	cairo_clip (cr);
-	cairo_mask(cr, pattern);
+	mask_rectangle(cr, pattern, x + margin, y, width - 2 * margin, margin);
 
 	/* Bottom stretch */
 	cairo_matrix_translate(&matrix, 0, -height + 128);
 	cairo_pattern_set_matrix(pattern, &matrix);
-
-	cairo_reset_clip(cr);
-	cairo_rectangle(cr, x + margin, y + height - margin,
-			width - 2 * margin, margin);
-	cairo_clip (cr);
-	cairo_mask(cr, pattern);
+	mask_rectangle(cr, pattern, x + margin, y + height - margin,
+		       width - 2 * margin, margin);
 
 	/* Left stretch */
 	cairo_matrix_init_translate(&matrix, 0, 60);
 	cairo_matrix_scale(&matrix, 1, 8.0 / height);
 	cairo_matrix_translate(&matrix, -x, -y - height / 2);
 	cairo_pattern_set_matrix(pattern, &matrix);
-	cairo_reset_clip(cr);
-	cairo_rectangle(cr, x, y + margin, margin, height - 2 * margin);
-	cairo_clip (cr);
-	cairo_mask(cr, pattern);
+	mask_rectangle(cr, pattern, x, y + margin, margin, height - 2 * margin);
 
 	/* Right stretch */
 	cairo_matrix_translate(&matrix, -width + 128, 0);
 	cairo_pattern_set_matrix(pattern, &matrix);
-	cairo_rectangle(cr, x + width - margin, y + margin,
-			margin, height - 2 * margin);
-	cairo_reset_clip(cr);
-	cairo_clip (cr);
-	cairo_mask(cr, pattern);
+	mask_rectangle(cr, pattern, x + width - margin, y + margin,
+		       margin, height - 2 * margin);
 
 	cairo_pattern_destroy(pattern);
-	cairo_reset_clip(cr);
 }
 
 void
@@ -336,10 +490,50 @@ theme_set_background_source(struct theme *t, cairo_t *cr, uint32_t flags)
 	}
 }
 
+/* Bump when the rendering of the cached assets changes. */
+#define THEME_CACHE_VERSION 2
+
+struct theme_cache_key {
+	int32_t version;
+	int32_t margin;
+	int32_t frame_radius;
+	int32_t titlebar_height;
+	int32_t cairo_version;
+};
+
+static int
+theme_load_cache(struct theme *t, const char *name,
+		 const struct theme_cache_key *key)
+{
+	cairo_surface_t *surfaces[3];
+
+	if (image_cache_load(name, key, sizeof *key, surfaces, 3) < 0)
+		return -1;
+
+	t->shadow = surfaces[0];
+	t->active_frame = surfaces[1];
+	t->inactive_frame = surfaces[2];
+
+	return 0;
+}
+
+static void
+theme_save_cache(struct theme *t, const char *name,
+		 const struct theme_cache_key *key)
+{
+	cairo_surface_t *surfaces[3] = {
+		t->shadow, t->active_frame, t->inactive_frame
+	};
+
+	image_cache_save(name, key, sizeof *key, surfaces, 3);
+}
+
 struct theme *
 theme_create(void)
 {
 	struct theme *t;
+	struct theme_cache_key key;
+	char name[64];
 	cairo_t *cr;
 
 	t = malloc(sizeof *t);
@@ -350,6 +544,20 @@ theme_create(void)
 	t->width = 6;
 	t->titlebar_height = 27;
 	t->frame_radius = 3;
+	t->title_font = glyph_font_create("sans", CAIRO_FONT_WEIGHT_BOLD, 14);
+
+	memset(&key, 0, sizeof key);
+	key.version = THEME_CACHE_VERSION;
+	key.margin = t->margin;
+	key.frame_radius = t->frame_radius;
+	key.titlebar_height = t->titlebar_height;
+	key.cairo_version = cairo_version();
+	snprintf(name, sizeof name, "theme-m%d-r%d-t%d",
+		 t->margin, t->frame_radius, t->titlebar_height);
+
+	if (theme_load_cache(t, name, &key) == 0)
+		return t;
+
 	t->shadow = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 128, 128);
 	cr = cairo_create(t->shadow);
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
@@ -389,6 +597,8 @@ theme_create(void)
 
 	cairo_destroy(cr);
 
+	theme_save_cache(t, name, &key);
+
 	return t;
 
  err_inactive_frame:
@@ -397,6 +607,8 @@ theme_create(void)
 	cairo_surface_destroy(t->active_frame);
  err_shadow:
 	cairo_surface_destroy(t->shadow);
+	if (t->title_font)
+		glyph_font_destroy(t->title_font);
 	free(t);
 	return NULL;
 }
@@ -407,6 +619,8 @@ theme_destroy(struct theme *t)
 	cairo_surface_destroy(t->active_frame);
 	cairo_surface_destroy(t->inactive_frame);
 	cairo_surface_destroy(t->shadow);
+	if (t->title_font)
+		glyph_font_destroy(t->title_font);
 	free(t);
 }
 
@@ -415,7 +629,7 @@ theme_render_frame(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, uint32_t flags)
 {
-	cairo_text_extents_t extents;
+	const struct glyph_run *run = NULL;
 	cairo_font_extents_t font_extents;
 	cairo_surface_t *source;
 	int x, y, margin, top_margin;
@@ -424,13 +638,15 @@ theme_render_frame(struct theme *t,
 	cairo_set_source_rgba(cr, 0, 0, 0, 0);
 	cairo_paint(cr);
 
-	if (flags & THEME_FRAME_MAXIMIZED)
+	if (flags & THEME_FRAME_MAXIMIZED || t->margin == 0)
 		margin = 0;
 	else {
-		cairo_set_source_rgba(cr, 0, 0, 0, 0.45);
-		tile_mask(cr, t->shadow,
-			  2, 2, width + 8, height + 8,
-			  64, 64);
+		if (!(flags & THEME_FRAME_NO_SHADOW)) {
+			cairo_set_source_rgba(cr, 0, 0, 0, 0.45);
+			tile_mask(cr, t->shadow,
+				  2, 2, width + 8, height + 8,
+				  64, 64);
+		}
 		margin = t->margin;
 	}
 
@@ -449,36 +665,31 @@ theme_render_frame(struct theme *t,
 		    width - margin * 2, height - margin * 2,
 		    t->width, top_margin);
 
-	if (title) {
+	if (title && t->title_font)
+		run = glyph_font_get_run(t->title_font, title);
+
+	if (run) {
 		cairo_rectangle (cr, margin + t->width, margin,
 				 width - (margin + t->width) * 2,
 				 t->titlebar_height - t->width);
 		cairo_clip(cr);
 
 		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-		cairo_select_font_face(cr, "sans",
-				       CAIRO_FONT_SLANT_NORMAL,
-				       CAIRO_FONT_WEIGHT_BOLD);
-		cairo_set_font_size(cr, 14);
-		cairo_text_extents(cr, title, &extents);
-		cairo_font_extents (cr, &font_extents);
-		x = (width - extents.width) / 2;
+		glyph_font_get_extents(t->title_font, &font_extents);
+		x = (width - run->extents.width) / 2;
 		y = margin +
 			(t->titlebar_height -
 			 font_extents.ascent - font_extents.descent) / 2 +
 			font_extents.ascent;
 
 		if (flags & THEME_FRAME_ACTIVE) {
-			cairo_move_to(cr, x + 1, y  + 1);
 			cairo_set_source_rgb(cr, 1, 1, 1);
-			cairo_show_text(cr, title);
-			cairo_move_to(cr, x, y);
+			glyph_font_show(t->title_font, cr, run, x + 1, y + 1);
 			cairo_set_source_rgb(cr, 0, 0, 0);
-			cairo_show_text(cr, title);
+			glyph_font_show(t->title_font, cr, run, x, y);
 		} else {
-			cairo_move_to(cr, x, y);
 			cairo_set_source_rgb(cr, 0.4, 0.4, 0.4);
-			cairo_show_text(cr, title);
+			glyph_font_show(t->title_font, cr, run, x, y);
 		}
 	}
 }
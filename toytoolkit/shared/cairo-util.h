@@ -43,6 +43,8 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius);
 cairo_surface_t *
 load_cairo_surface(const char *filename);
 
+struct glyph_font;
+
 struct theme {
 	cairo_surface_t *active_frame;
 	cairo_surface_t *inactive_frame;
@@ -51,6 +53,7 @@ struct theme {
 	int margin;
 	int width;
 	int titlebar_height;
+	struct glyph_font *title_font;
 };
 
 struct theme *
@@ -61,7 +64,8 @@ theme_destroy(struct theme *t);
 enum {
 	THEME_FRAME_ACTIVE = 1,
 	THEME_FRAME_MAXIMIZED = 2,
-	THEME_FRAME_NO_TITLE = 4
+	THEME_FRAME_NO_TITLE = 4,
+	THEME_FRAME_NO_SHADOW = 8	/* keeps the margin, leaves it clear */
 };
 
 void
@@ -106,7 +110,8 @@ enum frame_status {
 
 enum frame_flag {
 	FRAME_FLAG_ACTIVE = 0x1,
-	FRAME_FLAG_MAXIMIZED = 0x2
+	FRAME_FLAG_MAXIMIZED = 0x2,
+	FRAME_FLAG_NO_SHADOW = 0x4
 };
 
 enum {
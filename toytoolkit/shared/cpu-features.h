@@ -0,0 +1,78 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#ifndef _CPU_FEATURES_H
+#define _CPU_FEATURES_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/*
+ * Runtime CPU feature detection for the few vectorized pixel loops.
+ * Setting TOYTOOLKIT_NO_SIMD in the environment forces the plain C
+ * paths, which produce the same output.
+ */
+
+enum cpu_feature {
+	CPU_FEATURE_SSE2 = 0x1,
+	CPU_FEATURE_NEON = 0x2,
+	CPU_FEATURE_SSSE3 = 0x4,
+	CPU_FEATURE_AVX2 = 0x8
+};
+
+static inline uint32_t
+cpu_features(void)
+{
+	static int detected;
+	static uint32_t features;
+
+	if (detected)
+		return features;
+	detected = 1;
+
+	if (getenv("TOYTOOLKIT_NO_SIMD"))
+		return features;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		features |= CPU_FEATURE_SSE2;
+	if (__builtin_cpu_supports("ssse3"))
+		features |= CPU_FEATURE_SSSE3;
+	if (__builtin_cpu_supports("avx2"))
+		features |= CPU_FEATURE_AVX2;
+#elif defined(__aarch64__)
+	features |= CPU_FEATURE_NEON;
+#elif defined(__arm__) && defined(__linux__) && defined(HWCAP_NEON)
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+		features |= CPU_FEATURE_NEON;
+#endif
+
+	return features;
+}
+
+#endif
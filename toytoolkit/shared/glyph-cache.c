@@ -0,0 +1,718 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+//#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cairo.h>
+
+#include "glyph-cache.h"
+#include "image-cache.h"
+
+#define GLYPH_ATLAS_MAGIC	0x41474c57	/* "WLGA" */
+#define GLYPH_ATLAS_VERSION	2
+#define GLYPH_ATLAS_WIDTH	512
+#define GLYPH_ATLAS_ALIGN	64
+
+/* Printable ASCII, then the printable half of Latin-1. */
+#define GLYPH_ATLAS_COUNT	(95 + 96)
+
+/* Atlas glyphs are numbered above any real glyph id, so that runs
+ * shaped by either source can be told apart when drawn. */
+#define GLYPH_ATLAS_INDEX	0x1000000ul
+
+struct glyph_atlas_header {
+	uint32_t magic;
+	uint32_t version;
+	char family[32];
+	uint32_t weight;
+	uint32_t count;
+	double size;
+	cairo_font_extents_t extents;
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+	uint32_t padding;
+	uint64_t offset;
+};
+
+/* A cell of the bitmap, where it goes relative to the pen, and the
+ * glyph it was rasterized from. */
+struct glyph_atlas_glyph {
+	int16_t x, y;
+	int16_t width, height;
+	int16_t left, top;
+	float advance;
+	uint32_t index;
+};
+
+struct glyph_cache_entry {
+	uint32_t hash;
+	uint32_t last_use;
+	char *text;
+	struct glyph_run *run;
+};
+
+struct glyph_font {
+	char family[32];
+	cairo_font_weight_t weight;
+	double size;
+
+	/* With an atlas, only created for text the atlas lacks. */
+	cairo_scaled_font_t *scaled_font;
+
+	void *atlas_data;
+	size_t atlas_size;
+	const struct glyph_atlas_glyph *atlas_glyphs;
+	cairo_font_extents_t atlas_extents;
+	cairo_surface_t *atlas;
+	cairo_surface_t *atlas_cells[GLYPH_ATLAS_COUNT];
+
+	uint32_t use_count;
+	struct glyph_cache_entry cache[GLYPH_RUN_CACHE_SIZE];
+};
+
+static int
+atlas_enabled(void)
+{
+	return getenv("WLMESSAGE_GLYPH_ATLAS") != NULL;
+}
+
+static int
+atlas_slot(uint32_t c)
+{
+	if (c >= 0x20 && c < 0x7f)
+		return c - 0x20;
+	if (c >= 0xa0 && c <= 0xff)
+		return c - 0xa0 + 95;
+
+	return -1;
+}
+
+static uint32_t
+atlas_char(int slot)
+{
+	return slot < 95 ? slot + 0x20 : slot - 95 + 0xa0;
+}
+
+/* Returns the length of the character at s, 0 if it is not one the
+ * atlas could hold. */
+static int
+utf8_decode(const unsigned char *s, int len, uint32_t *c)
+{
+	if (s[0] < 0x80) {
+		*c = s[0];
+		return 1;
+	}
+
+	if ((s[0] & 0xe0) == 0xc0 && len >= 2 && (s[1] & 0xc0) == 0x80) {
+		*c = (s[0] & 0x1f) << 6 | (s[1] & 0x3f);
+		return *c >= 0x80 ? 2 : 0;
+	}
+
+	return 0;
+}
+
+#define GLYPH_ATLAS_NAME_SIZE 64
+
+static void
+atlas_name(struct glyph_font *font, char *name)
+{
+	char *p;
+
+	snprintf(name, GLYPH_ATLAS_NAME_SIZE, "glyphs-%s-%d-%g",
+		 font->family, (int) font->weight, font->size);
+	for (p = name; *p; p++)
+		if (*p == '/' || *p == ' ')
+			*p = '_';
+}
+
+static cairo_scaled_font_t *
+glyph_font_get_scaled(struct glyph_font *font)
+{
+	cairo_font_face_t *face;
+	cairo_font_options_t *options;
+	cairo_matrix_t font_matrix, ctm;
+
+	if (font->scaled_font)
+		return font->scaled_font;
+
+	face = cairo_toy_font_face_create(font->family,
+					  CAIRO_FONT_SLANT_NORMAL,
+					  font->weight);
+	options = cairo_font_options_create();
+	cairo_matrix_init_scale(&font_matrix, font->size, font->size);
+	cairo_matrix_init_identity(&ctm);
+
+	font->scaled_font = cairo_scaled_font_create(face, &font_matrix,
+						     &ctm, options);
+	cairo_font_options_destroy(options);
+	cairo_font_face_destroy(face);
+
+	return font->scaled_font;
+}
+
+static int
+atlas_load(struct glyph_font *font)
+{
+	const struct glyph_atlas_header *header;
+	const struct glyph_atlas_glyph *glyphs;
+	struct stat st;
+	char name[GLYPH_ATLAS_NAME_SIZE], *path, *data;
+	size_t table_end;
+	int fd, i;
+
+	atlas_name(font, name);
+	path = image_cache_path(name);
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	table_end = sizeof *header + GLYPH_ATLAS_COUNT * sizeof *glyphs;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < table_end) {
+		close(fd);
+		return -1;
+	}
+
+	/* Same private mapping as the image cache. */
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+
+	header = (const struct glyph_atlas_header *) data;
+	glyphs = (const struct glyph_atlas_glyph *) (data + sizeof *header);
+
+	if (header->magic != GLYPH_ATLAS_MAGIC ||
+	    header->version != GLYPH_ATLAS_VERSION ||
+	    strncmp(header->family, font->family, sizeof font->family) != 0 ||
+	    header->weight != (uint32_t) font->weight ||
+	    header->size != font->size ||
+	    header->count != GLYPH_ATLAS_COUNT ||
+	    header->width <= 0 || header->height <= 0 ||
+	    header->stride != cairo_format_stride_for_width(CAIRO_FORMAT_A8,
+							    header->width) ||
+	    header->offset < table_end ||
+	    header->offset + (uint64_t) header->stride * header->height >
+	    (uint64_t) st.st_size)
+		goto err_unmap;
+
+	for (i = 0; i < GLYPH_ATLAS_COUNT; i++)
+		if (glyphs[i].x < 0 || glyphs[i].y < 0 ||
+		    glyphs[i].width < 0 || glyphs[i].height < 0 ||
+		    glyphs[i].x + glyphs[i].width > header->width ||
+		    glyphs[i].y + glyphs[i].height > header->height)
+			goto err_unmap;
+
+	font->atlas = cairo_image_surface_create_for_data(
+		(unsigned char *) data + header->offset, CAIRO_FORMAT_A8,
+		header->width, header->height, header->stride);
+	if (cairo_surface_status(font->atlas) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(font->atlas);
+		font->atlas = NULL;
+		goto err_unmap;
+	}
+
+	font->atlas_data = data;
+	font->atlas_size = st.st_size;
+	font->atlas_glyphs = glyphs;
+	font->atlas_extents = header->extents;
+
+	return 0;
+
+err_unmap:
+	munmap(data, st.st_size);
+	return -1;
+}
+
+/* Rasterizes the glyph set with the scaled font, one shelf-packed A8
+ * bitmap, and writes it where atlas_load() looks. */
+static int
+atlas_save(struct glyph_font *font)
+{
+	struct glyph_atlas_header header;
+	struct glyph_atlas_glyph glyphs[GLYPH_ATLAS_COUNT];
+	struct image_cache_chunk chunks[4];
+	cairo_scaled_font_t *scaled = font->scaled_font;
+	cairo_text_extents_t extents;
+	cairo_glyph_t *run, glyph;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	char text[2], name[GLYPH_ATLAS_NAME_SIZE];
+	int i, n, x, y, row, right, bottom, ret = -1;
+	uint32_t c;
+
+	memset(&header, 0, sizeof header);
+	memset(glyphs, 0, sizeof glyphs);
+
+	x = y = row = 0;
+	for (i = 0; i < GLYPH_ATLAS_COUNT; i++) {
+		c = atlas_char(i);
+		if (c < 0x80) {
+			text[0] = c;
+			n = 1;
+		} else {
+			text[0] = 0xc0 | c >> 6;
+			text[1] = 0x80 | (c & 0x3f);
+			n = 2;
+		}
+
+		run = NULL;
+		if (cairo_scaled_font_text_to_glyphs(scaled, 0, 0, text, n,
+						     &run, &n, NULL, NULL,
+						     NULL) !=
+		    CAIRO_STATUS_SUCCESS || n != 1) {
+			cairo_glyph_free(run);
+			continue;
+		}
+		glyphs[i].index = run[0].index;
+		cairo_scaled_font_glyph_extents(scaled, run, 1, &extents);
+		cairo_glyph_free(run);
+
+		glyphs[i].advance = extents.x_advance;
+		if (extents.width <= 0 || extents.height <= 0)
+			continue;
+
+		/* A pixel of room around the ink for antialiasing. */
+		glyphs[i].left = floor(extents.x_bearing) - 1;
+		glyphs[i].top = floor(extents.y_bearing) - 1;
+		right = ceil(extents.x_bearing + extents.width) + 1;
+		bottom = ceil(extents.y_bearing + extents.height) + 1;
+		glyphs[i].width = right - glyphs[i].left;
+		glyphs[i].height = bottom - glyphs[i].top;
+
+		if (x + glyphs[i].width > GLYPH_ATLAS_WIDTH) {
+			x = 0;
+			y += row;
+			row = 0;
+		}
+		glyphs[i].x = x;
+		glyphs[i].y = y;
+		x += glyphs[i].width;
+		if (glyphs[i].height > row)
+			row = glyphs[i].height;
+	}
+
+	header.magic = GLYPH_ATLAS_MAGIC;
+	header.version = GLYPH_ATLAS_VERSION;
+	snprintf(header.family, sizeof header.family, "%s", font->family);
+	header.weight = font->weight;
+	header.count = GLYPH_ATLAS_COUNT;
+	header.size = font->size;
+	cairo_scaled_font_extents(scaled, &header.extents);
+	header.width = GLYPH_ATLAS_WIDTH;
+	header.height = y + row > 0 ? y + row : 1;
+	header.stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8,
+						      header.width);
+	header.offset = (sizeof header + sizeof glyphs + GLYPH_ATLAS_ALIGN - 1) &
+		~(uint64_t) (GLYPH_ATLAS_ALIGN - 1);
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_A8,
+					     header.width, header.height);
+	cr = cairo_create(surface);
+	cairo_set_scaled_font(cr, scaled);
+	cairo_set_source_rgba(cr, 0, 0, 0, 1);
+	for (i = 0; i < GLYPH_ATLAS_COUNT; i++) {
+		if (glyphs[i].width == 0)
+			continue;
+
+		/* The pen sits on a whole pixel, as when drawing. */
+		glyph.index = glyphs[i].index;
+		glyph.x = glyphs[i].x - glyphs[i].left;
+		glyph.y = glyphs[i].y - glyphs[i].top;
+		cairo_save(cr);
+		cairo_rectangle(cr, glyphs[i].x, glyphs[i].y,
+				glyphs[i].width, glyphs[i].height);
+		cairo_clip(cr);
+		cairo_show_glyphs(cr, &glyph, 1);
+		cairo_restore(cr);
+	}
+	cairo_destroy(cr);
+	cairo_surface_flush(surface);
+
+	if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS) {
+		chunks[0] = (struct image_cache_chunk) { &header, sizeof header };
+		chunks[1] = (struct image_cache_chunk) { glyphs, sizeof glyphs };
+		chunks[2] = (struct image_cache_chunk) {
+			NULL, header.offset - sizeof header - sizeof glyphs
+		};
+		chunks[3] = (struct image_cache_chunk) {
+			cairo_image_surface_get_data(surface),
+			header.stride * header.height
+		};
+		atlas_name(font, name);
+		ret = image_cache_write(name, chunks, 4);
+	}
+
+	cairo_surface_destroy(surface);
+
+	return ret;
+}
+
+struct glyph_font *
+glyph_font_create(const char *family, cairo_font_weight_t weight,
+		  double size)
+{
+	struct glyph_font *font;
+
+	font = calloc(1, sizeof *font);
+	if (!font)
+		return NULL;
+
+	snprintf(font->family, sizeof font->family, "%s", family);
+	font->weight = weight;
+	font->size = size;
+
+	/* The atlas makes fontconfig unnecessary until some text needs
+	 * a glyph it does not have. */
+	if (atlas_enabled() && atlas_load(font) == 0)
+		return font;
+
+	if (cairo_scaled_font_status(glyph_font_get_scaled(font)) !=
+	    CAIRO_STATUS_SUCCESS) {
+		cairo_scaled_font_destroy(font->scaled_font);
+		free(font);
+		return NULL;
+	}
+
+	/* First run: generate the atlas, and draw from it right away so
+	 * that text looks the same as on later runs. */
+	if (atlas_enabled() && atlas_save(font) == 0)
+		atlas_load(font);
+
+	return font;
+}
+
+void
+glyph_font_destroy(struct glyph_font *font)
+{
+	int i;
+
+	for (i = 0; i < GLYPH_RUN_CACHE_SIZE; i++) {
+		if (!font->cache[i].run)
+			continue;
+		free(font->cache[i].text);
+		glyph_run_destroy(font->cache[i].run);
+	}
+
+	if (font->atlas) {
+		for (i = 0; i < GLYPH_ATLAS_COUNT; i++)
+			if (font->atlas_cells[i])
+				cairo_surface_destroy(font->atlas_cells[i]);
+		cairo_surface_destroy(font->atlas);
+		munmap(font->atlas_data, font->atlas_size);
+	}
+
+	if (font->scaled_font)
+		cairo_scaled_font_destroy(font->scaled_font);
+	free(font);
+}
+
+void
+glyph_font_get_extents(struct glyph_font *font,
+		       cairo_font_extents_t *extents)
+{
+	if (font->atlas)
+		*extents = font->atlas_extents;
+	else
+		cairo_scaled_font_extents(glyph_font_get_scaled(font), extents);
+}
+
+/* Shapes from the metrics table, one glyph per character, or returns
+ * -1 if some character is not in the atlas. */
+static int
+atlas_run_create(struct glyph_font *font, struct glyph_run *run,
+		 const char *text, int len)
+{
+	const struct glyph_atlas_glyph *g;
+	double x = 0, x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+	int pos, n, slot, inked = 0;
+	uint32_t c;
+
+	if (len < 0)
+		len = strlen(text);
+
+	run->glyphs = cairo_glyph_allocate(len > 0 ? len : 1);
+	if (!run->glyphs)
+		return -1;
+	run->num_glyphs = 0;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = utf8_decode((const unsigned char *) text + pos,
+				len - pos, &c);
+		slot = n ? atlas_slot(c) : -1;
+		if (slot < 0) {
+			cairo_glyph_free(run->glyphs);
+			run->glyphs = NULL;
+			return -1;
+		}
+
+		g = &font->atlas_glyphs[slot];
+		run->glyphs[run->num_glyphs].index = GLYPH_ATLAS_INDEX + slot;
+		run->glyphs[run->num_glyphs].x = x;
+		run->glyphs[run->num_glyphs].y = 0;
+		run->num_glyphs++;
+
+		if (g->width > 0) {
+			if (!inked || x + g->left < x1)
+				x1 = x + g->left;
+			if (!inked || g->top < y1)
+				y1 = g->top;
+			if (!inked || x + g->left + g->width > x2)
+				x2 = x + g->left + g->width;
+			if (!inked || g->top + g->height > y2)
+				y2 = g->top + g->height;
+			inked = 1;
+		}
+		x += g->advance;
+	}
+
+	memset(&run->extents, 0, sizeof run->extents);
+	run->extents.x_bearing = x1;
+	run->extents.y_bearing = y1;
+	run->extents.width = x2 - x1;
+	run->extents.height = y2 - y1;
+	run->extents.x_advance = x;
+
+	return 0;
+}
+
+struct glyph_run *
+glyph_run_create(struct glyph_font *font, const char *text, int len)
+{
+	struct glyph_run *run;
+	cairo_scaled_font_t *scaled;
+	cairo_status_t status;
+
+	run = calloc(1, sizeof *run);
+	if (!run)
+		return NULL;
+
+	if (font->atlas && atlas_run_create(font, run, text, len) == 0)
+		return run;
+
+	scaled = glyph_font_get_scaled(font);
+	status = cairo_scaled_font_text_to_glyphs(scaled, 0, 0,
+						  text, len,
+						  &run->glyphs,
+						  &run->num_glyphs,
+						  NULL, NULL, NULL);
+	if (status != CAIRO_STATUS_SUCCESS) {
+		/* Invalid UTF-8, draw nothing rather than fail. */
+		run->glyphs = NULL;
+		run->num_glyphs = 0;
+	}
+
+	cairo_scaled_font_glyph_extents(scaled, run->glyphs,
+					run->num_glyphs, &run->extents);
+
+	return run;
+}
+
+void
+glyph_run_destroy(struct glyph_run *run)
+{
+	cairo_glyph_free(run->glyphs);
+	free(run);
+}
+
+static uint32_t
+hash_string(const char *text)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*text)
+		hash = (hash ^ (unsigned char) *text++) * 16777619u;
+
+	return hash;
+}
+
+const struct glyph_run *
+glyph_font_get_run(struct glyph_font *font, const char *text)
+{
+	struct glyph_cache_entry *entry, *lru = NULL;
+	struct glyph_run *run;
+	uint32_t hash = hash_string(text);
+	char *copy;
+	int i;
+
+	font->use_count++;
+
+	for (i = 0; i < GLYPH_RUN_CACHE_SIZE; i++) {
+		entry = &font->cache[i];
+		if (entry->run && entry->hash == hash &&
+		    strcmp(entry->text, text) == 0) {
+			entry->last_use = font->use_count;
+			return entry->run;
+		}
+
+		if (!lru || !entry->run ||
+		    (lru->run &&
+		     font->use_count - entry->last_use >
+		     font->use_count - lru->last_use))
+			lru = entry;
+	}
+
+	run = glyph_run_create(font, text, -1);
+	copy = strdup(text);
+	if (!run || !copy) {
+		if (run)
+			glyph_run_destroy(run);
+		free(copy);
+		return NULL;
+	}
+
+	if (lru->run) {
+		free(lru->text);
+		glyph_run_destroy(lru->run);
+	}
+
+	lru->hash = hash;
+	lru->last_use = font->use_count;
+	lru->text = copy;
+	lru->run = run;
+
+	return run;
+}
+
+/* Atlas cells only stay sharp when masked 1:1 with the device. */
+static int
+atlas_can_mask(cairo_t *cr)
+{
+	cairo_matrix_t matrix;
+
+	cairo_get_matrix(cr, &matrix);
+
+	return matrix.xx == 1 && matrix.yy == 1 &&
+		matrix.xy == 0 && matrix.yx == 0;
+}
+
+static void
+atlas_show(struct glyph_font *font, cairo_t *cr,
+	   const cairo_glyph_t *glyph, double x, double y)
+{
+	const struct glyph_atlas_glyph *g;
+	int slot = glyph->index - GLYPH_ATLAS_INDEX;
+	double dx, dy;
+
+	g = &font->atlas_glyphs[slot];
+	if (g->width == 0)
+		return;
+
+	if (!font->atlas_cells[slot])
+		font->atlas_cells[slot] =
+			cairo_surface_create_for_rectangle(font->atlas,
+							   g->x, g->y,
+							   g->width, g->height);
+
+	/* Whole device pixels, or the cell would get resampled. */
+	dx = x + glyph->x;
+	dy = y + glyph->y;
+	cairo_user_to_device(cr, &dx, &dy);
+	dx = round(dx);
+	dy = round(dy);
+	cairo_device_to_user(cr, &dx, &dy);
+
+	cairo_mask_surface(cr, font->atlas_cells[slot],
+			   dx + g->left, dy + g->top);
+}
+
+/* Draws glyphs with the scaled font, atlas glyphs included. */
+static void
+scaled_show(struct glyph_font *font, cairo_t *cr,
+	    const cairo_glyph_t *glyphs, int num_glyphs, double x, double y)
+{
+	cairo_scaled_font_t *scaled;
+	cairo_glyph_t *real = NULL;
+	int i;
+
+	/* A broken scaled font would put cr in an error state. */
+	scaled = glyph_font_get_scaled(font);
+	if (cairo_scaled_font_status(scaled) != CAIRO_STATUS_SUCCESS)
+		return;
+
+	if (font->atlas) {
+		real = cairo_glyph_allocate(num_glyphs);
+		if (!real)
+			return;
+		for (i = 0; i < num_glyphs; i++) {
+			real[i] = glyphs[i];
+			if (glyphs[i].index >= GLYPH_ATLAS_INDEX)
+				real[i].index = font->atlas_glyphs[
+					glyphs[i].index - GLYPH_ATLAS_INDEX].index;
+		}
+		glyphs = real;
+	}
+
+	cairo_save(cr);
+	cairo_set_scaled_font(cr, scaled);
+	cairo_translate(cr, x, y);
+	cairo_show_glyphs(cr, glyphs, num_glyphs);
+	cairo_restore(cr);
+
+	cairo_glyph_free(real);
+}
+
+void
+glyph_font_show(struct glyph_font *font, cairo_t *cr,
+		const struct glyph_run *run, double x, double y)
+{
+	int i, start;
+
+	if (!run || run->num_glyphs == 0)
+		return;
+
+	/* Scaled or transformed, as at buffer scale 2: the atlas was
+	 * rasterized for 1:1 only. */
+	if (!font->atlas || !atlas_can_mask(cr)) {
+		scaled_show(font, cr, run->glyphs, run->num_glyphs, x, y);
+		return;
+	}
+
+	for (i = 0; i < run->num_glyphs; ) {
+		if (run->glyphs[i].index >= GLYPH_ATLAS_INDEX) {
+			atlas_show(font, cr, &run->glyphs[i], x, y);
+			i++;
+			continue;
+		}
+
+		/* A stretch shaped by the scaled font, as in entries that
+		 * mix both. */
+		for (start = i; i < run->num_glyphs &&
+		     run->glyphs[i].index < GLYPH_ATLAS_INDEX; i++)
+			;
+		scaled_show(font, cr, run->glyphs + start, i - start, x, y);
+	}
+}
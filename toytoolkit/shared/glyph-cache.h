@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef _GLYPH_CACHE_H
+#define _GLYPH_CACHE_H
+
+#include <cairo.h>
+
+/*
+ * A font resolved once into a cairo_scaled_font_t, with a small cache
+ * of shaped strings.  Text then goes through cairo_show_glyphs() and
+ * neither fontconfig nor the scaled font lookup run per draw.
+ *
+ * With WLMESSAGE_GLYPH_ATLAS set, the first run also rasterizes
+ * printable ASCII and Latin-1 into an A8 atlas under
+ * $XDG_CACHE_HOME/wlmessage/.  Later runs map it and draw glyphs as
+ * masks, so fontconfig is only loaded for text outside that set or
+ * drawn under a scaling transform.
+ */
+
+#define GLYPH_RUN_CACHE_SIZE 64
+
+struct glyph_font;
+
+/* Glyph positions are relative to the origin of the first glyph. */
+struct glyph_run {
+	cairo_glyph_t *glyphs;
+	int num_glyphs;
+	cairo_text_extents_t extents;
+};
+
+struct glyph_font *
+glyph_font_create(const char *family, cairo_font_weight_t weight,
+		  double size);
+void
+glyph_font_destroy(struct glyph_font *font);
+
+void
+glyph_font_get_extents(struct glyph_font *font,
+		       cairo_font_extents_t *extents);
+
+/* Shapes len bytes of UTF-8 text, -1 for all of it, into a run owned
+ * by the caller. */
+struct glyph_run *
+glyph_run_create(struct glyph_font *font, const char *text, int len);
+void
+glyph_run_destroy(struct glyph_run *run);
+
+/* Cached version of glyph_run_create() for strings drawn again and
+ * again.  The run belongs to the font and stays valid for at least the
+ * next GLYPH_RUN_CACHE_SIZE - 1 lookups. */
+const struct glyph_run *
+glyph_font_get_run(struct glyph_font *font, const char *text);
+
+/* Draws run with its origin at (x, y), with the current source. */
+void
+glyph_font_show(struct glyph_font *font, cairo_t *cr,
+		const struct glyph_run *run, double x, double y);
+
+#endif
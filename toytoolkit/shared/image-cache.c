@@ -0,0 +1,346 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+//#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cairo.h>
+
+#include "image-cache.h"
+
+#define IMAGE_CACHE_MAGIC	0x434d4c57	/* "WLMC" */
+#define IMAGE_CACHE_VERSION	1
+#define IMAGE_CACHE_ALIGN	64
+
+struct image_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t key_size;
+	uint32_t count;
+};
+
+struct image_cache_entry {
+	uint32_t format;
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+	uint64_t offset;
+};
+
+struct image_cache_mapping {
+	void *data;
+	size_t size;
+	int refcount;
+};
+
+static const cairo_user_data_key_t mapping_key;
+
+static size_t
+align(size_t offset)
+{
+	return (offset + IMAGE_CACHE_ALIGN - 1) & ~(size_t) (IMAGE_CACHE_ALIGN - 1);
+}
+
+static int
+ensure_dir(const char *path)
+{
+	if (mkdir(path, 0700) == 0 || errno == EEXIST)
+		return 0;
+
+	return -1;
+}
+
+char *
+image_cache_path(const char *name)
+{
+	const char *cache_home, *home;
+	char *base, *dir, *path;
+
+	cache_home = getenv("XDG_CACHE_HOME");
+	if (cache_home && cache_home[0] == '/') {
+		base = strdup(cache_home);
+	} else {
+		home = getenv("HOME");
+		if (!home || asprintf(&base, "%s/.cache", home) < 0)
+			return NULL;
+	}
+	if (!base)
+		return NULL;
+
+	if (ensure_dir(base) < 0 || asprintf(&dir, "%s/wlmessage", base) < 0) {
+		free(base);
+		return NULL;
+	}
+	free(base);
+
+	if (ensure_dir(dir) < 0 || asprintf(&path, "%s/%s", dir, name) < 0)
+		path = NULL;
+	free(dir);
+
+	return path;
+}
+
+static void
+mapping_unref(void *data)
+{
+	struct image_cache_mapping *mapping = data;
+
+	if (--mapping->refcount > 0)
+		return;
+
+	munmap(mapping->data, mapping->size);
+	free(mapping);
+}
+
+int
+image_cache_load(const char *name, const void *key, size_t key_size,
+		 cairo_surface_t **surfaces, int count)
+{
+	struct image_cache_header *header;
+	struct image_cache_entry *entries;
+	struct image_cache_mapping *mapping;
+	struct stat st;
+	char *path, *data;
+	size_t table_end;
+	int fd, i;
+
+	path = image_cache_path(name);
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	table_end = sizeof *header + key_size + count * sizeof *entries;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < table_end) {
+		close(fd);
+		return -1;
+	}
+
+	/* Private writable mapping: cairo only reads these, but a stray
+	 * draw must never reach the file. */
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+
+	header = (struct image_cache_header *) data;
+	entries = (struct image_cache_entry *)
+		(data + sizeof *header + key_size);
+
+	if (header->magic != IMAGE_CACHE_MAGIC ||
+	    header->version != IMAGE_CACHE_VERSION ||
+	    header->key_size != key_size ||
+	    header->count != (uint32_t) count ||
+	    memcmp(data + sizeof *header, key, key_size) != 0)
+		goto err_unmap;
+
+	for (i = 0; i < count; i++) {
+		if (entries[i].format != CAIRO_FORMAT_ARGB32 ||
+		    entries[i].width <= 0 || entries[i].height <= 0 ||
+		    entries[i].stride !=
+		    cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32,
+						  entries[i].width) ||
+		    entries[i].offset < table_end ||
+		    entries[i].offset % IMAGE_CACHE_ALIGN ||
+		    entries[i].offset + (uint64_t) entries[i].stride *
+		    entries[i].height > (uint64_t) st.st_size)
+			goto err_unmap;
+	}
+
+	mapping = malloc(sizeof *mapping);
+	if (!mapping)
+		goto err_unmap;
+	mapping->data = data;
+	mapping->size = st.st_size;
+	mapping->refcount = 1;
+
+	for (i = 0; i < count; i++) {
+		surfaces[i] = cairo_image_surface_create_for_data(
+			(unsigned char *) data + entries[i].offset,
+			CAIRO_FORMAT_ARGB32,
+			entries[i].width, entries[i].height,
+			entries[i].stride);
+		mapping->refcount++;
+		if (cairo_surface_set_user_data(surfaces[i], &mapping_key,
+						mapping, mapping_unref) !=
+		    CAIRO_STATUS_SUCCESS) {
+			mapping->refcount--;
+			cairo_surface_destroy(surfaces[i]);
+			while (i--)
+				cairo_surface_destroy(surfaces[i]);
+			mapping_unref(mapping);
+			return -1;
+		}
+	}
+
+	mapping_unref(mapping);
+
+	return 0;
+
+err_unmap:
+	munmap(data, st.st_size);
+	return -1;
+}
+
+static int
+write_all(int fd, const void *data, size_t size)
+{
+	static const char zeros[IMAGE_CACHE_ALIGN];
+	const char *p = data;
+	size_t length;
+	ssize_t ret;
+
+	while (size > 0) {
+		/* NULL stands for zeros, used as padding */
+		length = size;
+		if (!data && length > sizeof zeros)
+			length = sizeof zeros;
+
+		ret = write(fd, data ? p : zeros, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+int
+image_cache_write(const char *name, const struct image_cache_chunk *chunks,
+		  int count)
+{
+	char *path, *tmp;
+	int fd, i, ret = -1;
+
+	path = image_cache_path(name);
+	if (!path)
+		return -1;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		free(path);
+		return -1;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	for (i = 0; i < count; i++)
+		if (write_all(fd, chunks[i].data, chunks[i].size) < 0)
+			goto out_close;
+
+	/* Readers only ever see a complete file. */
+	if (rename(tmp, path) == 0)
+		ret = 0;
+
+out_close:
+	close(fd);
+	if (ret < 0)
+		unlink(tmp);
+out:
+	free(tmp);
+	free(path);
+
+	return ret;
+}
+
+int
+image_cache_save(const char *name, const void *key, size_t key_size,
+		 cairo_surface_t **surfaces, int count)
+{
+	struct image_cache_header header;
+	struct image_cache_entry *entries;
+	struct image_cache_chunk *chunks;
+	size_t offset, written;
+	int i, n, ret;
+
+	for (i = 0; i < count; i++)
+		if (cairo_image_surface_get_format(surfaces[i]) !=
+		    CAIRO_FORMAT_ARGB32)
+			return -1;
+
+	entries = calloc(count, sizeof *entries);
+	chunks = calloc(3 + 2 * count, sizeof *chunks);
+	if (!entries || !chunks) {
+		free(entries);
+		free(chunks);
+		return -1;
+	}
+
+	header.magic = IMAGE_CACHE_MAGIC;
+	header.version = IMAGE_CACHE_VERSION;
+	header.key_size = key_size;
+	header.count = count;
+
+	offset = align(sizeof header + key_size + count * sizeof *entries);
+	for (i = 0; i < count; i++) {
+		entries[i].format = CAIRO_FORMAT_ARGB32;
+		entries[i].width = cairo_image_surface_get_width(surfaces[i]);
+		entries[i].height = cairo_image_surface_get_height(surfaces[i]);
+		entries[i].stride = cairo_image_surface_get_stride(surfaces[i]);
+		entries[i].offset = offset;
+		offset = align(offset + entries[i].stride * entries[i].height);
+	}
+
+	n = 0;
+	chunks[n++] = (struct image_cache_chunk) { &header, sizeof header };
+	chunks[n++] = (struct image_cache_chunk) { key, key_size };
+	chunks[n++] = (struct image_cache_chunk) {
+		entries, count * sizeof *entries
+	};
+
+	written = sizeof header + key_size + count * sizeof *entries;
+	for (i = 0; i < count; i++) {
+		chunks[n++] = (struct image_cache_chunk) {
+			NULL, entries[i].offset - written
+		};
+
+		cairo_surface_flush(surfaces[i]);
+		chunks[n++] = (struct image_cache_chunk) {
+			cairo_image_surface_get_data(surfaces[i]),
+			entries[i].stride * entries[i].height
+		};
+		written = entries[i].offset +
+			entries[i].stride * entries[i].height;
+	}
+
+	ret = image_cache_write(name, chunks, n);
+
+	free(chunks);
+	free(entries);
+
+	return ret;
+}
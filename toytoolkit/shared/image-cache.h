@@ -0,0 +1,63 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#ifndef _IMAGE_CACHE_H
+#define _IMAGE_CACHE_H
+
+#include <stddef.h>
+#include <cairo.h>
+
+/*
+ * Versioned on-disk cache of ARGB32 images, stored under
+ * $XDG_CACHE_HOME/wlmessage/.  A cache file holds a caller-defined key
+ * and a few images; loading maps the file and wraps the pixels with
+ * cairo_image_surface_create_for_data(), so nothing gets decoded or
+ * rendered.  The mapping lives until the last of its surfaces is
+ * destroyed.
+ */
+
+/* Caller frees the result, NULL if there is no usable cache directory. */
+char *
+image_cache_path(const char *name);
+
+/* Returns 0 and fills "surfaces" if "name" exists and matches "key". */
+int
+image_cache_load(const char *name, const void *key, size_t key_size,
+		 cairo_surface_t **surfaces, int count);
+
+/* A piece of a cache file; NULL data makes size bytes of zeros. */
+struct image_cache_chunk {
+	const void *data;
+	size_t size;
+};
+
+/* Writes the chunks one after the other to "name", replacing it
+ * atomically, for other caches sharing the directory. */
+int
+image_cache_write(const char *name, const struct image_cache_chunk *chunks,
+		  int count);
+
+int
+image_cache_save(const char *name, const void *key, size_t key_size,
+		 cairo_surface_t **surfaces, int count);
+
+#endif
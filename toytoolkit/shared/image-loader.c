@@ -31,6 +31,7 @@
 #include <pixman.h>
 
 #include "image-loader.h"
+#include "cpu-features.h"
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
 
@@ -44,14 +45,41 @@ stride_for_width(int width)
 	return width * 4;
 }
 
+/*
+ * Pixel conversions.  JPEG rows are expanded in place from RGB to
+ * opaque a8r8g8b8, and PNG rows are premultiplied from RGBA to
+ * a8r8g8b8.  The vector kernels handle 4 or 8 pixels per iteration
+ * with the same integer arithmetic and leave the remaining pixels to
+ * the plain C loops, so all paths give bit-identical results.  They
+ * write the pixels as little-endian words, like the C loops do there.
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__x86_64__) || defined(__i386__)
+#define IMAGE_LOADER_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IMAGE_LOADER_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+typedef void (*swizzle_func_t)(JSAMPLE *row, JDIMENSION width);
+typedef void (*premultiply_func_t)(uint8_t *p, unsigned int n);
+
+/* Expand pixels 0..n-1.  The row is walked backwards, so each source
+ * pixel is read before a destination pixel overwrites it. */
 static void
-swizzle_row(JSAMPLE *row, JDIMENSION width)
+swizzle_pixels_c(JSAMPLE *row, unsigned int n)
 {
 	JSAMPLE *s;
 	uint32_t *d;
 
-	s = row + (width - 1) * 3;
-	d = (uint32_t *) (row + (width - 1) * 4);
+	if (n == 0)
+		return;
+
+	s = row + (n - 1) * 3;
+	d = (uint32_t *) (row + (n - 1) * 4);
 	while (s >= row) {
 		*d = 0xff000000 | (s[0] << 16) | (s[1] << 8) | (s[2] << 0);
 		s -= 3;
@@ -59,6 +87,107 @@ swizzle_row(JSAMPLE *row, JDIMENSION width)
 	}
 }
 
+static void
+swizzle_row_c(JSAMPLE *row, JDIMENSION width)
+{
+	swizzle_pixels_c(row, width);
+}
+
+#ifdef IMAGE_LOADER_X86
+/* Vector blocks are also walked backwards.  A block loads a few bytes
+ * past its own source pixels, which are still unwritten source bytes
+ * or the unused end of the row. */
+__attribute__((target("ssse3")))
+static void
+swizzle_row_ssse3(JSAMPLE *row, JDIMENSION width)
+{
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+					      8, 7, 6, -1, 11, 10, 9, -1);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	unsigned int i, n = width & ~3;
+	__m128i v;
+
+	/* the blocks write over the source of the trailing pixels, so
+	 * those are expanded first, into their own place */
+	if (n < width) {
+		memmove(row + n * 4, row + n * 3, (width - n) * 3);
+		swizzle_pixels_c(row + n * 4, width - n);
+	}
+
+	for (i = n; i > 0; i -= 4) {
+		v = _mm_loadu_si128((const __m128i *) (row + (i - 4) * 3));
+		v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+		_mm_storeu_si128((__m128i *) (row + (i - 4) * 4), v);
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+swizzle_row_avx2(JSAMPLE *row, JDIMENSION width)
+{
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+						 8, 7, 6, -1, 11, 10, 9, -1,
+						 2, 1, 0, -1, 5, 4, 3, -1,
+						 8, 7, 6, -1, 11, 10, 9, -1);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	unsigned int i, n = width & ~7;
+	__m256i v;
+
+	if (n < width) {
+		memmove(row + n * 4, row + n * 3, (width - n) * 3);
+		swizzle_pixels_c(row + n * 4, width - n);
+	}
+
+	for (i = n; i > 0; i -= 8) {
+		v = _mm256_loadu_si256((const __m256i *) (row + (i - 8) * 3));
+		v = _mm256_permutevar8x32_epi32(v, lanes);
+		v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+		_mm256_storeu_si256((__m256i *) (row + (i - 8) * 4), v);
+	}
+}
+#endif
+
+#ifdef IMAGE_LOADER_NEON
+static void
+swizzle_row_neon(JSAMPLE *row, JDIMENSION width)
+{
+	unsigned int i, n = width & ~7;
+	uint8x8x3_t rgb;
+	uint8x8x4_t bgra;
+
+	if (n < width) {
+		memmove(row + n * 4, row + n * 3, (width - n) * 3);
+		swizzle_pixels_c(row + n * 4, width - n);
+	}
+
+	bgra.val[3] = vdup_n_u8(0xff);
+	for (i = n; i > 0; i -= 8) {
+		rgb = vld3_u8(row + (i - 8) * 3);
+		bgra.val[0] = rgb.val[2];
+		bgra.val[1] = rgb.val[1];
+		bgra.val[2] = rgb.val[0];
+		vst4_u8(row + (i - 8) * 4, bgra);
+	}
+}
+#endif
+
+static swizzle_func_t
+swizzle_select(void)
+{
+#ifdef IMAGE_LOADER_X86
+	if (cpu_features() & CPU_FEATURE_AVX2)
+		return swizzle_row_avx2;
+	if (cpu_features() & CPU_FEATURE_SSSE3)
+		return swizzle_row_ssse3;
+#endif
+#ifdef IMAGE_LOADER_NEON
+	if (cpu_features() & CPU_FEATURE_NEON)
+		return swizzle_row_neon;
+#endif
+	return swizzle_row_c;
+}
+
 static void
 error_exit(j_common_ptr cinfo)
 {
@@ -80,6 +209,7 @@ load_jpeg(FILE *fp)
 	unsigned int i;
 	int stride, first;
 	JSAMPLE *data, *rows[4];
+	swizzle_func_t swizzle;
 	jmp_buf env;
 
 	cinfo.err = jpeg_std_error(&jerr);
@@ -104,6 +234,7 @@ load_jpeg(FILE *fp)
 		return NULL;
 	}
 
+	swizzle = swizzle_select();
 	while (cinfo.output_scanline < cinfo.output_height) {
 		first = cinfo.output_scanline;
 		for (i = 0; i < ARRAY_LENGTH(rows); i++)
@@ -111,7 +242,7 @@ load_jpeg(FILE *fp)
 
 		jpeg_read_scanlines(&cinfo, rows, ARRAY_LENGTH(rows));
 		for (i = 0; first + i < cinfo.output_scanline; i++)
-			swizzle_row(rows[i], cinfo.output_width);
+			swizzle(rows[i], cinfo.output_width);
 	}
 
 	jpeg_finish_decompress(&cinfo);
@@ -138,14 +269,11 @@ multiply_alpha(int alpha, int color)
 }
 
 static void
-premultiply_data(png_structp   png,
-		 png_row_infop row_info,
-		 png_bytep     data)
+premultiply_pixels_c(uint8_t *p, unsigned int n)
 {
     unsigned int i;
-    png_bytep p;
 
-    for (i = 0, p = data; i < row_info->rowbytes; i += 4, p += 4) {
+    for (i = 0; i < n; i++, p += 4) {
 	png_byte  alpha = p[3];
 	uint32_t w;
 
@@ -168,6 +296,142 @@ premultiply_data(png_structp   png,
     }
 }
 
+/* The vector kernels multiply every channel, alpha by 255, which
+ * multiply_alpha() leaves unchanged, as it leaves any color unchanged
+ * by an alpha of 255 and maps it to 0 by an alpha of 0. */
+#ifdef IMAGE_LOADER_X86
+/* Two pixels as 16-bit channels: premultiply, then swap red and blue. */
+__attribute__((target("sse2")))
+static inline __m128i
+premultiply_epi16_sse2(__m128i v)
+{
+	const __m128i alpha_lanes = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+	const __m128i round = _mm_set1_epi16(0x80);
+	__m128i a, t;
+
+	a = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_or_si128(_mm_andnot_si128(alpha_lanes, a), alpha_lanes);
+
+	t = _mm_add_epi16(_mm_mullo_epi16(v, a), round);
+	t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+	t = _mm_shufflelo_epi16(t, _MM_SHUFFLE(3, 0, 1, 2));
+	return _mm_shufflehi_epi16(t, _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+__attribute__((target("sse2")))
+static void
+premultiply_pixels_sse2(uint8_t *p, unsigned int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int i;
+	__m128i v, lo, hi;
+
+	for (i = 0; i + 4 <= n; i += 4, p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+		lo = premultiply_epi16_sse2(_mm_unpacklo_epi8(v, zero));
+		hi = premultiply_epi16_sse2(_mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128((__m128i *) p, _mm_packus_epi16(lo, hi));
+	}
+
+	premultiply_pixels_c(p, n - i);
+}
+
+/* The same on four pixels, two per 128-bit lane. */
+__attribute__((target("avx2")))
+static inline __m256i
+premultiply_epi16_avx2(__m256i v)
+{
+	const __m256i alpha_lanes = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255,
+						      0, 0, 0, 255, 0, 0, 0, 255);
+	const __m256i round = _mm256_set1_epi16(0x80);
+	__m256i a, t;
+
+	a = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_or_si256(_mm256_andnot_si256(alpha_lanes, a), alpha_lanes);
+
+	t = _mm256_add_epi16(_mm256_mullo_epi16(v, a), round);
+	t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+
+	t = _mm256_shufflelo_epi16(t, _MM_SHUFFLE(3, 0, 1, 2));
+	return _mm256_shufflehi_epi16(t, _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+__attribute__((target("avx2")))
+static void
+premultiply_pixels_avx2(uint8_t *p, unsigned int n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int i;
+	__m256i v, lo, hi;
+
+	for (i = 0; i + 8 <= n; i += 8, p += 32) {
+		v = _mm256_loadu_si256((const __m256i *) p);
+		lo = premultiply_epi16_avx2(_mm256_unpacklo_epi8(v, zero));
+		hi = premultiply_epi16_avx2(_mm256_unpackhi_epi8(v, zero));
+		_mm256_storeu_si256((__m256i *) p, _mm256_packus_epi16(lo, hi));
+	}
+
+	premultiply_pixels_c(p, n - i);
+}
+#endif
+
+#ifdef IMAGE_LOADER_NEON
+static inline uint8x8_t
+premultiply_u8_neon(uint8x8_t color, uint8x8_t alpha)
+{
+	uint16x8_t t;
+
+	t = vaddq_u16(vmull_u8(color, alpha), vdupq_n_u16(0x80));
+	return vshrn_n_u16(vsraq_n_u16(t, t, 8), 8);
+}
+
+static void
+premultiply_pixels_neon(uint8_t *p, unsigned int n)
+{
+	unsigned int i;
+	uint8x8x4_t rgba, bgra;
+
+	for (i = 0; i + 8 <= n; i += 8, p += 32) {
+		rgba = vld4_u8(p);
+		bgra.val[0] = premultiply_u8_neon(rgba.val[2], rgba.val[3]);
+		bgra.val[1] = premultiply_u8_neon(rgba.val[1], rgba.val[3]);
+		bgra.val[2] = premultiply_u8_neon(rgba.val[0], rgba.val[3]);
+		bgra.val[3] = rgba.val[3];
+		vst4_u8(p, bgra);
+	}
+
+	premultiply_pixels_c(p, n - i);
+}
+#endif
+
+static premultiply_func_t
+premultiply_select(void)
+{
+#ifdef IMAGE_LOADER_X86
+	if (cpu_features() & CPU_FEATURE_AVX2)
+		return premultiply_pixels_avx2;
+	if (cpu_features() & CPU_FEATURE_SSE2)
+		return premultiply_pixels_sse2;
+#endif
+#ifdef IMAGE_LOADER_NEON
+	if (cpu_features() & CPU_FEATURE_NEON)
+		return premultiply_pixels_neon;
+#endif
+	return premultiply_pixels_c;
+}
+
+/* libpng transform callback, only used for interlaced images */
+static void
+premultiply_data(png_structp   png,
+		 png_row_infop row_info,
+		 png_bytep     data)
+{
+	premultiply_select()(data, row_info->rowbytes / 4);
+}
+
 static void
 read_func(png_structp png, png_bytep data, png_size_t size)
 {
@@ -190,6 +454,7 @@ load_png(FILE *fp)
 	png_info *info;
 	png_byte *data = NULL;
 	png_byte **row_pointers = NULL;
+	premultiply_func_t premultiply;
 	png_uint_32 width, height;
 	int depth, color_type, interlace, stride;
 	unsigned int i;
@@ -244,7 +509,13 @@ load_png(FILE *fp)
 		png_set_interlace_handling(png);
 
 	png_set_filler(png, 0xff, PNG_FILLER_AFTER);
-	png_set_read_user_transform_fn(png, premultiply_data);
+
+	/* Interlaced images are assembled over several passes, and each
+	 * pass is premultiplied by libpng before it is spread into the
+	 * rows.  Other rows are read straight into the image and
+	 * premultiplied there, while they are still in the cache. */
+	if (interlace != PNG_INTERLACE_NONE)
+		png_set_read_user_transform_fn(png, premultiply_data);
 	png_read_update_info(png, info);
 	png_get_IHDR(png, info,
 		     &width, &height, &depth,
@@ -258,20 +529,30 @@ load_png(FILE *fp)
 		return NULL;
 	}
 
-	row_pointers = malloc(height * sizeof row_pointers[0]);
-	if (row_pointers == NULL) {
-		free(data);
-		png_destroy_read_struct(&png, &info, NULL);
-		return NULL;
-	}
+	if (interlace != PNG_INTERLACE_NONE) {
+		row_pointers = malloc(height * sizeof row_pointers[0]);
+		if (row_pointers == NULL) {
+			free(data);
+			png_destroy_read_struct(&png, &info, NULL);
+			return NULL;
+		}
+
+		for (i = 0; i < height; i++)
+			row_pointers[i] = &data[i * stride];
 
-	for (i = 0; i < height; i++)
-		row_pointers[i] = &data[i * stride];
+		png_read_image(png, row_pointers);
+		free(row_pointers);
+		row_pointers = NULL;
+	} else {
+		premultiply = premultiply_select();
+		for (i = 0; i < height; i++) {
+			png_read_row(png, &data[i * stride], NULL);
+			premultiply(&data[i * stride], width);
+		}
+	}
 
-	png_read_image(png, row_pointers);
 	png_read_end(png, info);
 
-	free(row_pointers);
 	png_destroy_read_struct(&png, &info, NULL);
 
 	pixman_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
@@ -0,0 +1,117 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+
+//#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+
+int stats_enabled;
+struct stats stats;
+
+static int stats_fd = -1;
+
+static unsigned long long
+us(uint64_t ns)
+{
+	return ns / 1000;
+}
+
+static void
+stats_dump(void)
+{
+	int i;
+
+	dprintf(stats_fd, "stats: display_create_us=%llu connect_us=%llu "
+		"registry_us=%llu theme_join_us=%llu first_commit_us=%llu "
+		"first_frame_us=%llu frames=%u throttled=%u commits=%u "
+		"shm_pools=%u shm_bytes=%llu buffers_held_peak=%d keys=%u "
+		"key_avg_us=%llu key_max_us=%llu key_ms=",
+		us(stats.display_create), us(stats.connect),
+		us(stats.registry), us(stats.theme_join),
+		us(stats.first_commit), us(stats.first_frame),
+		stats.frames, stats.throttled, stats.commits,
+		stats.shm_pools, (unsigned long long) stats.shm_bytes,
+		stats.buffers_held_peak, stats.keys,
+		stats.keys ? us(stats.key_latency / stats.keys) : 0,
+		us(stats.key_latency_max));
+
+	for (i = 0; i < STATS_KEY_BUCKETS; i++)
+		dprintf(stats_fd, "%s%u", i ? "," : "", stats.key_buckets[i]);
+	dprintf(stats_fd, "\n");
+}
+
+int
+stats_open(int fd)
+{
+	if (stats_enabled || fd < 0)
+		return -1;
+
+	stats_fd = fd;
+	atexit(stats_dump);
+	stats_enabled = 1;
+
+	return 0;
+}
+
+uint64_t
+stats_time(void)
+{
+	struct timespec ts;
+
+	if (!stats_enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_record_commit(void)
+{
+	uint64_t now = stats_time(), latency;
+	int i;
+
+	if (!stats.first_commit)
+		stats.first_commit = now - stats.start;
+
+	if (!stats.key_pending)
+		return;
+
+	latency = now - stats.key_pending;
+	stats.key_pending = 0;
+	stats.keys++;
+	stats.key_latency += latency;
+	if (latency > stats.key_latency_max)
+		stats.key_latency_max = latency;
+
+	for (i = 0; i < STATS_KEY_BUCKETS - 1; i++)
+		if (latency < (1000000ull << i))
+			break;
+	stats.key_buckets[i]++;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Counters of the startup phases, frames, buffers and input latency,
+ * written on exit as one line of key=value pairs so that they can be
+ * collected from many devices.  Counting is always on; only the
+ * timings, which need a clock read, wait for stats_open().
+ */
+
+#include <stdint.h>
+
+/* Key press latency buckets: under 1, 2, 4 ... 64 ms, then the rest. */
+#define STATS_KEY_BUCKETS 8
+
+struct stats {
+	/* Durations in ns, summed over display_create() calls. */
+	uint64_t display_create;
+	uint64_t connect;
+	uint64_t registry;
+	uint64_t theme_join;
+
+	/* In ns since the first display_create(). */
+	uint64_t start;
+	uint64_t first_commit;
+	uint64_t first_frame;
+
+	uint32_t frames;		/* surface redraws */
+	uint32_t throttled;		/* redraws left for the frame callback */
+	uint32_t commits;
+	uint32_t shm_pools;
+	uint64_t shm_bytes;		/* pool sizes, growth included */
+	int32_t buffers_held;		/* shm buffers the compositor holds */
+	int32_t buffers_held_peak;
+
+	/* From a key press that schedules a redraw to the next commit. */
+	uint32_t keys;
+	uint64_t key_pressed;		/* the press being handled */
+	uint64_t key_pending;
+	uint64_t key_latency;
+	uint64_t key_latency_max;
+	uint32_t key_buckets[STATS_KEY_BUCKETS];
+};
+
+extern int stats_enabled;
+extern struct stats stats;
+
+/* Starts timing; the summary goes to fd when the process exits.
+ * Returns -1 if it is already open. */
+int
+stats_open(int fd);
+
+/* CLOCK_MONOTONIC in ns, 0 while stats are off. */
+uint64_t
+stats_time(void);
+
+void
+stats_record_commit(void);
+
+static inline void
+stats_phase(uint64_t *phase, uint64_t since)
+{
+	if (stats_enabled)
+		*phase += stats_time() - since;
+}
+
+static inline void
+stats_commit(void)
+{
+	stats.commits++;
+	if (stats_enabled)
+		stats_record_commit();
+}
+
+static inline void
+stats_frame_done(void)
+{
+	if (stats_enabled && !stats.first_frame)
+		stats.first_frame = stats_time() - stats.start;
+}
+
+/* Brackets the handling of a key press.  Only a press that schedules a
+ * redraw meanwhile is timed, and only the first of several before a
+ * commit. */
+static inline void
+stats_key_press(void)
+{
+	stats.key_pressed = stats_time();
+}
+
+static inline void
+stats_key_done(void)
+{
+	stats.key_pressed = 0;
+}
+
+static inline void
+stats_redraw_scheduled(void)
+{
+	if (stats.key_pressed && !stats.key_pending)
+		stats.key_pending = stats.key_pressed;
+}
+
+static inline void
+stats_buffer_held(int delta)
+{
+	stats.buffers_held += delta;
+	if (stats.buffers_held > stats.buffers_held_peak)
+		stats.buffers_held_peak = stats.buffers_held;
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+
+//#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/* A power of two, about 2 MB of events. */
+#define TRACE_EVENTS 65536
+
+struct trace_event {
+	uint64_t time;			/* CLOCK_MONOTONIC, in ns */
+	const char *name;
+	int64_t value;
+	int tid;
+	char phase;
+};
+
+int trace_enabled;
+
+static struct trace_event *trace_events;
+static unsigned int trace_next;
+static char *trace_filename;
+static __thread int trace_tid;
+
+static void
+trace_dump(void)
+{
+	struct trace_event *event;
+	unsigned int first, last, i;
+	const char *sep = "";
+	FILE *out;
+	int pid;
+
+	trace_enabled = 0;
+
+	out = fopen(trace_filename, "w");
+	if (!out) {
+		fprintf(stderr, "could not write the trace to %s: %m\n",
+			trace_filename);
+		return;
+	}
+
+	/* Past a full ring, the oldest event is the next to go. */
+	last = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+	first = last > TRACE_EVENTS ? last - TRACE_EVENTS : 0;
+	pid = getpid();
+
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (i = first; i != last; i++) {
+		event = &trace_events[i & (TRACE_EVENTS - 1)];
+		if (!event->name)
+			continue;
+
+		fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\","
+			"\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+			sep, event->name, event->phase,
+			(unsigned long long) (event->time / 1000),
+			(unsigned int) (event->time % 1000),
+			pid, event->tid);
+		if (event->phase == 'i')
+			fprintf(out, ",\"s\":\"t\"");
+		if (event->phase != 'B')
+			fprintf(out, ",\"args\":{\"value\":%lld}",
+				(long long) event->value);
+		fprintf(out, "}");
+		sep = ",";
+	}
+	fprintf(out, "\n]}\n");
+
+	if (fclose(out) != 0)
+		fprintf(stderr, "could not write the trace to %s: %m\n",
+			trace_filename);
+}
+
+int
+trace_open(const char *filename)
+{
+	if (trace_events)
+		return -1;
+
+	trace_events = calloc(TRACE_EVENTS, sizeof *trace_events);
+	trace_filename = strdup(filename);
+	if (!trace_events || !trace_filename) {
+		free(trace_events);
+		free(trace_filename);
+		trace_events = NULL;
+		trace_filename = NULL;
+		return -1;
+	}
+
+	atexit(trace_dump);
+	trace_enabled = 1;
+
+	return 0;
+}
+
+void
+trace_record(const char *name, char phase, int64_t value)
+{
+	struct trace_event *event;
+	struct timespec ts;
+	unsigned int slot;
+
+	if (!trace_tid)
+		trace_tid = syscall(SYS_gettid);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	/* Threads never share a slot; a full ring overwrites the
+	 * oldest events. */
+	slot = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+	event = &trace_events[slot & (TRACE_EVENTS - 1)];
+	event->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	event->value = value;
+	event->tid = trace_tid;
+	event->phase = phase;
+	__atomic_store_n(&event->name, name, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Records timestamped events into a fixed ring buffer, cheap enough
+ * to leave in release builds: a disabled recorder costs one test, an
+ * enabled one an atomic increment and a clock read.  The last
+ * TRACE_EVENTS events are written on exit in the Chrome trace event
+ * format, for chrome://tracing or Perfetto.  Names must be string
+ * literals; they are stored as pointers and written unescaped.
+ */
+
+#include <stdint.h>
+
+extern int trace_enabled;
+
+/* Starts recording; the trace goes to filename when the process
+ * exits.  Returns -1 if it is already recording. */
+int
+trace_open(const char *filename);
+
+void
+trace_record(const char *name, char phase, int64_t value);
+
+static inline void
+trace_begin(const char *name)
+{
+	if (trace_enabled)
+		trace_record(name, 'B', 0);
+}
+
+/* value shows in the arguments of the span. */
+static inline void
+trace_end(const char *name, int64_t value)
+{
+	if (trace_enabled)
+		trace_record(name, 'E', value);
+}
+
+static inline void
+trace_instant(const char *name, int64_t value)
+{
+	if (trace_enabled)
+		trace_record(name, 'i', value);
+}
+
+#endif
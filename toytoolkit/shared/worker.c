@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+//#include "config.h"
+
+#include <pthread.h>
+
+#include "worker.h"
+
+static void *
+worker_thread(void *data)
+{
+	struct worker *worker = data;
+
+	worker->result = worker->func(worker->data);
+
+	return NULL;
+}
+
+void
+worker_run(struct worker *worker, void *(*func)(void *data), void *data)
+{
+	worker->func = func;
+	worker->data = data;
+	worker->result = NULL;
+	worker->threaded =
+		pthread_create(&worker->thread, NULL, worker_thread, worker) == 0;
+
+	if (!worker->threaded)
+		worker->result = func(data);
+}
+
+void *
+worker_join(struct worker *worker)
+{
+	if (worker->threaded)
+		pthread_join(worker->thread, NULL);
+	worker->threaded = 0;
+
+	return worker->result;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright © 2014 Manuel Bachmann
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef _WORKER_H
+#define _WORKER_H
+
+/*
+ * Runs a CPU-bound startup step on its own thread while the caller
+ * keeps talking to the compositor.  There is no pool to manage: each
+ * step gets a thread that ends with it, and the caller joins it right
+ * before it needs the result.  If no thread can be started the step
+ * runs synchronously, so callers never need a fallback path.
+ */
+
+#include <pthread.h>
+
+struct worker {
+	pthread_t thread;
+	int threaded;
+	void *(*func)(void *data);
+	void *data;
+	void *result;
+};
+
+void
+worker_run(struct worker *worker, void *(*func)(void *data), void *data);
+
+/* Waits for the step and returns its result. */
+void *
+worker_join(struct worker *worker);
+
+#endif
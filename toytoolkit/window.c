@@ -68,6 +68,10 @@ typedef void *EGLContext;
 #include "text-cursor-position-client-protocol.h"
 #include "workspaces-client-protocol.h"
 #include "./shared/os-compatibility.h"
+#include "./shared/glyph-cache.h"
+#include "./shared/worker.h"
+#include "./shared/trace.h"
+#include "./shared/stats.h"
 
 #include "window.h"
 
@@ -80,10 +84,26 @@ struct global {
 	struct wl_list link;
 };
 
+struct display_font {
+	char *family;
+	cairo_font_weight_t weight;
+	double size;
+	struct glyph_font *font;
+	struct wl_list link;
+};
+
+struct buffer_stats {
+	uint32_t frames;	/* buffers prepared for drawing */
+	uint32_t grown;		/* times every buffer was busy, one added */
+	uint32_t deferred;	/* times the cap was hit, redraw deferred */
+};
+
 struct display {
 	struct wl_display *display;
 	struct wl_registry *registry;
 	struct wl_compositor *compositor;
+	uint32_t compositor_version;
+	struct wl_list font_list;
 	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
 	struct wl_data_device_manager *data_device_manager;
@@ -104,7 +124,8 @@ struct display {
 	struct wl_list deferred_list;
 
 	int timeout;
-	struct timeval time;
+	int timeout_fd;
+	struct task timeout_task;
 
 	int running;
 
@@ -114,9 +135,14 @@ struct display {
 	struct wl_list output_list;
 
 	struct theme *theme;
+	struct worker theme_worker;
+
+	struct wl_list shm_pool_list;
+	size_t shm_pool_hint;	/* bytes for a buffer of the largest output */
 
 	struct wl_cursor_theme *cursor_theme;
 	struct wl_cursor **cursors;
+	uint32_t cursors_loaded;	/* bitmask of looked-up cursors[] */
 
 	display_output_handler_t output_configure_handler;
 	display_global_handler_t global_handler;
@@ -135,6 +161,13 @@ struct display {
 
 	int has_rgb565;
 	int seat_version;
+
+	enum display_renderer renderer;
+	int egl_tried;			/* EGL is set up on first use */
+
+	int max_buffers;
+	struct buffer_stats buffer_stats;	/* of destroyed surfaces */
+	int low_memory;
 };
 
 struct window_output {
@@ -156,15 +189,32 @@ struct toysurface {
 				    int32_t width, int32_t height, uint32_t flags,
 				    enum wl_output_transform buffer_transform, int32_t buffer_scale);
 
+	/*
+	 * Return the region of the buffer from prepare() that has to be
+	 * repainted for a frame with the given damage, or NULL if all of
+	 * it must be.  damage is in surface coordinates, NULL meaning
+	 * everything.  The caller destroys the returned region.
+	 */
+	cairo_region_t *(*get_repaint)(struct toysurface *base,
+				       cairo_region_t *damage);
+
 	/*
 	 * Post the surface to the server, returning the server allocation
-	 * rectangle. The Cairo surface from prepare() must be destroyed
-	 * after calling this.
+	 * rectangle. Only damage (surface coordinates, NULL meaning
+	 * everything) is reported as changed. The Cairo surface from
+	 * prepare() must be destroyed after calling this.
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     cairo_region_t *damage,
 		     struct rectangle *server_allocation);
 
+	/*
+	 * Return the wl_buffer the last swap() attached, for other
+	 * surfaces to show as well, or NULL if it cannot be shared.
+	 */
+	struct wl_buffer *(*get_buffer)(struct toysurface *base);
+
 	/*
 	 * Make the toysurface current with the given EGL context.
 	 * Returns 0 on success, and negative of failure.
@@ -182,6 +232,12 @@ struct toysurface {
 	 * backing storage, and the Wayland protocol objects.
 	 */
 	void (*destroy)(struct toysurface *base);
+
+	/*
+	 * Set while prepare() fails only because the server still holds
+	 * every buffer; the window is redrawn when one is released.
+	 */
+	int blocked;
 };
 
 struct surface {
@@ -200,6 +256,14 @@ struct surface {
 	struct rectangle allocation;
 	struct rectangle server_allocation;
 
+	/* Damage collected for the next frame, surface coordinates. */
+	cairo_region_t *damage;
+	int damage_all;
+	/* Damage of the frame being drawn, NULL meaning everything. */
+	cairo_region_t *frame_damage;
+	/* Part of the current buffer redrawn for it, NULL meaning all. */
+	cairo_region_t *repaint;
+
 	struct wl_region *input_region;
 	struct wl_region *opaque_region;
 
@@ -248,6 +312,13 @@ struct window {
 
 	struct window *transient_for;
 
+	/* See window_set_mirror(); mirror_synced is set while the
+	 * window shows the buffers of mirror_source. */
+	struct window *mirror_source;
+	struct wl_list mirror_list;
+	struct wl_list mirror_link;
+	int mirror_synced;
+
 	struct window_frame *frame;
 
 	/* struct surface::link, contains also main_surface */
@@ -334,6 +405,8 @@ struct input {
 		xkb_mod_mask_t alt_mask;
 		xkb_mod_mask_t shift_mask;
 	} xkb;
+	struct worker keymap_worker;
+	int keymap_pending;
 
 	struct task repeat_task;
 	int repeat_timer_fd;
@@ -361,6 +434,14 @@ struct window_frame {
 	struct widget *widget;
 	struct widget *child;
 	struct frame *frame;
+	int focused;
+	int resizing;
+
+	/* The decorations as last rendered, in buffer pixels.  Dropped
+	 * whenever the frame asks for a repaint (size, title, buttons,
+	 * maximized state) or the focus or scale changes. */
+	cairo_surface_t *cache;
+	int32_t cache_width, cache_height, cache_scale;
 };
 
 struct menu {
@@ -387,10 +468,24 @@ struct tooltip {
 };
 
 struct shm_pool {
+	struct display *display;
 	struct wl_shm_pool *pool;
-	size_t size;
-	size_t used;
+	int fd;
+	size_t size;		/* of the file and the wl_shm_pool */
+	size_t reserved;	/* of the mapping */
+	size_t used;		/* end of the last block */
 	void *data;
+	struct wl_list block_list;	/* ordered by offset */
+	int live;		/* blocks handed out */
+	struct wl_list link;
+};
+
+struct shm_block {
+	struct shm_pool *pool;
+	size_t offset;
+	size_t size;
+	int free;
+	struct wl_list link;
 };
 
 enum {
@@ -519,14 +614,32 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 	return cairo_surface_reference(surface->cairo_surface);
 }
 
+static cairo_region_t *
+egl_window_surface_get_repaint(struct toysurface *base,
+			       cairo_region_t *damage)
+{
+	/* Buffer contents are undefined after a swap. */
+	return NULL;
+}
+
+static struct wl_buffer *
+egl_window_surface_get_buffer(struct toysurface *base)
+{
+	/* EGL keeps its buffers to itself. */
+	return NULL;
+}
+
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			cairo_region_t *damage,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
 
 	cairo_gl_surface_swapbuffers(surface->cairo_surface);
+	trace_instant("commit", wl_proxy_get_id((struct wl_proxy *) surface->surface));
+	stats_commit();
 	wl_egl_window_get_attached_size(surface->egl_window,
 					&server_allocation->width,
 					&server_allocation->height);
@@ -593,6 +706,9 @@ egl_window_surface_destroy(struct toysurface *base)
 	free(surface);
 }
 
+static int
+display_init_egl(struct display *d);
+
 static struct toysurface *
 egl_window_surface_create(struct display *display,
 			  struct wl_surface *wl_surface,
@@ -601,7 +717,7 @@ egl_window_surface_create(struct display *display,
 {
 	struct egl_window_surface *surface;
 
-	if (display->dpy == EGL_NO_DISPLAY)
+	if (display_init_egl(display) < 0)
 		return NULL;
 
 	surface = calloc(1, sizeof *surface);
@@ -609,7 +725,9 @@ egl_window_surface_create(struct display *display,
 		return NULL;
 
 	surface->base.prepare = egl_window_surface_prepare;
+	surface->base.get_repaint = egl_window_surface_get_repaint;
 	surface->base.swap = egl_window_surface_swap;
+	surface->base.get_buffer = egl_window_surface_get_buffer;
 	surface->base.acquire = egl_window_surface_acquire;
 	surface->base.release = egl_window_surface_release;
 	surface->base.destroy = egl_window_surface_destroy;
@@ -650,7 +768,7 @@ egl_window_surface_create(struct display *display,
 
 struct shm_surface_data {
 	struct wl_buffer *buffer;
-	struct shm_pool *pool;
+	struct shm_block *block;
 };
 
 struct wl_buffer *
@@ -664,122 +782,277 @@ display_get_buffer_for_surface(struct display *display,
 	return data->buffer;
 }
 
-static void
-shm_pool_destroy(struct shm_pool *pool);
+/*
+ * All shm buffers of a display are carved out of a few shared pools.
+ * Each pool maps a large virtual range up front and only grows the
+ * file behind it, so growing never moves buffers that are already
+ * handed out and the compositor just sees a wl_shm_pool.resize.
+ * Block sizes are rounded to a small set of classes so that buffers
+ * released during an interactive resize are reused for the next
+ * sizes instead of fragmenting the pool.
+ */
 
-static void
-shm_surface_data_destroy(void *p)
+/* address space reserved per pool; only what is used gets backed */
+#define SHM_POOL_RESERVE (64 * 1024 * 1024)
+#define SHM_POOL_MIN_SIZE (1024 * 1024)
+#define SHM_BLOCK_MIN_SIZE (64 * 1024)
+
+static size_t
+shm_size_class(size_t size)
 {
-	struct shm_surface_data *data = p;
+	size_t step = SHM_BLOCK_MIN_SIZE;
 
-	wl_buffer_destroy(data->buffer);
-	if (data->pool)
-		shm_pool_destroy(data->pool);
+	/* four classes per power of two, so at most 25% is wasted */
+	while (step * 8 <= size)
+		step *= 2;
 
-	free(data);
+	return (size + step - 1) / step * step;
 }
 
-static struct wl_shm_pool *
-make_shm_pool(struct display *display, int size, void **data)
+static struct shm_pool *
+shm_pool_create(struct display *display, size_t size, uint32_t flags)
 {
-	struct wl_shm_pool *pool;
-	int fd;
-
-	fd = os_create_anonymous_file(size);
-	if (fd < 0) {
-		fprintf(stderr, "creating a buffer file for %d B failed: %m\n",
+	struct shm_pool *pool;
+	size_t reserved;
+
+	pool = xzalloc(sizeof *pool);
+	pool->display = display;
+
+	trace_instant("shm_pool_create", size);
+
+	if (size < SHM_POOL_MIN_SIZE)
+		size = SHM_POOL_MIN_SIZE;
+	/* The first pool fits the buffer asked for.  Pools added while
+	 * resizing, or because the others are full, get room for a
+	 * full-screen buffer so that they are not replaced as the window
+	 * keeps growing. */
+	if (!display->low_memory &&
+	    ((flags & SURFACE_HINT_RESIZE) ||
+	     !wl_list_empty(&display->shm_pool_list)) &&
+	    size < display->shm_pool_hint)
+		size = display->shm_pool_hint;
+	size = shm_size_class(size);
+
+	reserved = SHM_POOL_RESERVE;
+	if (reserved < 4 * size)
+		reserved = 4 * size;
+
+	pool->fd = os_create_anonymous_file(size);
+	if (pool->fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %m\n",
 			size);
+		free(pool);
 		return NULL;
 	}
 
-	*data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (*data == MAP_FAILED) {
+	pool->data = mmap(NULL, reserved, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, pool->fd, 0);
+	if (pool->data == MAP_FAILED) {
+		/* no room to grow, map just what we have */
+		reserved = size;
+		pool->data = mmap(NULL, reserved, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, pool->fd, 0);
+	}
+	if (pool->data == MAP_FAILED) {
 		fprintf(stderr, "mmap failed: %m\n");
-		close(fd);
+		close(pool->fd);
+		free(pool);
 		return NULL;
 	}
 
-	pool = wl_shm_create_pool(display->shm, fd, size);
-
-	close(fd);
+	pool->pool = wl_shm_create_pool(display->shm, pool->fd, size);
+	pool->size = size;
+	stats.shm_pools++;
+	stats.shm_bytes += size;
+	pool->reserved = reserved;
+	wl_list_init(&pool->block_list);
+	wl_list_insert(&display->shm_pool_list, &pool->link);
 
 	return pool;
 }
 
-static struct shm_pool *
-shm_pool_create(struct display *display, size_t size)
+static void
+shm_pool_destroy(struct shm_pool *pool)
 {
-	struct shm_pool *pool = malloc(sizeof *pool);
+	struct shm_block *block, *tmp;
 
-	if (!pool)
-		return NULL;
+	wl_list_for_each_safe(block, tmp, &pool->block_list, link)
+		free(block);
 
-	pool->pool = make_shm_pool(display, size, &pool->data);
-	if (!pool->pool) {
-		free(pool);
-		return NULL;
-	}
+	wl_list_remove(&pool->link);
+	munmap(pool->data, pool->reserved);
+	wl_shm_pool_destroy(pool->pool);
+	close(pool->fd);
+	free(pool);
+}
 
-	pool->size = size;
-	pool->used = 0;
+static int
+shm_pool_grow(struct shm_pool *pool, size_t size)
+{
+	size_t new_size;
 
-	return pool;
+	if (size > pool->reserved)
+		return -1;
+
+	new_size = pool->size * 2;
+	if (new_size > pool->reserved)
+		new_size = pool->reserved;
+	if (new_size < size)
+		new_size = size;
+
+#ifdef HAVE_POSIX_FALLOCATE
+	if (posix_fallocate(pool->fd, pool->size, new_size - pool->size) != 0)
+		return -1;
+#else
+	if (ftruncate(pool->fd, new_size) < 0)
+		return -1;
+#endif
+
+	wl_shm_pool_resize(pool->pool, new_size);
+	stats.shm_bytes += new_size - pool->size;
+	pool->size = new_size;
+
+	return 0;
 }
 
-static void *
-shm_pool_allocate(struct shm_pool *pool, size_t size, int *offset)
+static struct shm_block *
+shm_pool_alloc(struct shm_pool *pool, size_t size)
 {
-	if (pool->used + size > pool->size)
+	struct shm_block *block, *rest;
+
+	/* first fit among the released blocks */
+	wl_list_for_each(block, &pool->block_list, link) {
+		if (!block->free || block->size < size)
+			continue;
+
+		if (block->size > size) {
+			rest = xzalloc(sizeof *rest);
+			rest->pool = pool;
+			rest->offset = block->offset + size;
+			rest->size = block->size - size;
+			rest->free = 1;
+			wl_list_insert(&block->link, &rest->link);
+			block->size = size;
+		}
+
+		goto out;
+	}
+
+	if (pool->used + size > pool->size &&
+	    shm_pool_grow(pool, pool->used + size) < 0)
 		return NULL;
 
-	*offset = pool->used;
+	block = xzalloc(sizeof *block);
+	block->pool = pool;
+	block->offset = pool->used;
+	block->size = size;
+	wl_list_insert(pool->block_list.prev, &block->link);
 	pool->used += size;
 
-	return (char *) pool->data + *offset;
+out:
+	block->free = 0;
+	pool->live++;
+
+	return block;
 }
 
-/* destroy the pool. this does not unmap the memory though */
 static void
-shm_pool_destroy(struct shm_pool *pool)
+shm_block_merge(struct shm_block *block, struct shm_block *next)
 {
-	munmap(pool->data, pool->size);
-	wl_shm_pool_destroy(pool->pool);
-	free(pool);
+	block->size += next->size;
+	wl_list_remove(&next->link);
+	free(next);
 }
 
-/* Start allocating from the beginning of the pool again */
 static void
-shm_pool_reset(struct shm_pool *pool)
+shm_block_free(struct shm_block *block)
 {
-	pool->used = 0;
+	struct shm_pool *pool = block->pool;
+	struct shm_block *prev, *next;
+
+	block->free = 1;
+	pool->live--;
+
+	if (block->link.next != &pool->block_list) {
+		next = container_of(block->link.next, struct shm_block, link);
+		if (next->free)
+			shm_block_merge(block, next);
+	}
+
+	if (block->link.prev != &pool->block_list) {
+		prev = container_of(block->link.prev, struct shm_block, link);
+		if (prev->free) {
+			shm_block_merge(prev, block);
+			block = prev;
+		}
+	}
+
+	/* a free tail goes back to the pool's unused space */
+	if (block->link.next == &pool->block_list) {
+		pool->used = block->offset;
+		wl_list_remove(&block->link);
+		free(block);
+	}
+
+	/* an idle pool is dropped, as long as another one remains */
+	if (pool->live == 0 && pool->link.next != pool->link.prev)
+		shm_pool_destroy(pool);
 }
 
-static int
-data_length_for_shm_surface(struct rectangle *rect)
+static struct shm_block *
+display_alloc_shm_block(struct display *display, size_t size, uint32_t flags)
+{
+	struct shm_pool *pool;
+	struct shm_block *block;
+
+	size = shm_size_class(size);
+
+	wl_list_for_each(pool, &display->shm_pool_list, link) {
+		block = shm_pool_alloc(pool, size);
+		if (block)
+			return block;
+	}
+
+	pool = shm_pool_create(display, size, flags);
+	if (!pool)
+		return NULL;
+
+	return shm_pool_alloc(pool, size);
+}
+
+static void
+display_destroy_shm_pools(struct display *display)
+{
+	struct shm_pool *pool, *tmp;
+
+	wl_list_for_each_safe(pool, tmp, &display->shm_pool_list, link)
+		shm_pool_destroy(pool);
+}
+
+static void
+shm_surface_data_destroy(void *p)
 {
-	int stride;
+	struct shm_surface_data *data = p;
+
+	wl_buffer_destroy(data->buffer);
+	shm_block_free(data->block);
 
-	stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32,
-						rect->width);
-	return stride * rect->height;
+	free(data);
 }
 
 static cairo_surface_t *
-display_create_shm_surface_from_pool(struct display *display,
-				     struct rectangle *rectangle,
-				     uint32_t flags, struct shm_pool *pool)
+display_create_shm_surface(struct display *display,
+			   struct rectangle *rectangle, uint32_t flags,
+			   struct shm_surface_data **data_ret)
 {
 	struct shm_surface_data *data;
+	struct shm_block *block;
 	uint32_t format;
 	cairo_surface_t *surface;
 	cairo_format_t cairo_format;
-	int stride, length, offset;
+	int stride, length;
 	void *map;
 
-	data = malloc(sizeof *data);
-	if (data == NULL)
-		return NULL;
-
 	if (flags & SURFACE_HINT_RGB565 && display->has_rgb565)
 		cairo_format = CAIRO_FORMAT_RGB16_565;
 	else
@@ -787,13 +1060,14 @@ display_create_shm_surface_from_pool(struct display *display,
 
 	stride = cairo_format_stride_for_width (cairo_format, rectangle->width);
 	length = stride * rectangle->height;
-	data->pool = NULL;
-	map = shm_pool_allocate(pool, length, &offset);
 
-	if (!map) {
-		free(data);
+	block = display_alloc_shm_block(display, length, flags);
+	if (!block)
 		return NULL;
-	}
+
+	data = xmalloc(sizeof *data);
+	data->block = block;
+	map = (char *) block->pool->data + block->offset;
 
 	surface = cairo_image_surface_create_for_data (map,
 						       cairo_format,
@@ -813,56 +1087,12 @@ display_create_shm_surface_from_pool(struct display *display,
 			format = WL_SHM_FORMAT_ARGB8888;
 	}
 
-	data->buffer = wl_shm_pool_create_buffer(pool->pool, offset,
+	data->buffer = wl_shm_pool_create_buffer(block->pool->pool,
+						 block->offset,
 						 rectangle->width,
 						 rectangle->height,
 						 stride, format);
 
-	return surface;
-}
-
-static cairo_surface_t *
-display_create_shm_surface(struct display *display,
-			   struct rectangle *rectangle, uint32_t flags,
-			   struct shm_pool *alternate_pool,
-			   struct shm_surface_data **data_ret)
-{
-	struct shm_surface_data *data;
-	struct shm_pool *pool;
-	cairo_surface_t *surface;
-
-	if (alternate_pool) {
-		shm_pool_reset(alternate_pool);
-		surface = display_create_shm_surface_from_pool(display,
-							       rectangle,
-							       flags,
-							       alternate_pool);
-		if (surface) {
-			data = cairo_surface_get_user_data(surface,
-							   &shm_surface_data_key);
-			goto out;
-		}
-	}
-
-	pool = shm_pool_create(display,
-			       data_length_for_shm_surface(rectangle));
-	if (!pool)
-		return NULL;
-
-	surface =
-		display_create_shm_surface_from_pool(display, rectangle,
-						     flags, pool);
-
-	if (!surface) {
-		shm_pool_destroy(pool);
-		return NULL;
-	}
-
-	/* make sure we destroy the pool when the surface is destroyed */
-	data = cairo_surface_get_user_data(surface, &shm_surface_data_key);
-	data->pool = pool;
-
-out:
 	if (data_ret)
 		*data_ret = data;
 
@@ -890,8 +1120,7 @@ display_create_surface(struct display *display,
 		return NULL;
 
 	assert(flags & SURFACE_SHM);
-	return display_create_shm_surface(display, rectangle, flags,
-					  NULL, NULL);
+	return display_create_shm_surface(display, rectangle, flags, NULL);
 }
 
 struct shm_surface_leaf {
@@ -899,8 +1128,11 @@ struct shm_surface_leaf {
 	/* 'data' is automatically destroyed, when 'cairo_surface' is */
 	struct shm_surface_data *data;
 
-	struct shm_pool *resize_pool;
 	int busy;
+
+	/* Parts changed since this buffer was last drawn, NULL when its
+	 * contents are entirely out of date. */
+	cairo_region_t *stale;
 };
 
 static void
@@ -910,13 +1142,17 @@ shm_surface_leaf_release(struct shm_surface_leaf *leaf)
 		cairo_surface_destroy(leaf->cairo_surface);
 	/* leaf->data already destroyed via cairo private */
 
-	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
+	if (leaf->stale)
+		cairo_region_destroy(leaf->stale);
 
 	memset(leaf, 0, sizeof *leaf);
 }
 
-#define MAX_LEAVES 3
+/* Surfaces start double buffered and add a buffer whenever the server
+ * holds all of them, up to display->max_buffers. */
+#define MIN_LEAVES 2
+#define MAX_LEAVES 8
+#define DEFAULT_MAX_LEAVES 4
 
 struct shm_surface {
 	struct toysurface base;
@@ -926,7 +1162,11 @@ struct shm_surface {
 	int dx, dy;
 
 	struct shm_surface_leaf leaf[MAX_LEAVES];
+	int leaves_nb;
 	struct shm_surface_leaf *current;
+	struct shm_surface_leaf *attached;
+
+	struct buffer_stats stats;
 };
 
 static struct shm_surface *
@@ -943,7 +1183,7 @@ shm_surface_buffer_state_debug(struct shm_surface *surface, const char *msg)
 	char bufs[MAX_LEAVES + 1];
 	int i;
 
-	for (i = 0; i < MAX_LEAVES; i++) {
+	for (i = 0; i < surface->leaves_nb; i++) {
 		leaf = &surface->leaf[i];
 
 		if (leaf->busy)
@@ -954,11 +1194,14 @@ shm_surface_buffer_state_debug(struct shm_surface *surface, const char *msg)
 			bufs[i] = ' ';
 	}
 
-	bufs[MAX_LEAVES] = '\0';
+	bufs[surface->leaves_nb] = '\0';
 	DBG_OBJ(surface->surface, "%s, leaves [%s]\n", msg, bufs);
 #endif
 }
 
+static void
+window_schedule_redraw_task(struct window *window);
+
 static void
 shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 {
@@ -969,18 +1212,19 @@ shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 
 	shm_surface_buffer_state_debug(surface, "buffer_release before");
 
-	for (i = 0; i < MAX_LEAVES; i++) {
+	for (i = 0; i < surface->leaves_nb; i++) {
 		leaf = &surface->leaf[i];
 		if (leaf->data && leaf->data->buffer == buffer) {
 			leaf->busy = 0;
+			stats_buffer_held(-1);
 			break;
 		}
 	}
-	assert(i < MAX_LEAVES && "unknown buffer released");
+	assert(i < surface->leaves_nb && "unknown buffer released");
 
 	/* Leave one free leaf with storage, release others */
 	free_found = 0;
-	for (i = 0; i < MAX_LEAVES; i++) {
+	for (i = 0; i < surface->leaves_nb; i++) {
 		leaf = &surface->leaf[i];
 
 		if (!leaf->cairo_surface || leaf->busy)
@@ -993,6 +1237,12 @@ shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 	}
 
 	shm_surface_buffer_state_debug(surface, "buffer_release  after");
+
+	if (surface->base.blocked) {
+		surface->base.blocked = 0;
+		window_schedule_redraw_task(
+			wl_surface_get_user_data(surface->surface));
+	}
 }
 
 static const struct wl_buffer_listener shm_surface_buffer_listener = {
@@ -1004,17 +1254,20 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		    int32_t width, int32_t height, uint32_t flags,
 		    enum wl_output_transform buffer_transform, int32_t buffer_scale)
 {
-	int resize_hint = !!(flags & SURFACE_HINT_RESIZE);
 	struct shm_surface *surface = to_shm_surface(base);
 	struct rectangle rect = { 0};
 	struct shm_surface_leaf *leaf = NULL;
 	int i;
 
+	/* Ends with 1 for a new buffer, 0 for a reused one, -1 for
+	 * none. */
+	trace_begin("shm_surface_prepare");
+
 	surface->dx = dx;
 	surface->dy = dy;
 
 	/* pick a free buffer, preferrably one that already has storage */
-	for (i = 0; i < MAX_LEAVES; i++) {
+	for (i = 0; i < surface->leaves_nb; i++) {
 		if (surface->leaf[i].busy)
 			continue;
 
@@ -1024,56 +1277,60 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	DBG_OBJ(surface->surface, "pick leaf %d\n",
 		(int)(leaf - &surface->leaf[0]));
 
+	if (!leaf && surface->leaves_nb < surface->display->max_buffers) {
+		leaf = &surface->leaf[surface->leaves_nb++];
+		surface->stats.grown++;
+		DBG_OBJ(surface->surface, "all busy, now %d leaves\n",
+			surface->leaves_nb);
+	}
+
 	if (!leaf) {
-		fprintf(stderr, "%s: all buffers are held by the server.\n",
-			__func__);
-		exit(1);
+		/* Try again when the server releases one. */
+		DBG_OBJ(surface->surface, "all %d leaves busy, deferring\n",
+			surface->leaves_nb);
+		surface->stats.deferred++;
+		surface->base.blocked = 1;
+		trace_end("shm_surface_prepare", -1);
 		return NULL;
 	}
 
-	if (!resize_hint && leaf->resize_pool) {
-		cairo_surface_destroy(leaf->cairo_surface);
-		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
-		leaf->resize_pool = NULL;
-	}
+	surface->stats.frames++;
 
 	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
 
 	if (leaf->cairo_surface &&
 	    cairo_image_surface_get_width(leaf->cairo_surface) == width &&
-	    cairo_image_surface_get_height(leaf->cairo_surface) == height)
+	    cairo_image_surface_get_height(leaf->cairo_surface) == height) {
+		trace_end("shm_surface_prepare", 0);
 		goto out;
+	}
 
 	if (leaf->cairo_surface)
 		cairo_surface_destroy(leaf->cairo_surface);
 
-#ifdef USE_RESIZE_POOL
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
-		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
+	if (leaf->stale) {
+		cairo_region_destroy(leaf->stale);
+		leaf->stale = NULL;
 	}
-#endif
 
 	rect.width = width;
 	rect.height = height;
 
+	/* The format comes from creation, the resize hint from this
+	 * frame, for sizing a new pool. */
 	leaf->cairo_surface =
 		display_create_shm_surface(surface->display, &rect,
-					   surface->flags,
-					   leaf->resize_pool,
+					   surface->flags |
+					   (flags & SURFACE_HINT_RESIZE),
 					   &leaf->data);
-	if (!leaf->cairo_surface)
+	if (!leaf->cairo_surface) {
+		trace_end("shm_surface_prepare", -1);
 		return NULL;
+	}
 
 	wl_buffer_add_listener(leaf->data->buffer,
 			       &shm_surface_buffer_listener, surface);
+	trace_end("shm_surface_prepare", 1);
 
 out:
 	surface->current = leaf;
@@ -1081,13 +1338,68 @@ out:
 	return cairo_surface_reference(leaf->cairo_surface);
 }
 
+static cairo_region_t *
+shm_surface_get_repaint(struct toysurface *base, cairo_region_t *damage)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+	struct shm_surface_leaf *leaf = surface->current;
+	cairo_region_t *repaint;
+
+	if (!damage || !leaf->stale)
+		return NULL;
+
+	/* The buffer also misses whatever changed while the server
+	 * held it. */
+	repaint = cairo_region_copy(damage);
+	cairo_region_union(repaint, leaf->stale);
+
+	return repaint;
+}
+
+static void
+shm_surface_damage(struct shm_surface *surface, cairo_region_t *damage,
+		   enum wl_output_transform buffer_transform,
+		   int32_t buffer_scale, struct rectangle *allocation)
+{
+	cairo_rectangle_int_t rect;
+	int i, n;
+
+	if (!damage) {
+		wl_surface_damage(surface->surface, 0, 0,
+				  allocation->width, allocation->height);
+		return;
+	}
+
+	n = cairo_region_num_rectangles(damage);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle(damage, i, &rect);
+#ifdef WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION
+		if (surface->display->compositor_version >=
+		    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION &&
+		    buffer_transform == WL_OUTPUT_TRANSFORM_NORMAL) {
+			wl_surface_damage_buffer(surface->surface,
+						 rect.x * buffer_scale,
+						 rect.y * buffer_scale,
+						 rect.width * buffer_scale,
+						 rect.height * buffer_scale);
+			continue;
+		}
+#endif
+		wl_surface_damage(surface->surface, rect.x, rect.y,
+				  rect.width, rect.height);
+	}
+}
+
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 cairo_region_t *damage,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct shm_surface_leaf *other;
+	int i;
 
 	server_allocation->width =
 		cairo_image_surface_get_width(leaf->cairo_surface);
@@ -1098,19 +1410,56 @@ shm_surface_swap(struct toysurface *base,
 				&server_allocation->width,
 				&server_allocation->height);
 
+	/* A buffer of another size has all of its contents replaced. */
+	if (surface->dx || surface->dy || !leaf->stale)
+		damage = NULL;
+
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+	shm_surface_damage(surface, damage, buffer_transform, buffer_scale,
+			   server_allocation);
+	trace_instant("commit", wl_proxy_get_id((struct wl_proxy *) surface->surface));
+	stats_commit();
 	wl_surface_commit(surface->surface);
 
+	/* This buffer is now up to date, the others miss this frame. */
+	for (i = 0; i < surface->leaves_nb; i++) {
+		other = &surface->leaf[i];
+		if (other == leaf || !other->stale)
+			continue;
+
+		if (damage) {
+			cairo_region_union(other->stale, damage);
+		} else {
+			cairo_region_destroy(other->stale);
+			other->stale = NULL;
+		}
+	}
+
+	if (leaf->stale)
+		cairo_region_destroy(leaf->stale);
+	leaf->stale = cairo_region_create();
+
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
 		(int)(leaf - &surface->leaf[0]));
 
 	leaf->busy = 1;
+	stats_buffer_held(1);
+	surface->attached = leaf;
 	surface->current = NULL;
 }
 
+static struct wl_buffer *
+shm_surface_get_buffer(struct toysurface *base)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+
+	if (!surface->attached || !surface->attached->data)
+		return NULL;
+
+	return surface->attached->data->buffer;
+}
+
 static int
 shm_surface_acquire(struct toysurface *base, EGLContext ctx)
 {
@@ -1126,10 +1475,22 @@ static void
 shm_surface_destroy(struct toysurface *base)
 {
 	struct shm_surface *surface = to_shm_surface(base);
+	struct buffer_stats *stats = &surface->display->buffer_stats;
 	int i;
 
-	for (i = 0; i < MAX_LEAVES; i++)
+	for (i = 0; i < surface->leaves_nb; i++) {
+		/* Destroying the buffers ends the compositor's hold. */
+		if (surface->leaf[i].busy)
+			stats_buffer_held(-1);
 		shm_surface_leaf_release(&surface->leaf[i]);
+	}
+
+	DBG_OBJ(surface->surface, "%u frames, %d leaves, grown %u, "
+		"deferred %u\n", surface->stats.frames, surface->leaves_nb,
+		surface->stats.grown, surface->stats.deferred);
+	stats->frames += surface->stats.frames;
+	stats->grown += surface->stats.grown;
+	stats->deferred += surface->stats.deferred;
 
 	free(surface);
 }
@@ -1148,7 +1509,9 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 		return NULL;
 
 	surface->base.prepare = shm_surface_prepare;
+	surface->base.get_repaint = shm_surface_get_repaint;
 	surface->base.swap = shm_surface_swap;
+	surface->base.get_buffer = shm_surface_get_buffer;
 	surface->base.acquire = shm_surface_acquire;
 	surface->base.release = shm_surface_release;
 	surface->base.destroy = shm_surface_destroy;
@@ -1156,6 +1519,7 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 	surface->display = display;
 	surface->surface = wl_surface;
 	surface->flags = flags;
+	surface->leaves_nb = MIN_LEAVES;
 
 	return &surface->base;
 }
@@ -1266,56 +1630,150 @@ static const struct cursor_alternatives cursors[] = {
 	{watches, ARRAY_LENGTH(watches)},
 };
 
+/* The cursor theme is only loaded on the first pointer enter, so
+ * keyboard- and touch-only setups never read any cursor files. */
 static void
 create_cursors(struct display *display)
 {
 	char *theme = NULL;
-	unsigned int i, j;
-	struct wl_cursor *cursor;
 
-	display->cursor_theme = wl_cursor_theme_load(theme, 32, display->shm);
-	if (!display->cursor_theme) {
-		fprintf(stderr, "could not load theme '%s'\n", theme);
+	if (display->cursors)
 		return;
-	}
+
 	display->cursors =
-		xmalloc(ARRAY_LENGTH(cursors) * sizeof display->cursors[0]);
+		xzalloc(ARRAY_LENGTH(cursors) * sizeof display->cursors[0]);
 
-	for (i = 0; i < ARRAY_LENGTH(cursors); i++) {
-		cursor = NULL;
-		for (j = 0; !cursor && j < cursors[i].count; ++j)
-			cursor = wl_cursor_theme_get_cursor(
-			    display->cursor_theme, cursors[i].names[j]);
+	display->cursor_theme = wl_cursor_theme_load(theme, 32, display->shm);
+	if (!display->cursor_theme)
+		fprintf(stderr, "could not load theme '%s'\n", theme);
+}
 
-		if (!cursor)
-			fprintf(stderr, "could not load cursor '%s'\n",
-				cursors[i].names[0]);
+/* Looks a cursor up the first time it is needed, trying each of its
+ * alternative names. */
+static struct wl_cursor *
+display_get_cursor(struct display *display, int pointer)
+{
+	struct wl_cursor *cursor = NULL;
+	unsigned int j;
 
-		display->cursors[i] = cursor;
+	if (pointer < 0 || pointer >= (int) ARRAY_LENGTH(cursors))
+		return NULL;
+
+	create_cursors(display);
+
+	if (display->cursors_loaded & (1 << pointer))
+		return display->cursors[pointer];
+
+	display->cursors_loaded |= 1 << pointer;
+	if (!display->cursor_theme)
+		return NULL;
+
+	for (j = 0; !cursor && j < cursors[pointer].count; ++j)
+		cursor = wl_cursor_theme_get_cursor(
+		    display->cursor_theme, cursors[pointer].names[j]);
+
+	if (!cursor)
+		fprintf(stderr, "could not load cursor '%s'\n",
+			cursors[pointer].names[0]);
+
+	display->cursors[pointer] = cursor;
+
+	return cursor;
+}
+
+static void
+destroy_fonts(struct display *display)
+{
+	struct display_font *font, *tmp;
+
+	wl_list_for_each_safe(font, tmp, &display->font_list, link) {
+		glyph_font_destroy(font->font);
+		free(font->family);
+		free(font);
 	}
 }
 
 static void
 destroy_cursors(struct display *display)
 {
-	wl_cursor_theme_destroy(display->cursor_theme);
+	if (display->cursor_theme)
+		wl_cursor_theme_destroy(display->cursor_theme);
 	free(display->cursors);
 }
 
 struct wl_cursor_image *
 display_get_pointer_image(struct display *display, int pointer)
 {
-	struct wl_cursor *cursor = display->cursors[pointer];
+	struct wl_cursor *cursor = display_get_cursor(display, pointer);
 
 	return cursor ? cursor->images[0] : NULL;
 }
 
-static void
-surface_flush(struct surface *surface)
+/* A mirror shows the buffers of its source while both have the same
+ * surfaces, size, scale and transform and the source draws with
+ * wl_shm; otherwise it draws itself. */
+static int
+window_mirror_matches(struct window *window)
 {
-	if (!surface->cairo_surface)
-		return;
+	struct surface *mirror = window->main_surface;
+	struct surface *source;
+
+	if (!window->mirror_source || window->resize_needed ||
+	    window->mirror_source->resize_needed)
+		return 0;
+
+	source = window->mirror_source->main_surface;
 
+	return source->buffer_type == WINDOW_BUFFER_TYPE_SHM &&
+	       source->allocation.width == mirror->allocation.width &&
+	       source->allocation.height == mirror->allocation.height &&
+	       source->buffer_scale == mirror->buffer_scale &&
+	       source->buffer_transform == mirror->buffer_transform &&
+	       wl_list_length(&window->mirror_source->subsurface_list) ==
+	       wl_list_length(&window->subsurface_list);
+}
+
+/* Returns whether the mirror shows the buffers of its source.  The
+ * one that takes over the drawing starts with a full frame. */
+static int
+window_mirror_update(struct window *window)
+{
+	int synced = window_mirror_matches(window);
+
+	if (synced == window->mirror_synced)
+		return synced;
+
+	window->mirror_synced = synced;
+	if (synced)
+		window_schedule_redraw(window->mirror_source);
+	else
+		window_schedule_redraw(window);
+
+	return synced;
+}
+
+/* The surface of the mirror standing where surface stands in the
+ * source; both windows create their surfaces in the same order. */
+static struct surface *
+window_mirror_get_surface(struct window *window, struct surface *surface)
+{
+	struct wl_list *link = window->subsurface_list.next;
+	struct surface *s;
+
+	wl_list_for_each(s, &surface->window->subsurface_list, link) {
+		if (link == &window->subsurface_list)
+			break;
+		if (s == surface)
+			return container_of(link, struct surface, link);
+		link = link->next;
+	}
+
+	return NULL;
+}
+
+static void
+surface_flush_regions(struct surface *surface)
+{
 	if (surface->opaque_region) {
 		wl_surface_set_opaque_region(surface->surface,
 					     surface->opaque_region);
@@ -1329,13 +1787,88 @@ surface_flush(struct surface *surface)
 		wl_region_destroy(surface->input_region);
 		surface->input_region = NULL;
 	}
+}
+
+/* Commits the buffer surface was just swapped to on the matching
+ * surface of every mirror in sync with it. */
+static void
+surface_flush_mirrors(struct surface *surface)
+{
+	struct window *mirror;
+	struct surface *other;
+	struct wl_buffer *buffer;
+	cairo_region_t *damage;
+	cairo_rectangle_int_t rect;
+	int i, n;
+
+	if (wl_list_empty(&surface->window->mirror_list))
+		return;
+
+	buffer = surface->toysurface->get_buffer(surface->toysurface);
+
+	wl_list_for_each(mirror, &surface->window->mirror_list, mirror_link) {
+		if (!window_mirror_update(mirror))
+			continue;
+
+		other = window_mirror_get_surface(mirror, surface);
+		if (!buffer || !other)
+			continue;
+
+		damage = surface->frame_damage;
+		if (other->server_allocation.width !=
+		    surface->server_allocation.width ||
+		    other->server_allocation.height !=
+		    surface->server_allocation.height)
+			damage = NULL;
+		other->server_allocation = surface->server_allocation;
+
+		wl_surface_attach(other->surface, buffer, 0, 0);
+		if (!damage) {
+			wl_surface_damage(other->surface, 0, 0,
+					  other->server_allocation.width,
+					  other->server_allocation.height);
+		} else {
+			n = cairo_region_num_rectangles(damage);
+			for (i = 0; i < n; i++) {
+				cairo_region_get_rectangle(damage, i, &rect);
+				wl_surface_damage(other->surface,
+						  rect.x, rect.y,
+						  rect.width, rect.height);
+			}
+		}
+		trace_instant("commit", wl_proxy_get_id((struct wl_proxy *) other->surface));
+		stats_commit();
+		wl_surface_commit(other->surface);
+	}
+}
+
+static void
+surface_flush(struct surface *surface)
+{
+	if (!surface->cairo_surface)
+		return;
+
+	surface_flush_regions(surface);
 
 	surface->toysurface->swap(surface->toysurface,
 				  surface->buffer_transform, surface->buffer_scale,
+				  surface->frame_damage,
 				  &surface->server_allocation);
 
+	surface_flush_mirrors(surface);
+
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
+
+	if (surface->frame_damage) {
+		cairo_region_destroy(surface->frame_damage);
+		surface->frame_damage = NULL;
+	}
+
+	if (surface->repaint) {
+		cairo_region_destroy(surface->repaint);
+		surface->repaint = NULL;
+	}
 }
 
 int
@@ -1359,14 +1892,34 @@ window_get_display(struct window *window)
 	return window->display;
 }
 
+/* Past this many buffer pixels, GL pays for its setup; smaller
+ * surfaces are drawn faster to wl_shm buffers. */
+#define RENDERER_AUTO_EGL_PIXELS (1024 * 768)
+
+static int
+surface_wants_egl(struct surface *surface, struct rectangle *allocation)
+{
+	struct display *display = surface->window->display;
+	int32_t scale = surface->buffer_scale;
+
+	if (surface->buffer_type != WINDOW_BUFFER_TYPE_EGL_WINDOW)
+		return 0;
+
+	if (display->renderer == DISPLAY_RENDERER_AUTO)
+		return allocation->width * scale * allocation->height * scale >=
+			RENDERER_AUTO_EGL_PIXELS;
+
+	return 1;
+}
+
 static void
 surface_create_surface(struct surface *surface, uint32_t flags)
 {
 	struct display *display = surface->window->display;
 	struct rectangle allocation = surface->allocation;
 
-	if (!surface->toysurface && display->dpy &&
-	    surface->buffer_type == WINDOW_BUFFER_TYPE_EGL_WINDOW) {
+	/* The renderer is settled by the first buffer of the surface. */
+	if (!surface->toysurface && surface_wants_egl(surface, &allocation)) {
 		surface->toysurface =
 			egl_window_surface_create(display,
 						  surface->surface,
@@ -1374,10 +1927,12 @@ surface_create_surface(struct surface *surface, uint32_t flags)
 						  &allocation);
 	}
 
-	if (!surface->toysurface)
+	if (!surface->toysurface) {
+		surface->buffer_type = WINDOW_BUFFER_TYPE_SHM;
 		surface->toysurface = shm_surface_create(display,
 							 surface->surface,
 							 flags, &allocation);
+	}
 
 	surface->cairo_surface = surface->toysurface->prepare(
 		surface->toysurface, 0, 0,
@@ -1394,8 +1949,10 @@ window_create_main_surface(struct window *window)
 	if (window->resizing)
 		flags |= SURFACE_HINT_RESIZE;
 
-	if (window->preferred_format == WINDOW_PREFERRED_FORMAT_RGB565)
-		flags |= SURFACE_HINT_RGB565;
+	/* Falls back to XRGB8888 without RGB565 support. */
+	if (window->preferred_format == WINDOW_PREFERRED_FORMAT_RGB565 ||
+	    window->display->low_memory)
+		flags |= SURFACE_HINT_RGB565 | SURFACE_OPAQUE;
 
 	surface_create_surface(surface, flags);
 }
@@ -1468,6 +2025,12 @@ surface_destroy(struct surface *surface)
 	if (surface->toysurface)
 		surface->toysurface->destroy(surface->toysurface);
 
+	cairo_region_destroy(surface->damage);
+	if (surface->frame_damage)
+		cairo_region_destroy(surface->frame_damage);
+	if (surface->repaint)
+		cairo_region_destroy(surface->repaint);
+
 	wl_list_remove(&surface->link);
 	free(surface);
 }
@@ -1479,9 +2042,15 @@ window_destroy(struct window *window)
 	struct input *input;
 	struct window_output *window_output;
 	struct window_output *window_output_tmp;
+	struct window *mirror, *mirror_tmp;
 
 	wl_list_remove(&window->redraw_task.link);
 
+	wl_list_remove(&window->mirror_link);
+	wl_list_for_each_safe(mirror, mirror_tmp,
+			      &window->mirror_list, mirror_link)
+		window_set_mirror(mirror, NULL);
+
 	wl_list_for_each(input, &display->input_list, link) {	  
 		if (input->touch_focus == window)
 			input->touch_focus = NULL;
@@ -1759,13 +2328,30 @@ widget_cairo_create(struct widget *widget)
 {
 	struct surface *surface = widget->surface;
 	cairo_surface_t *cairo_surface;
+	cairo_rectangle_int_t rect;
 	cairo_t *cr;
+	int i, n;
 
 	cairo_surface = widget_get_cairo_surface(widget);
 	cr = cairo_create(cairo_surface);
 
+	/* Interactive resizes favor speed over looks. */
+	if (widget->window->resizing)
+		cairo_set_antialias(cr, CAIRO_ANTIALIAS_FAST);
+
 	widget_cairo_update_transform(widget, cr);
 
+	/* Leave alone what is still valid in the buffer. */
+	if (surface->repaint) {
+		n = cairo_region_num_rectangles(surface->repaint);
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(surface->repaint, i, &rect);
+			cairo_rectangle(cr, rect.x, rect.y,
+					rect.width, rect.height);
+		}
+		cairo_clip(cr);
+	}
+
 	cairo_translate(cr, -surface->allocation.x, -surface->allocation.y);
 
 	return cr;
@@ -1892,9 +2478,30 @@ window_schedule_redraw_task(struct window *window);
 void
 widget_schedule_redraw(struct widget *widget)
 {
+	struct surface *surface = widget->surface;
+	cairo_rectangle_int_t rect;
+
 	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
-	widget->surface->redraw_needed = 1;
-	window_schedule_redraw_task(widget->window);
+
+	if (widget == surface->widget) {
+		surface->damage_all = 1;
+	} else if (!surface->damage_all) {
+		/* Strokes and pressed-state offsets reach a little outside
+		 * the allocation. */
+		rect.x = widget->allocation.x - surface->allocation.x - 2;
+		rect.y = widget->allocation.y - surface->allocation.y - 2;
+		rect.width = widget->allocation.width + 4;
+		rect.height = widget->allocation.height + 4;
+		cairo_region_union_rectangle(surface->damage, &rect);
+	}
+
+	surface->redraw_needed = 1;
+
+	/* The pending frame callback schedules the redraw, which paces
+	 * widgets redrawing from their own redraw handler to the
+	 * compositor, and stops them while no frame is shown. */
+	if (!surface->frame_cb)
+		window_schedule_redraw_task(widget->window);
 }
 
 void
@@ -2157,7 +2764,11 @@ frame_resize_handler(struct widget *widget,
 
 	widget_set_allocation(widget, 0, 0, width, height);
 
-	if (child->opaque) {
+	if (widget->window->display->low_memory) {
+		/* The buffers have no alpha channel. */
+		wl_region_add(widget->surface->opaque_region,
+			      0, 0, width, height);
+	} else if (child->opaque) {
 		if (!widget->window->fullscreen) {
 			frame_opaque_rect(frame->frame, &opaque.x, &opaque.y,
 					  &opaque.width, &opaque.height);
@@ -2175,26 +2786,110 @@ frame_resize_handler(struct widget *widget,
 	widget_schedule_redraw(widget);
 }
 
+/* Whether everything to repaint lies within the child, which paints
+ * over the decorations there anyway. */
+static int
+window_frame_repaint_inside_child(struct window_frame *frame)
+{
+	struct surface *surface = frame->widget->surface;
+	cairo_rectangle_int_t rect;
+	cairo_region_t *outside;
+	int inside;
+
+	if (!surface->repaint)
+		return 0;
+
+	rect.x = frame->child->allocation.x - surface->allocation.x;
+	rect.y = frame->child->allocation.y - surface->allocation.y;
+	rect.width = frame->child->allocation.width;
+	rect.height = frame->child->allocation.height;
+
+	outside = cairo_region_copy(surface->repaint);
+	cairo_region_subtract_rectangle(outside, &rect);
+	inside = cairo_region_is_empty(outside);
+	cairo_region_destroy(outside);
+
+	return inside;
+}
+
+static void
+window_frame_destroy_cache(struct window_frame *frame)
+{
+	if (frame->cache)
+		cairo_surface_destroy(frame->cache);
+	frame->cache = NULL;
+}
+
 static void
 frame_redraw_handler(struct widget *widget, void *data)
 {
 	cairo_t *cr;
 	struct window_frame *frame = data;
 	struct window *window = widget->window;
+	int32_t width, height, scale;
 
 	if (window->fullscreen)
 		return;
 
-	if (window->focused) {
-		frame_set_flag(frame->frame, FRAME_FLAG_ACTIVE);
-	} else {
-		frame_unset_flag(frame->frame, FRAME_FLAG_ACTIVE);
+	/* Both flag calls ask for a repaint, so only on a change. */
+	if (window->focused != frame->focused) {
+		if (window->focused)
+			frame_set_flag(frame->frame, FRAME_FLAG_ACTIVE);
+		else
+			frame_unset_flag(frame->frame, FRAME_FLAG_ACTIVE);
+		frame->focused = window->focused;
 	}
 
-	cr = widget_cairo_create(widget);
+	/* Every size of an interactive resize gets a quick frame, with
+	 * no shadow and no cache; the first frame after it is the full
+	 * one again. */
+	if (window->resizing != frame->resizing) {
+		if (window->resizing)
+			frame_set_flag(frame->frame, FRAME_FLAG_NO_SHADOW);
+		else
+			frame_unset_flag(frame->frame, FRAME_FLAG_NO_SHADOW);
+		frame->resizing = window->resizing;
+	}
+
+	width = widget->allocation.width;
+	height = widget->allocation.height;
+	scale = window_get_buffer_scale(window);
 
-	frame_repaint(frame->frame, cr);
+	if (frame_status(frame->frame) & FRAME_STATUS_REPAINT ||
+	    frame->cache_width != width || frame->cache_height != height ||
+	    frame->cache_scale != scale)
+		window_frame_destroy_cache(frame);
+	else if (window_frame_repaint_inside_child(frame))
+		return;
+
+	/* Low memory or resizing: no cache, the decorations go straight
+	 * to the buffer. */
+	if (window->display->low_memory || window->resizing) {
+		cr = widget_cairo_create(widget);
+		frame_repaint(frame->frame, cr);
+		cairo_destroy(cr);
+	} else if (!frame->cache) {
+		frame->cache = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							  width * scale,
+							  height * scale);
+		cr = cairo_create(frame->cache);
+		cairo_scale(cr, scale, scale);
+		frame_repaint(frame->frame, cr);
+		cairo_destroy(cr);
+	}
+
+	frame->cache_width = width;
+	frame->cache_height = height;
+	frame->cache_scale = scale;
+
+	if (!frame->cache)
+		return;
 
+	cr = widget_cairo_create(widget);
+	cairo_scale(cr, 1.0 / scale, 1.0 / scale);
+	cairo_set_source_surface(cr, frame->cache, 0, 0);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
 	cairo_destroy(cr);
 }
 
@@ -2486,6 +3181,7 @@ window_frame_set_child_size(struct widget *widget, int child_width,
 static void
 window_frame_destroy(struct window_frame *frame)
 {
+	window_frame_destroy_cache(frame);
 	frame_destroy(frame->frame);
 
 	/* frame->child must be destroyed by the application */
@@ -2611,13 +3307,15 @@ pointer_handle_enter(void *data, struct wl_pointer *pointer,
 		return;
 	}
 
+	create_cursors(input->display);
+
 	input->display->serial = serial;
 	input->pointer_enter_serial = serial;
 	input->pointer_focus = window;
 
 	if (window->resizing) {
 		window->resizing = 0;
-		/* Schedule a redraw to free the pool */
+		/* The resize grab is over: one full-quality frame. */
 		window_schedule_redraw(window);
 	}
 
@@ -2649,6 +3347,8 @@ pointer_handle_motion(void *data, struct wl_pointer *pointer,
 	float sx = wl_fixed_to_double(sx_w);
 	float sy = wl_fixed_to_double(sy_w);
 
+	trace_instant("input_motion", time);
+
 	if (!window)
 		return;
 
@@ -2693,6 +3393,8 @@ pointer_handle_button(void *data, struct wl_pointer *pointer, uint32_t serial,
 	struct widget *widget;
 	enum wl_pointer_button_state state = state_w;
 
+	trace_instant("input_button", time);
+
 	input->display->serial = serial;
 	if (input->focus_widget && input->grab == NULL &&
 	    state == WL_POINTER_BUTTON_STATE_PRESSED)
@@ -2717,6 +3419,8 @@ pointer_handle_axis(void *data, struct wl_pointer *pointer,
 	struct input *input = data;
 	struct widget *widget;
 
+	trace_instant("input_axis", time);
+
 	widget = input->focus_widget;
 	if (input->grab)
 		widget = input->grab;
@@ -2779,37 +3483,44 @@ keyboard_repeat_func(struct task *task, uint32_t events)
 	}
 }
 
-static void
-keyboard_handle_keymap(void *data, struct wl_keyboard *keyboard,
-		       uint32_t format, int fd, uint32_t size)
+struct keymap_job {
+	struct xkb_context *context;
+	char *map_str;
+	uint32_t size;
+	int fd;
+};
+
+static void *
+compile_keymap_func(void *data)
 {
-	struct input *input = data;
+	struct keymap_job *job = data;
 	struct xkb_keymap *keymap;
-	struct xkb_state *state;
-	char *map_str;
 
-	if (!data) {
-		close(fd);
-		return;
-	}
+	keymap = xkb_map_new_from_string(job->context,
+					 job->map_str,
+					 XKB_KEYMAP_FORMAT_TEXT_V1,
+					 0);
+	munmap(job->map_str, job->size);
+	close(job->fd);
+	free(job);
 
-	if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
-		close(fd);
-		return;
-	}
+	return keymap;
+}
 
-	map_str = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
-	if (map_str == MAP_FAILED) {
-		close(fd);
+/* Picks up a keymap compiled in the background by
+ * keyboard_handle_keymap().  Every path that touches the XKB state
+ * calls this first. */
+static void
+input_finish_keymap(struct input *input)
+{
+	struct xkb_keymap *keymap;
+	struct xkb_state *state;
+
+	if (!input->keymap_pending)
 		return;
-	}
 
-	keymap = xkb_map_new_from_string(input->display->xkb_context,
-					 map_str,
-					 XKB_KEYMAP_FORMAT_TEXT_V1,
-					 0);
-	munmap(map_str, size);
-	close(fd);
+	input->keymap_pending = 0;
+	keymap = worker_join(&input->keymap_worker);
 
 	if (!keymap) {
 		fprintf(stderr, "failed to compile keymap\n");
@@ -2836,6 +3547,48 @@ keyboard_handle_keymap(void *data, struct wl_keyboard *keyboard,
 		1 << xkb_map_mod_get_index(input->xkb.keymap, "Shift");
 }
 
+static void
+keyboard_handle_keymap(void *data, struct wl_keyboard *keyboard,
+		       uint32_t format, int fd, uint32_t size)
+{
+	struct input *input = data;
+	struct input *other;
+	struct keymap_job *job;
+	char *map_str;
+
+	if (!data) {
+		close(fd);
+		return;
+	}
+
+	if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
+		close(fd);
+		return;
+	}
+
+	map_str = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map_str == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+
+	/* The XKB context isn't thread-safe, so only one compile may
+	 * use it at a time. */
+	wl_list_for_each(other, &input->display->input_list, link)
+		input_finish_keymap(other);
+
+	job = xmalloc(sizeof *job);
+	job->context = input->display->xkb_context;
+	job->map_str = map_str;
+	job->size = size;
+	job->fd = fd;
+
+	/* Compiling the keymap is the slowest part of seat setup; let
+	 * it run while the remaining startup roundtrips complete. */
+	input->keymap_pending = 1;
+	worker_run(&input->keymap_worker, compile_keymap_func, job);
+}
+
 static void
 keyboard_handle_enter(void *data, struct wl_keyboard *keyboard,
 		      uint32_t serial, struct wl_surface *surface,
@@ -2846,6 +3599,7 @@ keyboard_handle_enter(void *data, struct wl_keyboard *keyboard,
 
 	input->display->serial = serial;
 	input->keyboard_focus = wl_surface_get_user_data(surface);
+	input_finish_keymap(input);
 
 	window = input->keyboard_focus;
 	if (window->keyboard_focus_handler)
@@ -2876,8 +3630,11 @@ keyboard_handle_key(void *data, struct wl_keyboard *keyboard,
 	xkb_keysym_t sym;
 	struct itimerspec its;
 
+	trace_instant("input_key", time);
+
 	input->display->serial = serial;
 	code = key + 8;
+	input_finish_keymap(input);
 	if (!window || !input->xkb.state)
 		return;
 
@@ -2895,6 +3652,8 @@ keyboard_handle_key(void *data, struct wl_keyboard *keyboard,
 	if (num_syms == 1)
 		sym = syms[0];
 
+	if (state == WL_KEYBOARD_KEY_STATE_PRESSED)
+		stats_key_press();
 
 	if (sym == XKB_KEY_F5 && input->modifiers == MOD_ALT_MASK) {
 		if (state == WL_KEYBOARD_KEY_STATE_PRESSED)
@@ -2911,6 +3670,7 @@ keyboard_handle_key(void *data, struct wl_keyboard *keyboard,
 		(*window->key_handler)(window, input, time, key,
 				       sym, state, window->user_data);
 	}
+	stats_key_done();
 
 	if (state == WL_KEYBOARD_KEY_STATE_RELEASED &&
 	    key == input->repeat_key) {
@@ -2941,6 +3701,8 @@ keyboard_handle_modifiers(void *data, struct wl_keyboard *keyboard,
 	struct input *input = data;
 	xkb_mod_mask_t mask;
 
+	input_finish_keymap(input);
+
 	/* If we're not using a keymap, then we don't handle PC-style modifiers */
 	if (!input->xkb.keymap)
 		return;
@@ -2977,6 +3739,8 @@ touch_handle_down(void *data, struct wl_touch *wl_touch,
 	float sx = wl_fixed_to_double(x_w);
 	float sy = wl_fixed_to_double(y_w);
 
+	trace_instant("input_touch_down", time);
+
 	input->display->serial = serial;
 	input->touch_focus = wl_surface_get_user_data(surface);
 	if (!input->touch_focus) {
@@ -3021,6 +3785,8 @@ touch_handle_up(void *data, struct wl_touch *wl_touch,
 	struct input *input = data;
 	struct touch_point *tp, *tmp;
 
+	trace_instant("input_touch_up", time);
+
 	if (!input->touch_focus) {
 		DBG("No touch focus found for touch up event!\n");
 		return;
@@ -3408,7 +4174,7 @@ input_set_pointer_image_index(struct input *input, int index)
 	if (!input->pointer)
 		return;
 
-	cursor = input->display->cursors[input->current_cursor];
+	cursor = display_get_cursor(input->display, input->current_cursor);
 	if (!cursor)
 		return;
 
@@ -3459,7 +4225,7 @@ pointer_surface_frame_callback(void *data, struct wl_callback *callback,
 
 	if (input->current_cursor == CURSOR_UNSET)
 		return;
-	cursor = input->display->cursors[input->current_cursor];
+	cursor = display_get_cursor(input->display, input->current_cursor);
 	if (!cursor)
 		return;
 
@@ -4004,6 +4770,8 @@ frame_callback(void *data, struct wl_callback *callback, uint32_t time)
 
 	assert(callback == surface->frame_cb);
 	DBG_OBJ(callback, "done\n");
+	trace_instant("frame_done", time);
+	stats_frame_done();
 	wl_callback_destroy(callback);
 	surface->frame_cb = NULL;
 
@@ -4031,11 +4799,14 @@ surface_redraw(struct surface *surface)
 	 * not yet hit the screen.
 	 */
 	if (surface->frame_cb) {
-		if (!surface->window->redraw_needed)
+		if (!surface->window->redraw_needed) {
+			stats.throttled++;
 			return 0;
+		}
 
 		DBG_OBJ(surface->frame_cb, "cancelled\n");
 		wl_callback_destroy(surface->frame_cb);
+		surface->frame_cb = NULL;
 	}
 
 	if (surface->widget->use_cairo &&
@@ -4044,13 +4815,33 @@ surface_redraw(struct surface *surface)
 		return -1;
 	}
 
+	if (surface->frame_damage)
+		cairo_region_destroy(surface->frame_damage);
+	if (surface->window->redraw_needed || surface->damage_all) {
+		surface->frame_damage = NULL;
+		cairo_region_destroy(surface->damage);
+	} else {
+		surface->frame_damage = surface->damage;
+	}
+	surface->damage = cairo_region_create();
+	surface->damage_all = 0;
+
+	if (surface->widget->use_cairo)
+		surface->repaint =
+			surface->toysurface->get_repaint(surface->toysurface,
+							 surface->frame_damage);
+
 	surface->frame_cb = wl_surface_frame(surface->surface);
 	wl_callback_add_listener(surface->frame_cb, &listener, surface);
 	DBG_OBJ(surface->frame_cb, "new\n");
 
 	surface->redraw_needed = 0;
 	DBG_OBJ(surface->surface, "-> widget_redraw\n");
+	trace_begin("surface_redraw");
+	stats.frames++;
 	widget_redraw(surface->widget);
+	trace_end("surface_redraw",
+		  wl_proxy_get_id((struct wl_proxy *) surface->surface));
 	DBG_OBJ(surface->surface, "done\n");
 	return 0;
 }
@@ -4068,10 +4859,14 @@ idle_redraw(struct task *task, uint32_t events)
 	wl_list_init(&window->redraw_task.link);
 	window->redraw_task_scheduled = 0;
 
+	/* Ends with 1 when the window resized. */
+	trace_begin("idle_redraw");
+
 	if (window->resize_needed) {
 		/* throttle resizing to the main surface display */
 		if (window->main_surface->frame_cb) {
 			DBG_OBJ(window->main_surface->frame_cb, "pending\n");
+			trace_end("idle_redraw", 0);
 			return;
 		}
 
@@ -4079,6 +4874,19 @@ idle_redraw(struct task *task, uint32_t events)
 		resized = 1;
 	}
 
+	/* A mirror in sync leaves the drawing to its source. */
+	if (window->mirror_source && window_mirror_update(window)) {
+		window->redraw_needed = 0;
+		wl_list_for_each(surface, &window->subsurface_list, link) {
+			surface->redraw_needed = 0;
+			cairo_region_destroy(surface->damage);
+			surface->damage = cairo_region_create();
+			surface_flush_regions(surface);
+		}
+		trace_end("idle_redraw", resized);
+		return;
+	}
+
 	if (surface_redraw(window->main_surface) < 0) {
 		/*
 		 * Only main_surface failure will cause us to undo the resize.
@@ -4101,15 +4909,23 @@ idle_redraw(struct task *task, uint32_t events)
 	wl_list_for_each(surface, &window->subsurface_list, link)
 		surface_set_synchronized_default(surface);
 
-	if (resized && failed) {
+	if (resized && failed && window->main_surface->toysurface &&
+	    window->main_surface->toysurface->blocked) {
+		/* Only out of free buffers: do the same resize again once
+		 * one is released. */
+		window->resize_needed = 1;
+	} else if (resized && failed) {
 		/* Restore widget tree to correspond to what is on screen. */
 		undo_resize(window);
 	}
+
+	trace_end("idle_redraw", resized);
 }
 
 static void
 window_schedule_redraw_task(struct window *window)
 {
+	stats_redraw_scheduled();
 	if (!window->redraw_task_scheduled) {
 		window->redraw_task.run = idle_redraw;
 		display_defer(window->display, &window->redraw_task);
@@ -4124,8 +4940,10 @@ window_schedule_redraw(struct window *window)
 
 	DBG_OBJ(window->main_surface->surface, "window %p\n", window);
 
-	wl_list_for_each(surface, &window->subsurface_list, link)
+	wl_list_for_each(surface, &window->subsurface_list, link) {
 		surface->redraw_needed = 1;
+		surface->damage_all = 1;
+	}
 
 	window_schedule_redraw_task(window);
 }
@@ -4151,12 +4969,28 @@ window_set_fullscreen(struct window *window, int fullscreen)
 					 0);
 }
 
+void
+window_set_output(struct window *window, struct output *output)
+{
+	if (!window->xdg_surface)
+		return;
+
+	xdg_surface_set_output(window->xdg_surface,
+			       output ? output->output : NULL);
+}
+
 int
 window_is_maximized(struct window *window)
 {
 	return window->maximized;
 }
 
+int
+window_is_resizing(struct window *window)
+{
+	return window->resizing;
+}
+
 void
 window_set_maximized(struct window *window, int maximized)
 {
@@ -4355,6 +5189,8 @@ surface_create(struct window *window)
 	surface->window = window;
 	surface->surface = wl_compositor_create_surface(display->compositor);
 	surface->buffer_scale = 1;
+	surface->damage = cairo_region_create();
+	surface->damage_all = 1;
 	wl_surface_add_listener(surface->surface, &surface_listener, window);
 
 	wl_list_insert(&window->subsurface_list, &surface->link);
@@ -4366,7 +5202,8 @@ static enum window_buffer_type
 get_preferred_buffer_type(struct display *display)
 {
 #ifdef HAVE_CAIRO_EGL
-	if (display->argb_device && !getenv("TOYTOOLKIT_NO_EGL"))
+	if (display->renderer != DISPLAY_RENDERER_SHM &&
+	    !getenv("TOYTOOLKIT_NO_EGL") && !display->low_memory)
 		return WINDOW_BUFFER_TYPE_EGL_WINDOW;
 #endif
 
@@ -4381,6 +5218,8 @@ window_create_internal(struct display *display, int custom)
 
 	window = xzalloc(sizeof *window);
 	wl_list_init(&window->subsurface_list);
+	wl_list_init(&window->mirror_list);
+	wl_list_init(&window->mirror_link);
 	window->display = display;
 
 	surface = surface_create(window);
@@ -4649,6 +5488,30 @@ window_show_menu(struct display *display,
 			       &xdg_popup_listener, window);
 }
 
+void
+window_set_mirror(struct window *window, struct window *source)
+{
+	struct surface *surface;
+
+	wl_list_remove(&window->mirror_link);
+	wl_list_init(&window->mirror_link);
+	window->mirror_source = source;
+	window->mirror_synced = 0;
+
+	if (!source) {
+		window_schedule_redraw(window);
+		return;
+	}
+
+	/* Only wl_shm buffers can be attached to several surfaces. */
+	wl_list_for_each(surface, &source->subsurface_list, link) {
+		if (!surface->toysurface)
+			surface->buffer_type = WINDOW_BUFFER_TYPE_SHM;
+	}
+
+	wl_list_insert(&source->mirror_list, &window->mirror_link);
+}
+
 void
 window_set_buffer_type(struct window *window, enum window_buffer_type type)
 {
@@ -4758,10 +5621,22 @@ display_handle_mode(void *data,
 {
 	struct output *output = data;
 	struct display *display = output->display;
+	struct output *other;
+	size_t size;
 
 	if (flags & WL_OUTPUT_MODE_CURRENT) {
 		output->allocation.width = width;
 		output->allocation.height = height;
+
+		/* only the modes in use, not every advertised one */
+		display->shm_pool_hint = 0;
+		wl_list_for_each(other, &display->output_list, link) {
+			size = (size_t) other->allocation.width *
+				other->allocation.height * 4;
+			if (size > display->shm_pool_hint)
+				display->shm_pool_hint = size;
+		}
+
 		if (display->output_configure_handler)
 			(*display->output_configure_handler)(
 						output, display->user_data);
@@ -4877,7 +5752,6 @@ output_set_destroy_handler(struct output *output,
 			   display_output_handler_t handler)
 {
 	output->destroy_handler = handler;
-	/* FIXME: implement this, once we have way to remove outputs */
 }
 
 void
@@ -4932,6 +5806,7 @@ output_get_model(struct output *output)
 static void
 fini_xkb(struct input *input)
 {
+	input_finish_keymap(input);
 	xkb_state_unref(input->xkb.state);
 	xkb_map_unref(input->xkb.keymap);
 }
@@ -5061,8 +5936,14 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 	wl_list_insert(d->global_list.prev, &global->link);
 
 	if (strcmp(interface, "wl_compositor") == 0) {
+#ifdef WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION
+		d->compositor_version = MIN(version, 4);
+#else
+		d->compositor_version = 3;
+#endif
 		d->compositor = wl_registry_bind(registry, id,
-						 &wl_compositor_interface, 3);
+						 &wl_compositor_interface,
+						 d->compositor_version);
 	} else if (strcmp(interface, "wl_output") == 0) {
 		display_add_output(d, id);
 	} else if (strcmp(interface, "wl_seat") == 0) {
@@ -5214,6 +6095,27 @@ fini_egl(struct display *display)
 	eglTerminate(display->dpy);
 	eglReleaseThread();
 }
+
+/* Loading the GL driver takes a while, so it waits for the first
+ * surface, or caller, asking for EGL. */
+static int
+display_init_egl(struct display *d)
+{
+	if (!d->egl_tried) {
+		d->egl_tried = 1;
+		if (init_egl(d) < 0)
+			fprintf(stderr, "EGL does not seem to work, "
+				"falling back to software rendering and wl_shm.\n");
+	}
+
+	return d->argb_device ? 0 : -1;
+}
+#else
+static int
+display_init_egl(struct display *d)
+{
+	return -1;
+}
 #endif
 
 static void
@@ -5246,7 +6148,10 @@ handle_display_data(struct task *task, uint32_t events)
 	}
 
 	if (events & EPOLLIN) {
+		/* Ends with the number of events dispatched. */
+		trace_begin("dispatch");
 		ret = wl_display_dispatch(display->display);
+		trace_end("dispatch", ret);
 		if (ret == -1) {
 			display_exit(display);
 			return;
@@ -5273,18 +6178,38 @@ log_handler(const char *format, va_list args)
 	vfprintf(stderr, format, args);
 }
 
+static void *
+create_theme_func(void *data)
+{
+	return theme_create();
+}
+
 struct display *
 display_create(int *argc, char *argv[])
 {
 	struct display *d;
+	uint64_t start, since;
 
 	wl_log_set_handler_client(log_handler);
 
+	if (getenv("WLMESSAGE_TRACE"))
+		trace_open(getenv("WLMESSAGE_TRACE"));
+	if (getenv("WLMESSAGE_STATS"))
+		stats_open(atoi(getenv("WLMESSAGE_STATS")));
+	trace_begin("display_create");
+	start = stats_time();
+	if (!stats.start)
+		stats.start = start;
+
 	d = zalloc(sizeof *d);
 	if (d == NULL)
 		return NULL;
 
+	trace_begin("connect");
+	since = stats_time();
 	d->display = wl_display_connect(NULL);
+	stats_phase(&stats.connect, since);
+	trace_end("connect", 0);
 	if (d->display == NULL) {
 		fprintf(stderr, "failed to connect to Wayland display: %m\n");
 		free(d);
@@ -5298,6 +6223,10 @@ display_create(int *argc, char *argv[])
 		return NULL;
 	}
 
+	/* Rendering the theme only needs cairo, so it can be done
+	 * while the registry roundtrip is in flight. */
+	worker_run(&d->theme_worker, create_theme_func, NULL);
+
 	d->epoll_fd = os_epoll_create_cloexec();
 	d->display_fd = wl_display_get_fd(d->display);
 	d->display_task.run = handle_display_data;
@@ -5308,8 +6237,15 @@ display_create(int *argc, char *argv[])
 	wl_list_init(&d->input_list);
 	wl_list_init(&d->output_list);
 	wl_list_init(&d->global_list);
+	wl_list_init(&d->font_list);
+	wl_list_init(&d->shm_pool_list);
 
 	d->timeout = 0;
+	d->timeout_fd = -1;
+
+	d->max_buffers = DEFAULT_MAX_LEAVES;
+	if (getenv("WLMESSAGE_MAX_BUFFERS"))
+		display_set_max_buffers(d, atoi(getenv("WLMESSAGE_MAX_BUFFERS")));
 
 	d->workspace = 0;
 	d->workspace_count = 1;
@@ -5317,25 +6253,31 @@ display_create(int *argc, char *argv[])
 	d->registry = wl_display_get_registry(d->display);
 	wl_registry_add_listener(d->registry, &registry_listener, d);
 
+	trace_begin("registry");
+	since = stats_time();
 	if (wl_display_dispatch(d->display) < 0) {
 		fprintf(stderr, "Failed to process Wayland connection: %m\n");
+		worker_join(&d->theme_worker);
 		return NULL;
 	}
+	stats_phase(&stats.registry, since);
+	trace_end("registry", 0);
 
-#ifdef HAVE_CAIRO_EGL
-	if (init_egl(d) < 0)
-		fprintf(stderr, "EGL does not seem to work, "
-			"falling back to software rendering and wl_shm.\n");
-#endif
-
-	create_cursors(d);
-
-	d->theme = theme_create();
+	trace_begin("theme_join");
+	since = stats_time();
+	d->theme = worker_join(&d->theme_worker);
+	stats_phase(&stats.theme_join, since);
+	trace_end("theme_join", 0);
+	if (getenv("WLMESSAGE_LOWMEM"))
+		display_use_low_memory(d);
 
 	wl_list_init(&d->window_list);
 
 	init_dummy_surface(d);
 
+	stats_phase(&stats.display_create, start);
+	trace_end("display_create", 0);
+
 	return d;
 }
 
@@ -5378,6 +6320,7 @@ display_destroy(struct display *display)
 	xkb_context_unref(display->xkb_context);
 
 	theme_destroy(display->theme);
+	destroy_fonts(display);
 	destroy_cursors(display);
 
 #ifdef HAVE_CAIRO_EGL
@@ -5391,6 +6334,14 @@ display_destroy(struct display *display)
 	if (display->xdg_shell)
 		xdg_shell_destroy(display->xdg_shell);
 
+	display_destroy_shm_pools(display);
+
+	if (getenv("WLMESSAGE_BUFFER_STATS"))
+		fprintf(stderr, "shm buffers: %u frames, grown %u times, "
+			"deferred %u times\n", display->buffer_stats.frames,
+			display->buffer_stats.grown,
+			display->buffer_stats.deferred);
+
 	if (display->shm)
 		wl_shm_destroy(display->shm);
 
@@ -5406,14 +6357,61 @@ display_destroy(struct display *display)
 	    !(display->display_fd_events & EPOLLHUP))
 		wl_display_flush(display->display);
 
+	if (display->timeout_fd >= 0)
+		close(display->timeout_fd);
+
 	wl_display_disconnect(display->display);
 	free(display);
 }
 
+static void
+display_timeout_func(struct task *task, uint32_t events)
+{
+	struct display *display =
+		container_of(task, struct display, timeout_task);
+	uint64_t exp;
+
+	if (read(display->timeout_fd, &exp, sizeof exp) != sizeof exp)
+		return;
+
+	display->running = 0;
+}
+
+/* The timeout counts from display_run(), on a timerfd so that the
+ * loop can sleep until something actually happens. */
+static void
+display_arm_timeout(struct display *display)
+{
+	struct itimerspec its;
+
+	if (!display->timeout && display->timeout_fd < 0)
+		return;
+
+	if (display->timeout_fd < 0) {
+		display->timeout_fd = timerfd_create(CLOCK_MONOTONIC,
+						     TFD_CLOEXEC | TFD_NONBLOCK);
+		if (display->timeout_fd < 0) {
+			fprintf(stderr, "could not create timerfd\n: %m");
+			return;
+		}
+		display->timeout_task.run = display_timeout_func;
+		display_watch_fd(display, display->timeout_fd, EPOLLIN,
+				 &display->timeout_task);
+	}
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = display->timeout;
+	its.it_value.tv_nsec = 0;
+	timerfd_settime(display->timeout_fd, 0, &its, NULL);
+}
+
 void
 display_set_timeout(struct display *display, int timeout)
 {
 	display->timeout = timeout;
+	if (display->running)
+		display_arm_timeout(display);
 }
 
 int
@@ -5422,6 +6420,34 @@ display_get_timeout(struct display *display)
 	return display->timeout;
 }
 
+void
+display_set_max_buffers(struct display *display, int count)
+{
+	if (count < MIN_LEAVES)
+		count = MIN_LEAVES;
+	if (count > MAX_LEAVES)
+		count = MAX_LEAVES;
+
+	display->max_buffers = count;
+}
+
+void
+display_set_renderer(struct display *display, enum display_renderer renderer)
+{
+	display->renderer = renderer;
+}
+
+void
+display_use_low_memory(struct display *display)
+{
+	display->low_memory = 1;
+	display_set_max_buffers(display, MIN_LEAVES);
+
+	/* Shadowless: the frames are laid out and drawn without them. */
+	if (display->theme)
+		display->theme->margin = 0;
+}
+
 void
 display_set_user_data(struct display *display, void *data)
 {
@@ -5434,6 +6460,29 @@ display_get_user_data(struct display *display)
 	return display->user_data;
 }
 
+struct glyph_font *
+display_get_font(struct display *display, const char *family,
+		 cairo_font_weight_t weight, double size)
+{
+	struct display_font *font;
+
+	wl_list_for_each(font, &display->font_list, link) {
+		if (font->weight == weight && font->size == size &&
+		    strcmp(font->family, family) == 0)
+			return font->font;
+	}
+
+	font = xzalloc(sizeof *font);
+	font->family = xstrdup(family);
+	font->weight = weight;
+	font->size = size;
+	font->font = glyph_font_create(family, weight, size);
+	fail_on_null(font->font);
+	wl_list_insert(&display->font_list, &font->link);
+
+	return font->font;
+}
+
 struct wl_display *
 display_get_display(struct display *display)
 {
@@ -5454,6 +6503,7 @@ display_has_subcompositor(struct display *display)
 cairo_device_t *
 display_get_cairo_device(struct display *display)
 {
+	display_init_egl(display);
 	return display->argb_device;
 }
 
@@ -5478,6 +6528,7 @@ display_get_serial(struct display *display)
 EGLDisplay
 display_get_egl_display(struct display *d)
 {
+	display_init_egl(d);
 	return d->dpy;
 }
 
@@ -5493,6 +6544,7 @@ display_create_data_source(struct display *display)
 EGLConfig
 display_get_argb_egl_config(struct display *d)
 {
+	display_init_egl(d);
 	return d->argb_config;
 }
 
@@ -5528,7 +6580,7 @@ display_defer(struct display *display, struct task *task)
 	wl_list_insert(&display->deferred_list, &task->link);
 }
 
-void
+int
 display_watch_fd(struct display *display,
 		 int fd, uint32_t events, struct task *task)
 {
@@ -5536,7 +6588,7 @@ display_watch_fd(struct display *display,
 
 	ep.events = events;
 	ep.data.ptr = task;
-	epoll_ctl(display->epoll_fd, EPOLL_CTL_ADD, fd, &ep);
+	return epoll_ctl(display->epoll_fd, EPOLL_CTL_ADD, fd, &ep);
 }
 
 void
@@ -5550,10 +6602,9 @@ display_run(struct display *display)
 {
 	struct task *task;
 	struct epoll_event ep[16];
-	struct timeval current_time;
 	int i, count, ret;
 
-	gettimeofday(&display->time, NULL);
+	display_arm_timeout(display);
 
 	display->running = 1;
 	while (1) {
@@ -5564,13 +6615,6 @@ display_run(struct display *display)
 			task->run(task, 0);
 		}
 
-		if (display->timeout) {
-			gettimeofday(&current_time, NULL);
-
-			if ((current_time.tv_sec - display->time.tv_sec) >= display->timeout)
-				return;
-		}
-
 		wl_display_dispatch_pending(display->display);
 
 		if (!display->running)
@@ -5589,7 +6633,7 @@ display_run(struct display *display)
 		}
 
 		count = epoll_wait(display->epoll_fd,
-				   ep, ARRAY_LENGTH(ep), 200);
+				   ep, ARRAY_LENGTH(ep), -1);
 		for (i = 0; i < count; i++) {
 			task = ep[i].data.ptr;
 			task->run(task, ep[i].events);
@@ -75,12 +75,41 @@ display_set_timeout(struct display *display, int timeout);
 int
 display_get_timeout(struct display *display);
 
+/* Caps the buffers a surface may add while the compositor holds all of
+ * its others.  Also set by WLMESSAGE_MAX_BUFFERS. */
+void
+display_set_max_buffers(struct display *display, int count);
+
+enum display_renderer {
+	DISPLAY_RENDERER_AUTO,		/* EGL for large surfaces only */
+	DISPLAY_RENDERER_SHM,
+	DISPLAY_RENDERER_EGL
+};
+
+/* Picks how the windows created afterwards are rendered.  EGL itself
+ * is only set up once a surface needs it. */
+void
+display_set_renderer(struct display *display, enum display_renderer renderer);
+
+/* Trades looks for memory: shadowless frames, opaque RGB565 (or
+ * XRGB8888) shm buffers, two of them per surface at most and no
+ * decoration cache.  Also set by WLMESSAGE_LOWMEM. */
+void
+display_use_low_memory(struct display *display);
+
 void
 display_set_user_data(struct display *display, void *data);
 
 void *
 display_get_user_data(struct display *display);
 
+struct glyph_font;
+
+/* Fonts are created on first use and live as long as the display. */
+struct glyph_font *
+display_get_font(struct display *display, const char *family,
+		 cairo_font_weight_t weight, double size);
+
 struct wl_display *
 display_get_display(struct display *display);
 
@@ -169,7 +198,7 @@ display_get_pointer_image(struct display *display, int pointer);
 void
 display_defer(struct display *display, struct task *task);
 
-void
+int
 display_watch_fd(struct display *display,
 		 int fd, uint32_t events, struct task *task);
 
@@ -374,6 +403,18 @@ void
 display_surface_damage(struct display *display, cairo_surface_t *cairo_surface,
 		       int32_t x, int32_t y, int32_t width, int32_t height);
 
+/*
+ * Makes window a mirror of source: while both have the same size,
+ * scale, transform and surfaces, every buffer source commits is also
+ * committed to window, which does not draw at all.  Otherwise window
+ * draws itself as usual.  The two windows must create their
+ * subsurfaces in the same order, and source switches to wl_shm
+ * buffers, so call this before it is first drawn.  A NULL source
+ * stops the mirroring.
+ */
+void
+window_set_mirror(struct window *window, struct window *source);
+
 void
 window_set_buffer_type(struct window *window, enum window_buffer_type type);
 
@@ -386,9 +427,19 @@ window_is_fullscreen(struct window *window);
 void
 window_set_fullscreen(struct window *window, int fullscreen);
 
+/* The output a fullscreen or maximized window goes to, NULL letting
+ * the compositor choose. */
+void
+window_set_output(struct window *window, struct output *output);
+
 int
 window_is_maximized(struct window *window);
 
+/* True during an interactive resize, when redraws may cut corners;
+ * a full redraw follows it. */
+int
+window_is_resizing(struct window *window);
+
 void
 window_set_maximized(struct window *window, int maximized);
 
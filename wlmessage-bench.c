@@ -0,0 +1,451 @@
+/* Copyright © 2014 Manuel Bachmann */
+
+ /* wlmessage-bench times the rendering paths of wlmessage and of the
+  * toolkit offscreen, and optionally the time from exec to the first
+  * commit against a headless weston. One JSON object is printed per
+  * line, so runs can be compared with any script. The sources are
+  * included so their static helpers can be timed directly */
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "wlmessage.c"
+#include "toytoolkit/shared/cairo-util.c"
+#include "toytoolkit/shared/image-loader.c"
+
+#define BENCH_MIN_NS (200 * 1000000LL)	/* per benchmark */
+#define BENCH_E2E_RUNS 5
+#define BENCH_E2E_TIMEOUT 5		/* seconds, for weston and each run */
+
+struct bench_context {
+	struct theme *theme;
+	struct frame *frame;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	struct rectangle allocation;
+	uint8_t *data;
+	int width, height;
+
+	struct message_window message_window;
+	struct message_window view_window;	/* with a long text */
+	struct entry entry;
+	struct progress progress;
+	struct message_view view;
+	struct button button;
+};
+
+typedef void (*bench_func_t) (struct bench_context *ctx);
+
+static const char *bench_filter;
+
+static long long
+bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+ /* doubles the iterations until a run lasts long enough to be
+  * meaningful, then reports the last run */
+static void
+bench_run (const char *name, struct bench_context *ctx, bench_func_t func)
+{
+	long long start, elapsed;
+	long iterations, i;
+
+	if (bench_filter && !strstr (name, bench_filter))
+		return;
+
+	func (ctx);	/* warm up caches */
+
+	for (iterations = 1; ; iterations *= 2) {
+		start = bench_now ();
+		for (i = 0; i < iterations; i++)
+			func (ctx);
+		elapsed = bench_now () - start;
+		if (elapsed >= BENCH_MIN_NS / 4 || iterations >= (1L << 30))
+			break;
+	}
+
+	printf ("{\"bench\":\"%s\",\"size\":\"%dx%d\",\"iterations\":%ld,\"ns_per_iter\":%.1f}\n",
+	        name, ctx->width, ctx->height, iterations, (double) elapsed / iterations);
+	fflush (stdout);
+}
+
+static void
+bench_set_size (struct bench_context *ctx, int width, int height)
+{
+	if (ctx->cr)
+		cairo_destroy (ctx->cr);
+	if (ctx->surface)
+		cairo_surface_destroy (ctx->surface);
+	free (ctx->data);
+
+	ctx->width = width;
+	ctx->height = height;
+	ctx->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+	ctx->cr = cairo_create (ctx->surface);
+	ctx->data = xzalloc (width * height * 4);
+
+	ctx->allocation.x = 0;
+	ctx->allocation.y = 0;
+	ctx->allocation.width = width;
+	ctx->allocation.height = height;
+}
+
+ /* toolkit */
+
+static void
+bench_blur (struct bench_context *ctx)
+{
+	blur_surface (ctx->surface, 32);
+}
+
+static void
+bench_tile_mask (struct bench_context *ctx)
+{
+	cairo_set_source_rgba (ctx->cr, 0, 0, 0, 0.45);
+	tile_mask (ctx->cr, ctx->theme->shadow, 2, 2,
+	           ctx->width - 4, ctx->height - 4, 64, 64);
+}
+
+static void
+bench_tile_source (struct bench_context *ctx)
+{
+	tile_source (ctx->cr, ctx->theme->active_frame, 0, 0,
+	             ctx->width, ctx->height,
+	             ctx->theme->width, ctx->theme->titlebar_height);
+}
+
+static void
+bench_theme_render_frame (struct bench_context *ctx)
+{
+	theme_render_frame (ctx->theme, ctx->cr, ctx->width, ctx->height,
+	                    "wlmessage", THEME_FRAME_ACTIVE);
+}
+
+static void
+bench_frame_repaint (struct bench_context *ctx)
+{
+	frame_repaint (ctx->frame, ctx->cr);
+}
+
+static void
+bench_premultiply (struct bench_context *ctx)
+{
+	png_row_info row_info;
+	int i;
+
+	 /* the result depends on the alpha only, so the data can be
+	  * premultiplied again and again */
+	memset (&row_info, 0, sizeof row_info);
+	row_info.rowbytes = ctx->width * 4;
+	for (i = 0; i < ctx->height; i++)
+		premultiply_data (NULL, &row_info, ctx->data + i * ctx->width * 4);
+}
+
+static void
+bench_swizzle (struct bench_context *ctx)
+{
+	swizzle_func_t swizzle = swizzle_select ();
+	int i;
+
+	for (i = 0; i < ctx->height; i++)
+		swizzle (ctx->data + i * ctx->width * 4, ctx->width);
+}
+
+ /* wlmessage */
+
+static void
+bench_message_window_draw (struct bench_context *ctx)
+{
+	message_window_draw (&ctx->message_window, ctx->cr, ctx->allocation, 1);
+}
+
+static void
+bench_message_view_render (struct bench_context *ctx)
+{
+	message_view_render (&ctx->view, 1, ctx->width, 0, ctx->height);
+}
+
+static void
+bench_button_sprites (struct bench_context *ctx)
+{
+	 /* the sprites are kept while the size does not change */
+	button_destroy_sprites (&ctx->button);
+	button_render_sprites (&ctx->button, ctx->allocation, 1);
+}
+
+static void
+bench_entry_draw (struct bench_context *ctx)
+{
+	entry_draw (&ctx->entry, ctx->cr, ctx->allocation);
+}
+
+static void
+bench_progress_draw (struct bench_context *ctx)
+{
+	progress_draw (&ctx->progress, ctx->cr, ctx->allocation);
+}
+
+ /* a keystroke in the middle of a long text, then its removal */
+static void
+bench_entry_edit (struct bench_context *ctx)
+{
+	entry_insert (&ctx->entry, "x", 1);
+	entry_update_glyphs (&ctx->entry);
+	entry_delete (&ctx->entry, 0);
+	entry_update_glyphs (&ctx->entry);
+}
+
+static void
+bench_setup_wlmessage (struct bench_context *ctx)
+{
+	struct message_window *message_window = &ctx->message_window;
+	static char text[64 * 1024];
+	int i, len;
+
+	message_window->message_font = glyph_font_create ("sans", CAIRO_FONT_WEIGHT_NORMAL, 18);
+	message_window->label_font = glyph_font_create ("sans", CAIRO_FONT_WEIGHT_NORMAL, 14);
+	message_window->layout = message_layout_create (message_window->message_font,
+	                                                "Do you want to save the changes\n"
+	                                                "to this document before closing ?",
+	                                                strlen ("Do you want to save the changes\n"
+	                                                        "to this document before closing ?"),
+	                                                NULL);
+	message_window->buttons_nb = 2;
+	message_window->entry = &ctx->entry;
+	wl_list_init (&message_window->button_list);
+
+	ctx->entry.message_window = message_window;
+	ctx->entry.active = 1;
+	for (i = 0, len = 0; i < 20; i++)
+		len += snprintf (text + len, sizeof text - len, "word%d ", i);
+	entry_set_text (&ctx->entry, text);
+	for (i = 0; i < ctx->entry.chars_nb / 2; i++)
+		entry_move (&ctx->entry, 0);
+
+	ctx->progress.message_window = message_window;
+	ctx->progress.value = 42;
+
+	ctx->button.message_window = message_window;
+	ctx->button.caption = "Cancel";
+
+	 /* a long text for the message_view */
+	for (i = 0, len = 0; len < (int) sizeof text - 80; i++)
+		len += snprintf (text + len, sizeof text - len,
+		                 "line %d of a long message, drawn by the view\n", i);
+	ctx->view_window.message_font = message_window->message_font;
+	ctx->view_window.layout = message_layout_create (message_window->message_font,
+	                                                 text, len, NULL);
+	ctx->view.message_window = &ctx->view_window;
+	ctx->view.line_height = 22;
+	ctx->view.ascent = 17;
+}
+
+ /* end to end: exec to the first wl_surface.commit, as reported by
+  * WAYLAND_DEBUG on stderr */
+
+static int
+bench_wait_socket (const char *path)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < BENCH_E2E_TIMEOUT * 100; i++) {
+		if (stat (path, &st) == 0)
+			return 0;
+		usleep (10000);
+	}
+
+	return -1;
+}
+
+static long long
+bench_first_commit (const char *wlmessage, const char *socket_name)
+{
+	char line[4096];
+	long long start, result = -1;
+	pid_t pid;
+	FILE *fp;
+	int fds[2];
+
+	if (pipe (fds) < 0)
+		return -1;
+
+	start = bench_now ();
+	pid = fork ();
+	if (pid < 0) {
+		close (fds[0]);
+		close (fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		dup2 (fds[1], STDERR_FILENO);
+		close (fds[0]);
+		close (fds[1]);
+		setenv ("WAYLAND_DISPLAY", socket_name, 1);
+		setenv ("WAYLAND_DEBUG", "client", 1);
+		execlp (wlmessage, wlmessage, "-no-daemon", "-timeout", "5",
+		        "-buttons", "Yes:1,No:0", "wlmessage-bench", NULL);
+		_exit (127);
+	}
+	close (fds[1]);
+
+	fp = fdopen (fds[0], "r");
+	while (fp && fgets (line, sizeof line, fp)) {
+		if (strstr (line, "wl_surface@") && strstr (line, ".commit(")) {
+			result = bench_now () - start;
+			break;
+		}
+	}
+
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+	if (fp)
+		fclose (fp);
+	else
+		close (fds[0]);
+
+	return result;
+}
+
+static int
+compare_ll (const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_e2e (const char *wlmessage, const char *weston)
+{
+	char socket_name[64], path[PATH_MAX];
+	long long runs[BENCH_E2E_RUNS];
+	const char *runtime_dir, *skipped = NULL;
+	pid_t pid;
+	int i, null_fd;
+
+	if (bench_filter && !strstr ("exec_to_first_commit", bench_filter))
+		return;
+
+	runtime_dir = getenv ("XDG_RUNTIME_DIR");
+	if (!runtime_dir) {
+		skipped = "XDG_RUNTIME_DIR is not set";
+		goto out;
+	}
+
+	snprintf (socket_name, sizeof socket_name, "wlmessage-bench-%d", getpid ());
+	snprintf (path, sizeof path, "%s/%s", runtime_dir, socket_name);
+
+	pid = fork ();
+	if (pid < 0) {
+		skipped = "fork failed";
+		goto out;
+	}
+	if (pid == 0) {
+		char socket_arg[80];
+
+		null_fd = open ("/dev/null", O_WRONLY);
+		if (null_fd >= 0) {
+			dup2 (null_fd, STDOUT_FILENO);
+			dup2 (null_fd, STDERR_FILENO);
+		}
+		snprintf (socket_arg, sizeof socket_arg, "--socket=%s", socket_name);
+		execlp (weston, weston, "--backend=headless-backend.so",
+		        socket_arg, NULL);
+		_exit (127);
+	}
+
+	if (bench_wait_socket (path) < 0) {
+		skipped = "weston did not start";
+	} else {
+		for (i = 0; i < BENCH_E2E_RUNS; i++) {
+			runs[i] = bench_first_commit (wlmessage, socket_name);
+			if (runs[i] < 0) {
+				skipped = "wlmessage did not commit";
+				break;
+			}
+		}
+	}
+
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+
+ out:
+	if (skipped) {
+		printf ("{\"bench\":\"exec_to_first_commit\",\"skipped\":\"%s\"}\n", skipped);
+		return;
+	}
+
+	qsort (runs, BENCH_E2E_RUNS, sizeof runs[0], compare_ll);
+	printf ("{\"bench\":\"exec_to_first_commit\",\"iterations\":%d,"
+	        "\"ns_min\":%lld,\"ns_median\":%lld}\n",
+	        BENCH_E2E_RUNS, runs[0], runs[BENCH_E2E_RUNS / 2]);
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const int sizes[][2] = { { 400, 200 }, { 800, 600 }, { 1920, 1080 } };
+	struct bench_context ctx;
+	const char *wlmessage = NULL, *weston = "weston";
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp (argv[i], "-wlmessage") && i+1 < argc) {
+			wlmessage = argv[++i];
+		} else if (!strcmp (argv[i], "-weston") && i+1 < argc) {
+			weston = argv[++i];
+		} else if (argv[i][0] != '-') {
+			bench_filter = argv[i];
+		} else {
+			printf ("usage: wlmessage-bench [-options] [filter]\n"
+			        "\n"
+			        "where options include:\n"
+			        "    -wlmessage path             also time exec to first commit with this binary\n"
+			        "    -weston path                headless compositor for that (default: weston)\n"
+			        "\n"
+			        "Only benchmarks whose name contains \"filter\" are run.\n");
+			return 1;
+		}
+	}
+
+	memset (&ctx, 0, sizeof ctx);
+	ctx.theme = theme_create ();
+	ctx.frame = frame_create (ctx.theme, 0, 0, 1, FRAME_BUTTON_ALL, "wlmessage");
+	bench_setup_wlmessage (&ctx);
+
+	for (i = 0; i < (int) ARRAY_LENGTH (sizes); i++) {
+		bench_set_size (&ctx, sizes[i][0], sizes[i][1]);
+		frame_resize_inside (ctx.frame, ctx.width, ctx.height);
+
+		bench_run ("blur_surface", &ctx, bench_blur);
+		bench_run ("tile_mask", &ctx, bench_tile_mask);
+		bench_run ("tile_source", &ctx, bench_tile_source);
+		bench_run ("theme_render_frame", &ctx, bench_theme_render_frame);
+		bench_run ("frame_repaint", &ctx, bench_frame_repaint);
+		bench_run ("premultiply_data", &ctx, bench_premultiply);
+		bench_run ("swizzle_row", &ctx, bench_swizzle);
+		bench_run ("message_window_draw", &ctx, bench_message_window_draw);
+
+		 /* the view renders into its own cache */
+		ctx.view.cache = ctx.surface;
+		bench_run ("message_view_render", &ctx, bench_message_view_render);
+	}
+
+	bench_set_size (&ctx, 240, 32);
+	bench_run ("entry_draw", &ctx, bench_entry_draw);
+	bench_run ("entry_edit", &ctx, bench_entry_edit);
+	bench_run ("progress_draw", &ctx, bench_progress_draw);
+	bench_set_size (&ctx, 60, 32);
+	bench_run ("button_sprites", &ctx, bench_button_sprites);
+
+	if (wlmessage)
+		bench_e2e (wlmessage, weston);
+
+	return 0;
+}
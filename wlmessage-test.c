@@ -0,0 +1,187 @@
+/* Copyright © 2014 Manuel Bachmann */
+
+ /* wlmessage-test checks the input handling of wlmessage offscreen,
+  * without a compositor. The sources are included so their static
+  * helpers can be called directly. Failed checks are printed, and
+  * make the exit status 1 for "make check" */
+
+#include "wlmessage.c"
+
+static int test_failures;
+
+static void
+test_check (int condition, const char *test, const char *what)
+{
+	if (condition)
+		return;
+
+	fprintf (stderr, "%s: %s\n", test, what);
+	test_failures++;
+}
+
+static void
+test_entry_init (struct entry *entry, struct message_window *message_window)
+{
+	memset (entry, 0, sizeof *entry);
+	entry->message_window = message_window;
+	message_window->entry = entry;
+	entry_set_text (entry, "");
+}
+
+static void
+test_entry_fini (struct entry *entry)
+{
+	free (entry->buffer);
+	free (entry->text);
+	free (entry->glyphs);
+	free (entry->offsets);
+}
+
+ /* -all-outputs : clicking the entry of the second copy, then typing
+  * there ; the key reaches key_handler with that copy's user data */
+static void
+test_all_outputs_entry (void)
+{
+	struct message_window first, copy;
+	struct entry first_entry, copy_entry;
+
+	memset (&first, 0, sizeof first);
+	memset (&copy, 0, sizeof copy);
+	first.keyboard = &first;
+	first.mirror = &copy;
+	copy.keyboard = &first;
+	test_entry_init (&first_entry, &first);
+	test_entry_init (&copy_entry, &copy);
+
+	test_check (entry_activate (&copy_entry, NULL) == &first_entry,
+	            __func__, "the click did not go to the first copy");
+
+	key_handler (NULL, NULL, 0, 0, XKB_KEY_a, WL_KEYBOARD_KEY_STATE_PRESSED, &copy);
+	test_check (!strcmp (entry_get_text (&first_entry), "a"),
+	            __func__, "the text did not reach the first copy");
+
+	 /* a copy drawing on its own, on an output of another size */
+	test_check (!strcmp (entry_get_text (&copy_entry), "a") &&
+	            copy_entry.cursor == 1 && copy_entry.active,
+	            __func__, "the copy does not show the text typed");
+
+	test_entry_fini (&first_entry);
+	test_entry_fini (&copy_entry);
+}
+
+ /* Home and End reach an active entry before a scrolling message */
+static void
+test_entry_keys_before_view (void)
+{
+	struct message_window message_window;
+	struct message_view view;
+	struct entry entry;
+
+	memset (&message_window, 0, sizeof message_window);
+	memset (&view, 0, sizeof view);
+	message_window.keyboard = &message_window;
+	message_window.view = &view;
+	test_entry_init (&entry, &message_window);
+	entry_set_text (&entry, "abc");
+	entry.active = 1;
+
+	test_check (message_window_key (&message_window, XKB_KEY_Home) == &entry &&
+	            entry.cursor == 0, __func__, "Home did not move the cursor");
+	test_check (message_window_key (&message_window, XKB_KEY_End) == &entry &&
+	            entry.cursor == 3, __func__, "End did not move the cursor");
+
+	test_entry_fini (&entry);
+}
+
+ /* the daemon's dialogs, without a display */
+static struct daemon_client *test_dialog_client;
+static struct message_window test_dialog;
+
+static struct message_window *
+test_dialog_create (struct daemon_client *client)
+{
+	test_dialog_client = client;
+	return &test_dialog;
+}
+
+static void
+test_dialog_destroy (struct daemon_client *client)
+{
+	if (test_dialog_client == client)
+		test_dialog_client = NULL;
+}
+
+static void
+test_client_unwatch (struct daemon_client *client)
+{
+}
+
+static const struct daemon_interface test_daemon_interface = {
+	test_dialog_create,
+	test_dialog_destroy,
+	test_client_unwatch
+};
+
+static struct daemon_client *
+test_daemon_client (struct daemon *daemon, int *peer)
+{
+	struct daemon_client *client;
+	int fds[2];
+
+	if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+		return NULL;
+
+	client = xzalloc (sizeof *client);
+	client->daemon = daemon;
+	client->fd = fds[0];
+	client->task.run = daemon_client_data;
+	client->ready = 1;
+	wl_list_insert (daemon->client_list.prev, &client->link);
+	*peer = fds[1];
+
+	return client;
+}
+
+ /* client A hangs up while its dialog shows : B's dialog opens */
+static void
+test_daemon_client_gone (void)
+{
+	struct daemon daemon;
+	struct daemon_client *a, *b, *client, *tmp;
+	int peer_a, peer_b;
+
+	memset (&daemon, 0, sizeof daemon);
+	daemon.interface = &test_daemon_interface;
+	wl_list_init (&daemon.client_list);
+
+	a = test_daemon_client (&daemon, &peer_a);
+	b = test_daemon_client (&daemon, &peer_b);
+	if (!a || !b) {
+		test_check (0, __func__, "no socket pair");
+		return;
+	}
+
+	daemon_process (&daemon);
+	test_check (daemon.current == a && test_dialog_client == a,
+	            __func__, "the first client has no dialog");
+
+	close (peer_a);
+	a->task.run (&a->task, EPOLLIN | EPOLLHUP);
+	test_check (daemon.current == b && test_dialog_client == b,
+	            __func__, "the queued client got no dialog");
+
+	daemon.closing = 1;
+	wl_list_for_each_safe (client, tmp, &daemon.client_list, link)
+		daemon_client_destroy (client);
+	close (peer_b);
+}
+
+int
+main (int argc, char *argv[])
+{
+	test_all_outputs_entry ();
+	test_entry_keys_before_view ();
+	test_daemon_client_gone ();
+
+	return test_failures ? 1 : 0;
+}
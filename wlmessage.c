@@ -1,100 +1,685 @@
 /* Copyright © 2014 Manuel Bachmann */
 
 #include <linux/input.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <glib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
 #include <wayland-client.h>
 
 #include "window.h"
+#include "shared/glyph-cache.h"
+#include "shared/image-cache.h"
+#include "shared/image-loader.h"
+#include "shared/worker.h"
+#include "shared/trace.h"
+#include "shared/stats.h"
 #include "text-client-protocol.h"
 #define MAX_LINES 6
+#define MAX_LINE_BYTES 1024
+#define MAX_REQUEST_SIZE (1024 * 1024)
+#define WRITE_TIMEOUT 1000		/* ms a client may leave its socket full */
+#define VIEW_PADDING 4
+#define VIEW_RESIZE_SLACK 128		/* cache growth while resizing */
+#define ICON_SIZE 64
+#define ICON_SCALES 2		/* 1x and 2x, for HiDPI outputs */
 
 
+struct dialog_spec {
+	char *message;
+	char *file;
+	char *title;
+	char *titlebuttons;
+	int noresize;
+	char *buttons;
+	char *icon;
+	int timeout;
+	char *deflt;
+	char *textfield;
+	char *progress;
+	int stdin_updates;
+};
+
+struct message_window;
+
+struct message_layout {
+	const char *data;		/* message text, not NUL-terminated */
+	size_t size;
+	void *map;			/* file mapping behind "data", if any */
+
+	size_t *offsets;		/* start of every line found so far */
+	int offsets_nb;
+	int offsets_size;
+	int complete;			/* the whole text has been indexed */
+
+	int lines_nb;
+	struct {
+		struct glyph_run *run;	/* first lines, shaped once */
+		double width, height;
+	} lines[MAX_LINES];
+	double width;			/* widest line */
+	int scroll;			/* too many lines, use a message_view */
+
+	char line[MAX_LINE_BYTES + 1];
+};
+
+ /* allocations that go away together : blocks are chained and only
+  * freed by arena_release(), which leaves the arena empty and usable */
+#define ARENA_BLOCK_SIZE 4096
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct arena {
+	struct arena_block *block;
+};
+
+static void *
+arena_alloc (struct arena *arena, size_t size)
+{
+	struct arena_block *block = arena->block;
+	size_t block_size;
+	void *p;
+
+	size = (size + 15) & ~(size_t) 15;
+	if (!block || block->size - block->used < size) {
+		block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = xmalloc (sizeof *block + block_size);
+		block->next = arena->block;
+		block->used = 0;
+		block->size = block_size;
+		arena->block = block;
+	}
+
+	p = block->data + block->used;
+	block->used += size;
+
+	return p;
+}
+
+static char *
+arena_strndup (struct arena *arena, const char *text, size_t len)
+{
+	char *copy = arena_alloc (arena, len + 1);
+
+	memcpy (copy, text, len);
+	copy[len] = '\0';
+
+	return copy;
+}
+
+static void
+arena_release (struct arena *arena)
+{
+	struct arena_block *block, *next;
+
+	for (block = arena->block; block; block = next) {
+		next = block->next;
+		free (block);
+	}
+	arena->block = NULL;
+}
+
+ /* called once when the dialog is answered ; "text" is NULL when
+  * there is no text field or the dialog was closed/timed out */
+typedef void (*message_done_func_t) (struct message_window *message_window,
+                                     int value, const char *text, void *data);
+
 struct message_window {
 	struct window *window;
 	struct widget *widget;
 	cairo_surface_t *surface;
+	struct display *display;
 
 	char *message;
+	struct message_layout *layout;
+	struct message_view *view;
 	char *title;
-	cairo_surface_t *icon;
+	struct glyph_font *message_font;
+	struct glyph_font *label_font;	/* buttons and entry */
+	char *icon_filename;
+	cairo_surface_t *icons[ICON_SCALES];
+	struct worker icon_worker;
+	int icon_pending;
 	struct entry *entry;
 	int buttons_nb;
 	struct wl_list button_list;
+	struct arena button_arena;	/* the buttons and their captions */
+	int default_value;
+	struct progress *progress;
+
+	int timer_fd;
+	struct task timer_task;
+
+	message_done_func_t done;
+	void *done_data;
+	int finished;
+
+	struct message_window *mirror;	/* next copy, with -all-outputs */
+	struct message_window *keyboard;	/* whose entry gets the keys */
+	struct output *output;		/* of a copy, which goes with it */
 };
 
 struct button {
+	struct message_window *message_window;
 	struct widget *widget;
 	int focused, pressed;
 	struct wl_list link;
+	cairo_surface_t *sprites[3];	/* one per button_state */
 
 	char *caption;
 	int value;
 };
 
 struct entry {
+	struct message_window *message_window;
 	struct widget *widget;
 	int active;
 
 	struct wl_text_input *text_input;
-	char *text;
-	int cursor_pos;
-	int cursor_anchor;
 	int last_vkb_len;
+
+	 /* the text is a gap buffer, with the gap at the cursor */
+	char *buffer;
+	int size;
+	int gap_start;
+	int gap_end;
+	int chars_nb;
+	int cursor;			/* in characters */
+	char *text;			/* contiguous copy, NULL when outdated */
+
+	 /* one glyph per character ; offsets[i] is where character i
+	  * starts and offsets[chars_nb] is the text width. Both are valid
+	  * up to character "shaped", so edits reshape from there on */
+	cairo_glyph_t *glyphs;
+	double *offsets;
+	int glyphs_size;
+	int shaped;
+	double scroll;			/* when the text is wider than the field */
+};
+
+struct progress {
+	struct message_window *message_window;
+	struct widget *widget;
+	int value;			/* percentage, -1 when indeterminate */
+};
+
+struct message_view {
+	struct message_window *message_window;
+	struct widget *widget;
+	int line_height;
+	int ascent;
+	int scroll;			/* pixels above the visible area */
+
+	cairo_surface_t *cache;		/* visible rows as last drawn */
+	int cache_width, cache_height;	/* the part in use */
+	int cache_scale;		/* buffer scale it was drawn at */
+	int cache_scroll;
+	int cache_valid;
+};
+
+struct daemon_client;
+
+ /* what the daemon does with the display, so that wlmessage-test can
+  * run its queue without one */
+struct daemon_interface {
+	struct message_window *(*dialog_create) (struct daemon_client *client);
+	void (*dialog_destroy) (struct daemon_client *client);
+	void (*unwatch) (struct daemon_client *client);
+};
+
+struct daemon {
+	struct display *display;
+	const struct daemon_interface *interface;
+	char *path;
+	int fd;
+	struct task task;
+	struct wl_list client_list;
+	struct daemon_client *current;
+	struct task next_task;
+	int next_scheduled;
+	int closing;			/* no more dialogs get opened */
 };
 
-void message_window_destroy ();
+struct daemon_client {
+	struct daemon *daemon;
+	struct wl_list link;
+	int fd;
+	struct task task;
+
+	uint32_t size;
+	uint32_t len;
+	char *request;
+	int ready;
+	struct dialog_spec spec;
+	struct message_window *message_window;
+};
+
+void message_window_destroy (struct message_window *message_window);
+void message_window_finish (struct message_window *message_window, int value, int with_text);
 
-struct message_window *message_window;
 struct wl_text_input_manager *text_input_manager;
-int default_value;
 
+ /* -lowmem and -renderer, for every display of the process */
+static int low_memory;
+static enum display_renderer renderer = DISPLAY_RENDERER_AUTO;
 
-int
-get_number_of_lines (char *text)
+ /* -all-outputs, for the dialog shown in-process */
+static int all_outputs;
+
+
+static void
+message_layout_destroy (struct message_layout *layout)
 {
-	int lines_num = 0;
+	int i;
 
-	gchar **lines = g_strsplit (text, "\n", -1);
+	for (i = 0; i < layout->lines_nb; i++)
+		glyph_run_destroy (layout->lines[i].run);
+	if (layout->map)
+		munmap (layout->map, layout->size);
+	free (layout->offsets);
+	free (layout);
+}
 
-	if ( lines ) {
-	  while ((lines[lines_num] != NULL) && (lines_num < MAX_LINES))
-	    lines_num++;
+ /* finds line starts until "line" is known or the text ends ;
+  * returns the number of lines known */
+static int
+message_layout_index (struct message_layout *layout, int line)
+{
+	const char *end;
+	size_t start;
+
+	while (!layout->complete && layout->offsets_nb <= line) {
+		start = layout->offsets[layout->offsets_nb - 1];
+		end = memchr (layout->data + start, '\n', layout->size - start);
+		if (!end) {
+			layout->complete = 1;
+			break;
+		}
 
-	  g_strfreev (lines);
+		if (layout->offsets_nb == layout->offsets_size) {
+			layout->offsets_size *= 2;
+			layout->offsets = (size_t *) xrealloc ((char *) layout->offsets,
+			                                      layout->offsets_size * sizeof *layout->offsets);
+		}
+		layout->offsets[layout->offsets_nb++] = end + 1 - layout->data;
 	}
 
-	return lines_num;
+	return layout->offsets_nb;
 }
 
-int
-get_max_length_of_lines (char *text)
+ /* copies at most "max" bytes of a line, stopping on a UTF-8
+  * character boundary ; returns the copied length or -1 */
+static int
+message_layout_copy_line (struct message_layout *layout, int line,
+                          char *dest, size_t max)
+{
+	size_t start, len;
+
+	if (message_layout_index (layout, line + 1) <= line)
+		return -1;
+
+	start = layout->offsets[line];
+	if (line + 1 < layout->offsets_nb)
+		len = layout->offsets[line + 1] - 1 - start;
+	else
+		len = layout->size - start;
+
+	if (len > max) {
+		len = max;
+		while (len > 0 && (layout->data[start + len] & 0xc0) == 0x80)
+			len--;
+	}
+	memcpy (dest, layout->data + start, len);
+	dest[len] = '\0';
+
+	return len;
+}
+
+ /* returns a line as a string valid until the next call, NULL
+  * past the end */
+static const char *
+message_layout_get_line (struct message_layout *layout, int line)
+{
+	if (message_layout_copy_line (layout, line, layout->line, MAX_LINE_BYTES) < 0)
+		return NULL;
+
+	return layout->line;
+}
+
+ /* indexes and measures the first lines only, so the cost does not
+  * depend on the text size ; redraws then only place them */
+static struct message_layout *
+message_layout_create (struct glyph_font *font,
+                       const char *data, size_t size, void *map)
+{
+	struct message_layout *layout;
+	struct glyph_run *run;
+	int i, len;
+
+	layout = xzalloc (sizeof *layout);
+	layout->data = data;
+	layout->size = size;
+	layout->map = map;
+
+	layout->offsets_size = 64;
+	layout->offsets = xmalloc (layout->offsets_size * sizeof *layout->offsets);
+	layout->offsets[0] = 0;
+	layout->offsets_nb = 1;
+
+	layout->scroll = message_layout_index (layout, MAX_LINES) > MAX_LINES;
+	layout->lines_nb = layout->scroll ? MAX_LINES : layout->offsets_nb;
+
+	for (i = 0; i < layout->lines_nb; i++) {
+		len = message_layout_copy_line (layout, i, layout->line, MAX_LINE_BYTES);
+		run = glyph_run_create (font, layout->line, len);
+		fail_on_null (run);
+		layout->lines[i].run = run;
+		layout->lines[i].width = run->extents.width;
+		layout->lines[i].height = run->extents.height;
+		if (run->extents.width > layout->width)
+			layout->width = run->extents.width;
+	}
+
+	return layout;
+}
+
+ /* maps the file instead of reading it, so only the pages actually
+  * displayed are ever loaded */
+static struct message_layout *
+message_layout_create_from_file (struct glyph_font *font, const char *filename)
+{
+	struct stat st;
+	void *map = NULL;
+	int fd;
+
+	fd = open (filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat (fd, &st) < 0) {
+		fprintf (stderr, "could not open %s: %m\n", filename);
+		if (fd >= 0)
+			close (fd);
+		return message_layout_create (font, "", 0, NULL);
+	}
+
+	if (st.st_size > 0) {
+		map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf (stderr, "could not map %s: %m\n", filename);
+			map = NULL;
+		}
+	}
+	close (fd);
+
+	if (!map)
+		return message_layout_create (font, "", 0, NULL);
+
+	madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+	return message_layout_create (font, map, st.st_size, map);
+}
+
+
+static int
+utf8_next (const char *text, int pos, int end)
+{
+	for (pos++; pos < end && (text[pos] & 0xc0) == 0x80; pos++);
+	return pos;
+}
+
+static int
+utf8_prev (const char *text, int pos)
+{
+	for (pos--; pos > 0 && (text[pos] & 0xc0) == 0x80; pos--);
+	return pos;
+}
+
+static int
+utf8_count (const char *text, int len)
+{
+	int i, n = 0;
+
+	for (i = 0; i < len; i++)
+		if ((text[i] & 0xc0) != 0x80)
+			n++;
+	return n;
+}
+
+static void
+entry_set_text (struct entry *entry, const char *text)
+{
+	int len = strlen (text);
+
+	free (entry->buffer);
+	entry->size = len + 64;
+	entry->buffer = xmalloc (entry->size);
+	memcpy (entry->buffer, text, len);
+
+	 /* a stray continuation byte can't start the text */
+	if (len > 0 && (entry->buffer[0] & 0xc0) == 0x80)
+		entry->buffer[0] = '?';
+
+	entry->gap_start = len;
+	entry->gap_end = entry->size;
+	entry->chars_nb = utf8_count (entry->buffer, len);
+	entry->cursor = entry->chars_nb;
+	entry->shaped = 0;
+	free (entry->text);
+	entry->text = NULL;
+}
+
+ /* the text as a string, valid until the next edit */
+static const char *
+entry_get_text (struct entry *entry)
+{
+	int tail = entry->size - entry->gap_end;
+
+	if (!entry->text) {
+		entry->text = xmalloc (entry->gap_start + tail + 1);
+		memcpy (entry->text, entry->buffer, entry->gap_start);
+		memcpy (entry->text + entry->gap_start, entry->buffer + entry->gap_end, tail);
+		entry->text[entry->gap_start + tail] = '\0';
+	}
+
+	return entry->text;
+}
+
+ /* everything from character "index" on has to be shaped again */
+static void
+entry_changed (struct entry *entry, int index)
+{
+	if (entry->shaped > index)
+		entry->shaped = index;
+	free (entry->text);
+	entry->text = NULL;
+}
+
+static void
+entry_insert (struct entry *entry, const char *text, int len)
+{
+	int tail = entry->size - entry->gap_end;
+	int size;
+
+	if (entry->gap_end - entry->gap_start < len) {
+		size = entry->size * 2 + len;
+		entry->buffer = xrealloc (entry->buffer, size);
+		memmove (entry->buffer + size - tail, entry->buffer + entry->gap_end, tail);
+		entry->gap_end = size - tail;
+		entry->size = size;
+	}
+
+	memcpy (entry->buffer + entry->gap_start, text, len);
+	entry->gap_start += len;
+	entry_changed (entry, entry->cursor);
+	entry->chars_nb += utf8_count (text, len);
+	entry->cursor += utf8_count (text, len);
+}
+
+static void
+entry_delete (struct entry *entry, int forward)
 {
-	int lines_num = 0;
-	int length = 0;
+	if (forward && entry->gap_end < entry->size) {
+		entry->gap_end = utf8_next (entry->buffer, entry->gap_end, entry->size);
+	} else if (!forward && entry->gap_start > 0) {
+		entry->gap_start = utf8_prev (entry->buffer, entry->gap_start);
+		entry->cursor--;
+	} else {
+		return;
+	}
+
+	entry->chars_nb--;
+	entry_changed (entry, entry->cursor);
+}
 
-	gchar **lines = g_strsplit (text, "\n", -1);
-	
-	if ( lines ) {
-	  while ((lines[lines_num] != NULL) && (lines_num < MAX_LINES)) {
-	    if (strlen (lines[lines_num]) > length)
-	      length = strlen (lines[lines_num]);
-	    lines_num++;
-	  }
-	  g_strfreev (lines);
+ /* moves the gap one character, the text itself doesn't change */
+static void
+entry_move (struct entry *entry, int forward)
+{
+	int pos, len;
+
+	if (forward && entry->gap_end < entry->size) {
+		pos = utf8_next (entry->buffer, entry->gap_end, entry->size);
+		len = pos - entry->gap_end;
+		memmove (entry->buffer + entry->gap_start, entry->buffer + entry->gap_end, len);
+		entry->gap_start += len;
+		entry->gap_end = pos;
+		entry->cursor++;
+	} else if (!forward && entry->gap_start > 0) {
+		pos = utf8_prev (entry->buffer, entry->gap_start);
+		len = entry->gap_start - pos;
+		memmove (entry->buffer + entry->gap_end - len, entry->buffer + pos, len);
+		entry->gap_start = pos;
+		entry->gap_end -= len;
+		entry->cursor--;
 	}
+}
 
-	return length;
+ /* after a change to the keyboard copy's entry : the -all-outputs
+  * copies that draw their own buffers show its text and cursor too */
+static void
+entry_schedule_redraw (struct entry *entry)
+{
+	struct message_window *copy;
+	struct entry *other;
+
+	 /* offscreen, in wlmessage-test, entries have no widget */
+	if (entry->widget)
+		widget_schedule_redraw (entry->widget);
+
+	for (copy = entry->message_window->mirror; copy; copy = copy->mirror) {
+		other = copy->entry;
+		if (!other)
+			continue;
+
+		entry_set_text (other, entry_get_text (entry));
+		while (other->cursor > entry->cursor)
+			entry_move (other, 0);
+		other->active = entry->active;
+		if (other->widget)
+			widget_schedule_redraw (other->widget);
+	}
 }
 
-char **
-get_lines (char *text)
+ /* shapes "n" characters held in "len" bytes, starting at pen position
+  * "x", and returns the pen position after them */
+static double
+entry_shape (struct glyph_font *font, const char *text, int len, int n,
+             cairo_glyph_t *glyphs, double *offsets, double x)
 {
-	gchar **lines = g_strsplit (text, "\n", -1);
+	struct glyph_run *run;
+	int i, pos, next;
+
+	if (n == 0)
+		return x;
 
-	return lines;
+	run = glyph_run_create (font, text, len);
+
+	if (run->num_glyphs == n) {
+		for (i = 0; i < n; i++) {
+			glyphs[i] = run->glyphs[i];
+			glyphs[i].x += x;
+			offsets[i] = glyphs[i].x;
+		}
+		x += run->extents.x_advance;
+	} else if (n > 1) {
+		 /* not one glyph per character : go one character at a time */
+		for (i = 0, pos = 0; i < n; i++, pos = next) {
+			next = utf8_next (text, pos, len);
+			x = entry_shape (font, text + pos, next - pos, 1,
+			                 glyphs + i, offsets + i, x);
+		}
+	} else {
+		glyphs[0].index = run->num_glyphs ? run->glyphs[0].index : 0;
+		glyphs[0].x = x;
+		glyphs[0].y = 0;
+		offsets[0] = x;
+		x += run->extents.x_advance;
+	}
+
+	glyph_run_destroy (run);
+
+	return x;
 }
 
+ /* brings glyphs and offsets up to date, from the first edit on */
+static void
+entry_update_glyphs (struct entry *entry)
+{
+	struct glyph_font *font = entry->message_window->label_font;
+	int i, n, pos;
+	double x;
+
+	if (entry->shaped == entry->chars_nb && entry->offsets)
+		return;
+
+	if (entry->glyphs_size < entry->chars_nb + 1) {
+		entry->glyphs_size = entry->chars_nb + 32;
+		entry->glyphs = (cairo_glyph_t *) xrealloc ((char *) entry->glyphs,
+		                                            entry->glyphs_size * sizeof *entry->glyphs);
+		entry->offsets = (double *) xrealloc ((char *) entry->offsets,
+		                                      entry->glyphs_size * sizeof *entry->offsets);
+	}
+	if (entry->shaped == 0)
+		entry->offsets[0] = 0;
+
+	i = entry->shaped;
+	x = entry->offsets[i];
+
+	 /* what needs shaping may start before the gap */
+	if (i < entry->cursor) {
+		pos = entry->gap_start;
+		for (n = i; n < entry->cursor; n++)
+			pos = utf8_prev (entry->buffer, pos);
+		x = entry_shape (font, entry->buffer + pos, entry->gap_start - pos,
+		                 entry->cursor - i, entry->glyphs + i, entry->offsets + i, x);
+		i = entry->cursor;
+	}
+
+	pos = entry->gap_end;
+	for (n = entry->cursor; n < i; n++)
+		pos = utf8_next (entry->buffer, pos, entry->size);
+	x = entry_shape (font, entry->buffer + pos, entry->size - pos,
+	                 entry->chars_nb - i, entry->glyphs + i, entry->offsets + i, x);
+
+	entry->offsets[entry->chars_nb] = x;
+	entry->shaped = entry->chars_nb;
+}
 
 static void
 text_input_enter(void *data,
@@ -131,28 +716,22 @@ text_input_preedit_string(void *data,
                           const char *commit)
 {
 	struct entry *entry = data;
-	char *new_text;
-
-	if (strlen(entry->text) >= 18)
-		return;
+	int len = strlen (text);
 
 	 /* workaround to prevent using Backspace for now */
-	if (strlen(text) < entry->last_vkb_len) {
-		entry->last_vkb_len = strlen(text);
+	if (len < entry->last_vkb_len) {
+		entry->last_vkb_len = len;
 		return;
 	} else {
-		entry->last_vkb_len = strlen(text);
+		entry->last_vkb_len = len;
 	}
 
-	new_text = malloc (strlen(entry->text) + 1 + 1);
-	strncpy (new_text, entry->text, entry->cursor_pos);
-	strcpy (new_text+entry->cursor_pos, text+(strlen(text)-1));
-	strcpy (new_text+entry->cursor_pos+1, entry->text+entry->cursor_pos);
-	free (entry->text);
-	entry->text = new_text;
-	entry->cursor_pos++;
+	 /* the last character is the one just typed */
+	if (len > 0)
+		entry_insert (entry, text + utf8_prev (text, len),
+		              len - utf8_prev (text, len));
 
-	widget_schedule_redraw (entry->widget);
+	entry_schedule_redraw (entry);
 }
 
 static void
@@ -197,40 +776,27 @@ text_input_keysym(void *data,
                   uint32_t modifiers)
 {
 	struct entry *entry = data;
-	char *new_text;
 
 	if (state == WL_KEYBOARD_KEY_STATE_PRESSED)
 		return;
 
 	 /* use Tab as Backspace until I figure this out */
-	if (sym == XKB_KEY_Tab) {
-		if (entry->cursor_pos != 0) {
-			new_text = malloc (strlen(entry->text));
-			strncpy (new_text, entry->text, entry->cursor_pos - 1);
-			strcpy (new_text+entry->cursor_pos-1, entry->text+entry->cursor_pos);
-			free (entry->text);
-			entry->text = new_text;
-			entry->cursor_pos--;
-		}
-	}	
+	if (sym == XKB_KEY_Tab)
+		entry_delete (entry, 0);
 
-	if (sym == XKB_KEY_Left) {
-		if (entry->cursor_pos != 0)
-			entry->cursor_pos--;
-	}
+	if (sym == XKB_KEY_Left)
+		entry_move (entry, 0);
 
-	if (sym == XKB_KEY_Right) {
-		if (entry->cursor_pos != strlen (entry->text))
-			entry->cursor_pos++;
-	}
+	if (sym == XKB_KEY_Right)
+		entry_move (entry, 1);
 
 	if (sym == XKB_KEY_Return) {
-		fprintf (stdout, entry->text);
-		message_window_destroy ();
-		exit (default_value);
+		message_window_finish (entry->message_window,
+		                       entry->message_window->default_value, 1);
+		return;
 	}
 
-	widget_schedule_redraw (entry->widget);
+	entry_schedule_redraw (entry);
 }
 
 static void
@@ -267,12 +833,20 @@ static const struct wl_text_input_listener text_input_listener = {
 
 
 void
-button_send_activate (int value)
+message_window_finish (struct message_window *message_window, int value, int with_text)
 {
-	if (message_window->entry)
-		fprintf (stdout, message_window->entry->text);
-	message_window_destroy ();
-	exit (value);
+	const char *text = NULL;
+
+	if (message_window->finished)
+		return;
+	message_window->finished = 1;
+
+	trace_instant ("dialog_done", value);
+
+	if (with_text && message_window->entry)
+		text = entry_get_text (message_window->entry);
+
+	message_window->done (message_window, value, text, message_window->done_data);
 }
 
 static void
@@ -289,7 +863,7 @@ button_click_handler(struct widget *widget,
 		button->pressed = 1;
 	} else {
 		button->pressed = 0;
-		button_send_activate (button->value);
+		message_window_finish (button->message_window, button->value, 1);
 	}
 }
 
@@ -314,7 +888,7 @@ button_touch_up_handler(struct widget *widget, struct input *input,
 	button->focused = 0;
 	widget_schedule_redraw (widget);
 
-	button_send_activate (button->value);
+	message_window_finish (button->message_window, button->value, 1);
 }
 
 static int
@@ -339,49 +913,133 @@ button_leave_handler(struct widget *widget,
 	widget_schedule_redraw (widget);
 }
 
+enum button_state {
+	BUTTON_NORMAL,
+	BUTTON_FOCUSED,
+	BUTTON_PRESSED,
+	BUTTON_STATES
+};
+
+ /* sprites cover the allocation, the 1-pixel pressed offset and half
+  * of the stroke on each side */
+#define BUTTON_SPRITE_MARGIN 1
+
+static void
+button_destroy_sprites (struct button *button)
+{
+	int i;
+
+	for (i = 0; i < BUTTON_STATES; i++) {
+		if (button->sprites[i])
+			cairo_surface_destroy (button->sprites[i]);
+		button->sprites[i] = NULL;
+	}
+}
+
+ /* renders every state once, so redraws are a single blit */
+static void
+button_render_sprites (struct button *button, struct rectangle allocation,
+                       int scale)
+{
+	struct message_window *message_window = button->message_window;
+	const struct glyph_run *run;
+	cairo_t *cr;
+	int width, height, offset, i;
+
+	width = (allocation.width + 3*BUTTON_SPRITE_MARGIN) * scale;
+	height = (allocation.height + 3*BUTTON_SPRITE_MARGIN) * scale;
+
+	if (button->sprites[0] &&
+	    cairo_image_surface_get_width (button->sprites[0]) == width &&
+	    cairo_image_surface_get_height (button->sprites[0]) == height)
+		return;
+
+	button_destroy_sprites (button);
+	run = glyph_font_get_run (message_window->label_font, button->caption);
+
+	for (i = 0; i < BUTTON_STATES; i++) {
+		button->sprites[i] = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+		                                                 width, height);
+		offset = BUTTON_SPRITE_MARGIN + (i == BUTTON_PRESSED ? 1 : 0);
+
+		cr = cairo_create (button->sprites[i]);
+		cairo_scale (cr, scale, scale);
+		cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+		cairo_rectangle (cr, offset, offset,
+		                 allocation.width, allocation.height);
+		if (i != BUTTON_NORMAL)
+			cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
+		else
+			cairo_set_source_rgb (cr, 0.9, 0.9, 0.9);
+		cairo_fill (cr);
+		cairo_set_line_width (cr, 1);
+		cairo_rectangle (cr, offset, offset,
+		                 allocation.width, allocation.height);
+		cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
+		cairo_stroke (cr);
+		if (run)
+			glyph_font_show (message_window->label_font, cr, run,
+			                 offset + (allocation.width - run->extents.width)/2,
+			                 offset + (allocation.height - run->extents.height)/2 + 10);
+		cairo_destroy (cr);
+	}
+}
+
 static void
 button_redraw_handler (struct widget *widget, void *data)
 {
 	struct button *button = data;
+	struct message_window *message_window = button->message_window;
 	struct rectangle allocation;
 	cairo_t *cr;
-	cairo_text_extents_t extents;
+	int scale, state;
 
 	widget_get_allocation (widget, &allocation);
-	if (button->pressed) {
-		allocation.x++;
-		allocation.y++;
-	}
+	scale = window_get_buffer_scale (message_window->window);
 
-	cr = widget_cairo_create (message_window->widget);
-	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-	cairo_rectangle (cr,
-			allocation.x,
-			allocation.y,
-			allocation.width,
-			allocation.height);
-	if (button->focused)
-		cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
+	 /* no-op unless the scale changed since the last resize */
+	button_render_sprites (button, allocation, scale);
+
+	if (button->pressed)
+		state = BUTTON_PRESSED;
+	else if (button->focused)
+		state = BUTTON_FOCUSED;
 	else
-		cairo_set_source_rgb (cr, 0.9, 0.9, 0.9);
-	cairo_fill (cr);
-	cairo_set_line_width (cr, 1);
-	cairo_rectangle (cr,
-			allocation.x,
-			allocation.y,
-			allocation.width,
-			allocation.height);
-	cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
-	cairo_stroke_preserve(cr);
-	cairo_select_font_face (cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-	cairo_set_font_size (cr, 14);
-	cairo_text_extents (cr, button->caption, &extents);
-	cairo_move_to (cr, allocation.x + (allocation.width - extents.width)/2,
-                           allocation.y + (allocation.height - extents.height)/2 + 10);
-	cairo_show_text (cr, button->caption);
+		state = BUTTON_NORMAL;
+
+	cr = widget_cairo_create (widget);
+	cairo_translate (cr, allocation.x - BUTTON_SPRITE_MARGIN,
+	                     allocation.y - BUTTON_SPRITE_MARGIN);
+	cairo_scale (cr, 1.0/scale, 1.0/scale);
+	cairo_set_source_surface (cr, button->sprites[state], 0.0, 0.0);
+	cairo_paint (cr);
 	cairo_destroy (cr);
 }
 
+ /* keys go to the entry of the "keyboard" copy, so a click on any
+  * -all-outputs copy activates that one */
+static struct entry *
+entry_activate (struct entry *entry, struct input *input)
+{
+	struct entry *target = entry->message_window->keyboard->entry;
+
+	if (input && text_input_manager) {
+		if (!target->text_input) {
+			target->text_input = wl_text_input_manager_create_text_input (text_input_manager);
+			wl_text_input_add_listener (target->text_input, &text_input_listener, target);
+		}
+
+		struct wl_seat *seat = input_get_seat (input);
+		struct wl_surface *surface = window_get_wl_surface (entry->message_window->window);
+		wl_text_input_show_input_panel (target->text_input);
+		wl_text_input_activate (target->text_input, seat, surface);
+	}
+
+	target->active = 1;
+
+	return target;
+}
+
 static void
 entry_click_handler(struct widget *widget,
 		struct input *input, uint32_t time,
@@ -393,17 +1051,8 @@ entry_click_handler(struct widget *widget,
 	widget_schedule_redraw (widget);
 
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED && button == BTN_LEFT) {
-		if (!entry->text_input) {
-			entry->text_input = wl_text_input_manager_create_text_input (text_input_manager);
-			wl_text_input_add_listener (entry->text_input, &text_input_listener, entry);
-		}
-
-		struct wl_seat *seat = input_get_seat (input);
-		struct wl_surface *surface = window_get_wl_surface (message_window->window);
-		wl_text_input_show_input_panel (entry->text_input);
-		wl_text_input_activate (entry->text_input, seat, surface);
-
-		entry->active = 1;
+		entry = entry_activate (entry, input);
+		entry_schedule_redraw (entry);
 	}
 }
 
@@ -416,17 +1065,8 @@ entry_touch_handler(struct widget *widget, struct input *input,
 
 	widget_schedule_redraw (widget);
 
-	if (!entry->text_input) {
-		entry->text_input = wl_text_input_manager_create_text_input (text_input_manager);
-		wl_text_input_add_listener (entry->text_input, &text_input_listener, entry);
-	}
-
-	struct wl_seat *seat = input_get_seat (input);
-	struct wl_surface *surface = window_get_wl_surface (message_window->window);
-	wl_text_input_show_input_panel (entry->text_input);
-	wl_text_input_activate (entry->text_input, seat, surface);
-
-	entry->active = 1;
+	entry = entry_activate (entry, input);
+	entry_schedule_redraw (entry);
 }
 
 static int
@@ -437,20 +1077,34 @@ entry_motion_handler(struct widget *widget,
 	return CURSOR_IBEAM;
 }
 
-static void
-entry_redraw_handler (struct widget *widget, void *data)
+#define ENTRY_PADDING 6
+
+ /* finds the first character starting at or after "x" */
+static int
+entry_char_at (struct entry *entry, double x)
 {
-	struct entry *entry = data;
-	struct rectangle allocation;
-	cairo_t *cr;
-	cairo_text_extents_t extents;
-	cairo_text_extents_t leftp_extents;
-	char *leftp_text;
-	int char_pos;
+	int low = 0, high = entry->chars_nb, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (entry->offsets[mid] < x)
+			low = mid + 1;
+		else
+			high = mid;
+	}
 
-	widget_get_allocation (widget, &allocation);
+	return low;
+}
+
+static void
+entry_draw (struct entry *entry, cairo_t *cr, struct rectangle allocation)
+{
+	struct message_window *message_window = entry->message_window;
+	struct glyph_run visible;
+	cairo_font_extents_t font_extents;
+	double width, field, cursor_x, x, baseline;
+	int first, last;
 
-	cr = widget_cairo_create (message_window->widget);
 	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
 	cairo_rectangle (cr,
 	                allocation.x,
@@ -469,444 +1123,2243 @@ entry_redraw_handler (struct widget *widget, void *data)
 		cairo_set_source_rgb (cr, 0.0, 0.0, 1.0);
 	else
 		cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
-	cairo_stroke_preserve(cr);
+	cairo_stroke (cr);
+
+	entry_update_glyphs (entry);
+	width = entry->offsets[entry->chars_nb];
+	cursor_x = entry->offsets[entry->cursor];
+	field = allocation.width - 2*ENTRY_PADDING;
 
+	 /* short texts are centered, long ones scroll to keep the cursor
+	  * in view */
+	if (width <= field) {
+		entry->scroll = -(field - width)/2;
+	} else {
+		if (entry->scroll < 0)
+			entry->scroll = 0;
+		if (cursor_x - entry->scroll > field)
+			entry->scroll = cursor_x - field;
+		if (cursor_x < entry->scroll)
+			entry->scroll = cursor_x;
+		if (entry->scroll > width - field)
+			entry->scroll = width - field;
+	}
+	x = allocation.x + ENTRY_PADDING - entry->scroll;
+
+	glyph_font_get_extents (message_window->label_font, &font_extents);
+	baseline = allocation.y + (allocation.height + font_extents.ascent
+	                                             - font_extents.descent)/2;
+
+	cairo_rectangle (cr, allocation.x + ENTRY_PADDING/2, allocation.y,
+	                     allocation.width - ENTRY_PADDING, allocation.height);
+	cairo_clip (cr);
+
+	 /* only the glyphs in view are drawn */
+	first = entry_char_at (entry, entry->scroll) - 1;
+	if (first < 0) first = 0;
+	last = entry_char_at (entry, entry->scroll + field) + 1;
+	if (last > entry->chars_nb) last = entry->chars_nb;
+	visible.glyphs = entry->glyphs + first;
+	visible.num_glyphs = last - first;
 	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 1.0);
-	cairo_select_font_face (cr, "sans",
-	                        CAIRO_FONT_SLANT_NORMAL,
-	                        CAIRO_FONT_WEIGHT_NORMAL);
-	cairo_set_font_size (cr, 14);
-	cairo_text_extents (cr, entry->text, &extents);
-			char_pos = strlen(entry->text) -1;						/* for spaces at the end */
-			while (char_pos >= 0 && entry->text[char_pos] == ' ') {
-				extents.width += 5.0;
-				char_pos--;
-			}
-	cairo_move_to (cr, allocation.x + (allocation.width - extents.width)/2,
-	        	   allocation.y + (allocation.height - extents.height)/2 + 10);
-	cairo_show_text (cr, entry->text);
+	glyph_font_show (message_window->label_font, cr, &visible, x, baseline);
 
 	if (entry->active) {
-		leftp_text = malloc (entry->cursor_pos + 1);
-		strncpy (leftp_text, entry->text, entry->cursor_pos);
-		leftp_text[entry->cursor_pos] = '\0';
-		cairo_text_extents (cr, leftp_text, &leftp_extents);
-			char_pos = strlen(leftp_text) -1;
-			while (char_pos >= 0 && leftp_text[char_pos] == ' ') {
-				leftp_extents.width += 5.0;
-				char_pos--;
-			}
-		free (leftp_text);
-
-		cairo_move_to (cr, allocation.x + (allocation.width - extents.width)/2 + leftp_extents.width,
-		        	   allocation.y + (allocation.height - extents.height)/2 + 15);
-		cairo_line_to(cr, allocation.x + (allocation.width - extents.width)/2 + leftp_extents.width,
-		        	   allocation.y + (allocation.height - extents.height)/2 - 5);
-		cairo_stroke(cr);
+		cairo_move_to (cr, x + cursor_x, baseline + 5);
+		cairo_line_to (cr, x + cursor_x, baseline - 15);
+		cairo_stroke (cr);
 	}
-
-	cairo_destroy (cr);
 }
 
 static void
-resize_handler (struct widget *widget, int32_t width, int32_t height, void *data)
+entry_redraw_handler (struct widget *widget, void *data)
 {
-	struct message_window *message_window = data;
-	struct entry *entry;
-	struct button *button;
+	struct entry *entry = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+
+	widget_get_allocation (widget, &allocation);
+
+	cr = widget_cairo_create (widget);
+	entry_draw (entry, cr, allocation);
+	cairo_destroy (cr);
+}
+
+ /* keeps "y" inside the text, indexing only as far as needed */
+static int
+message_view_clamp (struct message_view *view, int y)
+{
+	struct message_layout *layout = view->message_window->layout;
+	struct rectangle allocation;
+	int max;
+
+	widget_get_allocation (view->widget, &allocation);
+
+	if (y < 0)
+		return 0;
+
+	if (!layout->complete)
+		message_layout_index (layout, y / view->line_height
+		                              + allocation.height / view->line_height + 1);
+	if (!layout->complete)
+		return y;
+
+	max = layout->offsets_nb * view->line_height + 2*VIEW_PADDING - allocation.height;
+	if (max < 0)
+		max = 0;
+
+	return y < max ? y : max;
+}
+
+static void
+message_view_scroll (struct message_view *view, int y)
+{
+	y = message_view_clamp (view, y);
+	if (y == view->scroll)
+		return;
+
+	view->scroll = y;
+	widget_schedule_redraw (view->widget);
+}
+
+ /* draws the rows between "y0" and "y1" (widget coordinates) into
+  * the cache */
+static void
+message_view_render (struct message_view *view, int scale, int width,
+                     int y0, int y1)
+{
+	struct message_layout *layout = view->message_window->layout;
+	struct glyph_font *font = view->message_window->message_font;
+	struct glyph_run *run;
+	const char *text;
+	cairo_t *cr;
+	int i, last;
+
+	cr = cairo_create (view->cache);
+	cairo_scale (cr, scale, scale);
+	cairo_rectangle (cr, 0, y0, width, y1 - y0);
+	cairo_clip (cr);
+
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba (cr, 0.5, 0.5, 0.5, 1.0);
+	cairo_paint (cr);
+
+	cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 1.0);
+
+	i = (view->scroll + y0 - VIEW_PADDING) / view->line_height;
+	if (i < 0)
+		i = 0;
+	last = (view->scroll + y1 - VIEW_PADDING) / view->line_height;
+
+	for (; i <= last; i++) {
+		text = message_layout_get_line (layout, i);
+		if (!text)
+			break;
+		 /* rows are drawn once each, so they skip the run cache */
+		run = glyph_run_create (font, text, -1);
+		if (!run)
+			break;
+		glyph_font_show (font, cr, run, VIEW_PADDING,
+		                 VIEW_PADDING + i*view->line_height - view->scroll + view->ascent);
+		glyph_run_destroy (run);
+	}
+
+	cairo_destroy (cr);
+}
+
+static void
+message_view_redraw_handler (struct widget *widget, void *data)
+{
+	struct message_view *view = data;
+	struct rectangle allocation;
+	unsigned char *pixels;
+	cairo_t *cr;
+	int scale, stride, height, delta, width, resizing;
+
+	widget_get_allocation (widget, &allocation);
+	if (allocation.width <= 0 || allocation.height <= 0)
+		return;
+
+	scale = window_get_buffer_scale (view->message_window->window);
+	width = allocation.width * scale;
+	height = allocation.height * scale;
+
+	 /* while resizing, any cache big enough does, and a new one gets
+	  * some slack so the next sizes fit too; the exact size is back
+	  * with the first frame after the resize */
+	resizing = window_is_resizing (view->message_window->window);
+	if (!view->cache ||
+	    cairo_image_surface_get_width (view->cache) < width ||
+	    cairo_image_surface_get_height (view->cache) < height ||
+	    (!resizing &&
+	     (cairo_image_surface_get_width (view->cache) != width ||
+	      cairo_image_surface_get_height (view->cache) != height))) {
+		if (view->cache)
+			cairo_surface_destroy (view->cache);
+		if (resizing) {
+			width += VIEW_RESIZE_SLACK * scale;
+			height += VIEW_RESIZE_SLACK * scale;
+		}
+		view->cache = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+		                                          width, height);
+		view->cache_valid = 0;
+	}
+
+	if (view->cache_width != allocation.width ||
+	    view->cache_height != allocation.height ||
+	    view->cache_scale != scale) {
+		view->cache_width = allocation.width;
+		view->cache_height = allocation.height;
+		view->cache_scale = scale;
+		view->cache_valid = 0;
+	}
+
+	 /* a resize may have moved the end of the text */
+	view->scroll = message_view_clamp (view, view->scroll);
+	delta = view->scroll - view->cache_scroll;
+
+	if (!view->cache_valid || abs (delta) >= allocation.height) {
+		message_view_render (view, scale, allocation.width, 0, allocation.height);
+	} else if (delta != 0) {
+		 /* move the rows still visible, draw only the uncovered ones */
+		cairo_surface_flush (view->cache);
+		pixels = cairo_image_surface_get_data (view->cache);
+		stride = cairo_image_surface_get_stride (view->cache);
+		height = (allocation.height - abs (delta)) * scale;
+		if (delta > 0)
+			memmove (pixels, pixels + delta*scale*stride, height*stride);
+		else
+			memmove (pixels - delta*scale*stride, pixels, height*stride);
+		cairo_surface_mark_dirty (view->cache);
+
+		if (delta > 0)
+			message_view_render (view, scale, allocation.width,
+			                     allocation.height - delta, allocation.height);
+		else
+			message_view_render (view, scale, allocation.width, 0, -delta);
+	}
+
+	view->cache_scroll = view->scroll;
+	view->cache_valid = 1;
+
+	cr = widget_cairo_create (widget);
+	cairo_translate (cr, allocation.x, allocation.y);
+	cairo_scale (cr, 1.0/scale, 1.0/scale);
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface (cr, view->cache, 0.0, 0.0);
+	cairo_rectangle (cr, 0, 0, allocation.width * scale, allocation.height * scale);
+	cairo_fill (cr);
+	cairo_destroy (cr);
+}
+
+static void
+message_view_axis_handler (struct widget *widget, struct input *input,
+                           uint32_t time, uint32_t axis, wl_fixed_t value,
+                           void *data)
+{
+	struct message_view *view = data;
+
+	if (axis != WL_POINTER_AXIS_VERTICAL_SCROLL)
+		return;
+
+	message_view_scroll (view, view->scroll + wl_fixed_to_int (value) * 2);
+}
+
+ /* returns 1 if the key scrolled the view */
+static int
+message_view_key (struct message_view *view, uint32_t sym)
+{
+	struct message_layout *layout = view->message_window->layout;
 	struct rectangle allocation;
+	int page;
+
+	widget_get_allocation (view->widget, &allocation);
+	page = allocation.height - view->line_height;
+	if (page < view->line_height)
+		page = view->line_height;
+
+	switch (sym) {
+		case XKB_KEY_Up:
+			message_view_scroll (view, view->scroll - view->line_height);
+			break;
+		case XKB_KEY_Down:
+			message_view_scroll (view, view->scroll + view->line_height);
+			break;
+		case XKB_KEY_Page_Up:
+			message_view_scroll (view, view->scroll - page);
+			break;
+		case XKB_KEY_Page_Down:
+			message_view_scroll (view, view->scroll + page);
+			break;
+		case XKB_KEY_Home:
+			message_view_scroll (view, 0);
+			break;
+		case XKB_KEY_End:
+			message_layout_index (layout, INT_MAX);
+			message_view_scroll (view, INT_MAX);
+			break;
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+#define ICON_CACHE_VERSION 1
+
+ /* identifies the source file; the cache name only hashes its path */
+struct icon_cache_key {
+	int32_t version;
+	int32_t size;
+	int64_t dev;
+	int64_t ino;
+	int64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+static cairo_surface_t *
+icon_scale (pixman_image_t *image, int size)
+{
+	cairo_surface_t *source, *icon;
+	cairo_t *cr;
+	int width = pixman_image_get_width (image);
+	int height = pixman_image_get_height (image);
+	double ratio;
+
+	source = cairo_image_surface_create_for_data ((unsigned char *) pixman_image_get_data (image),
+	                                              CAIRO_FORMAT_ARGB32, width, height,
+	                                              pixman_image_get_stride (image));
+	icon = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, size, size);
+	cr = cairo_create (icon);
+
+	 /* fit inside size x size, keeping the aspect ratio */
+	if (width != size || height != size) {
+		ratio = (double) size / (width > height ? width : height);
+		cairo_translate (cr, (size - width*ratio)/2, (size - height*ratio)/2);
+		cairo_scale (cr, ratio, ratio);
+	}
+	cairo_set_source_surface (cr, source, 0.0, 0.0);
+	cairo_paint (cr);
+	cairo_destroy (cr);
+	cairo_surface_destroy (source);
+
+	return icon;
+}
+
+ /* decodes and rescales "icon_filename", unless a cached copy matches */
+static void *
+icon_load_func (void *data)
+{
+	struct message_window *message_window = data;
+	struct icon_cache_key key;
+	pixman_image_t *image;
+	struct stat st;
+	char name[32];
+	uint32_t hash = 2166136261u;
+	const char *c;
+	int i;
+
+	trace_begin ("icon_load");
+
+	if (stat (message_window->icon_filename, &st) < 0)
+		goto out;
+
+	for (c = message_window->icon_filename; *c; c++)
+		hash = (hash ^ (unsigned char) *c) * 16777619u;
+	snprintf (name, sizeof name, "icon-%08x", hash);
+
+	memset (&key, 0, sizeof key);
+	key.version = ICON_CACHE_VERSION;
+	key.size = ICON_SIZE;
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	key.file_size = st.st_size;
+	key.mtime_sec = st.st_mtim.tv_sec;
+	key.mtime_nsec = st.st_mtim.tv_nsec;
+
+	if (image_cache_load (name, &key, sizeof key,
+	                      message_window->icons, ICON_SCALES) == 0)
+		goto out;
+
+	image = load_image (message_window->icon_filename);
+	if (!image)
+		goto out;
+
+	for (i = 0; i < ICON_SCALES; i++)
+		message_window->icons[i] = icon_scale (image, ICON_SIZE * (i+1));
+	pixman_image_unref (image);
+
+	image_cache_save (name, &key, sizeof key,
+	                  message_window->icons, ICON_SCALES);
+
+out:
+	free (message_window->icon_filename);
+	message_window->icon_filename = NULL;
+
+	trace_end ("icon_load", message_window->icons[0] != NULL);
+
+	return NULL;
+}
+
+ /* waits for the icons loaded by icon_load_func(), if any */
+static void
+message_window_join_icon (struct message_window *message_window)
+{
+	if (!message_window->icon_pending)
+		return;
+
+	worker_join (&message_window->icon_worker);
+	message_window->icon_pending = 0;
+}
+
+static void
+resize_handler (struct widget *widget, int32_t width, int32_t height, void *data)
+{
+	struct message_window *message_window = data;
+	struct entry *entry;
+	struct button *button;
+	struct rectangle allocation, button_allocation;
 	int buttons_width, extended_width;
-	int x;
+	int x, top, bottom;
+
+	message_window_join_icon (message_window);
+
+	widget_get_allocation (widget, &allocation);
+
+	 /* the text area ends above the entry and buttons */
+	top = allocation.y + 10 + (!message_window->icons[0] ? 0 : 74);
+	bottom = allocation.y + height - 16;
+	if (message_window->entry)
+		bottom = allocation.y + height - 16*2 - 32*2 - 8;
+	else if (message_window->buttons_nb)
+		bottom = allocation.y + height - 16 - 32 - 8;
+
+	if (message_window->progress) {
+		widget_set_allocation (message_window->progress->widget,
+		                       allocation.x + 40, bottom - 16,
+		                       width - 80, 16);
+		bottom -= 16 + 8;
+	}
+
+	if (message_window->view) {
+		widget_set_allocation (message_window->view->widget,
+		                       allocation.x + 20, top,
+		                       width - 40, bottom - top);
+	}
+
+	x = allocation.x + (width - 240)/2;
+
+	if (message_window->entry) {
+		entry = message_window->entry;
+		widget_set_allocation (entry->widget, x, allocation.y + height - 16*2 - 32*2,
+		                                      240, 32);
+	}
+
+	buttons_width = 0;
+	wl_list_for_each (button, &message_window->button_list, link) {
+		extended_width = strlen(button->caption) - 5;
+		if (extended_width < 0) extended_width = 0;
+		buttons_width += 60 + extended_width*10;
+	}
+
+	x = allocation.x + (width - buttons_width)/2
+	                 - (message_window->buttons_nb-1)*10;
+
+	wl_list_for_each (button, &message_window->button_list, link) {
+		extended_width = strlen(button->caption) - 5;
+		if (extended_width < 0) extended_width = 0;
+		widget_set_allocation (button->widget, x, allocation.y + height - 16 - 32,
+		                                       60 + extended_width*10, 32); 
+		widget_get_allocation (button->widget, &button_allocation);
+		button_render_sprites (button, button_allocation,
+		                       window_get_buffer_scale (message_window->window));
+		x += 60 + extended_width*10 + 10;
+	}
+}
+
+static void
+message_window_draw (struct message_window *message_window, cairo_t *cr,
+                     struct rectangle allocation, int scale)
+{
+	struct message_layout *layout = message_window->layout;
+	int i, icon_scale;
+
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_rectangle (cr,
+			allocation.x,
+			allocation.y,
+			allocation.width,
+			allocation.height);
+	cairo_set_source_rgba (cr, 0.5, 0.5, 0.5, 1.0);
+	cairo_fill (cr);
+
+	if (message_window->icons[0]) {
+		icon_scale = scale;
+		if (icon_scale > ICON_SCALES) icon_scale = ICON_SCALES;
+		if (icon_scale < 1) icon_scale = 1;
+
+		cairo_save (cr);
+		cairo_translate (cr, allocation.x + (allocation.width - ICON_SIZE)/2,
+		                     allocation.y + 10);
+		cairo_scale (cr, 1.0/icon_scale, 1.0/icon_scale);
+		cairo_set_source_surface (cr, message_window->icons[icon_scale-1], 0.0, 0.0);
+		 /* the icon is prescaled ; only above ICON_SCALES does it get
+		  * resampled, and then a resize draws it with a fast filter */
+		if (icon_scale != scale && message_window->window &&
+		    window_is_resizing (message_window->window))
+			cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_FAST);
+		cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+		cairo_paint (cr);
+		cairo_restore (cr);
+	}
+
+	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 1.0);
+
+	 /* long texts are drawn by the message_view */
+	for (i = 0; i < layout->lines_nb && !layout->scroll; i++) {
+		double height = layout->lines[i].height;
+
+		glyph_font_show (message_window->message_font, cr, layout->lines[i].run,
+		                 allocation.x + (allocation.width - layout->lines[i].width)/2,
+	        	         allocation.y + (allocation.height - layout->lines_nb * height)/2
+		                                + i*(height+10)
+		                                + (!message_window->icons[0] ? 0 : 32)
+                                                - (!message_window->entry ? 0 : 32)
+                                                - (!message_window->buttons_nb ? 0 : 32)
+                                                - (!message_window->progress ? 0 : 12));
+	}
+}
+
+static void
+redraw_handler (struct widget *widget, void *data)
+{
+	struct message_window *message_window = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+
+	message_window_join_icon (message_window);
+
+	widget_get_allocation (message_window->widget, &allocation);
+
+	cr = widget_cairo_create (message_window->widget);
+	message_window_draw (message_window, cr, allocation,
+	                     window_get_buffer_scale (message_window->window));
+	cairo_destroy (cr);
+}
+
+ /* returns 1 if the key was for the entry */
+static int
+entry_key (struct entry *entry, uint32_t sym)
+{
+	char text[16];
+
+	switch (sym) {
+		case XKB_KEY_BackSpace:
+			entry_delete (entry, 0);
+			break;
+		case XKB_KEY_Delete:
+			entry_delete (entry, 1);
+			break;
+		case XKB_KEY_Left:
+			entry_move (entry, 0);
+			break;
+		case XKB_KEY_Right:
+			entry_move (entry, 1);
+			break;
+		case XKB_KEY_Home:
+			while (entry->cursor > 0)
+				entry_move (entry, 0);
+			break;
+		case XKB_KEY_End:
+			while (entry->cursor < entry->chars_nb)
+				entry_move (entry, 1);
+			break;
+		default:
+			if (xkb_keysym_to_utf8 (sym, text, sizeof(text)) <= 0)
+				return 0;
+			if ((unsigned char) text[0] < 0x20)	/* control characters, Tab */
+				return 0;
+			entry_insert (entry, text, strlen (text));
+	}
+
+	return 1;
+}
+
+ /* the active entry gets the keys first, so that Home and End move
+  * its cursor ; the message view scrolls with the others. Returns the
+  * entry if it has to be redrawn */
+static struct entry *
+message_window_key (struct message_window *message_window, uint32_t sym)
+{
+	struct entry *entry = message_window->entry;
+
+	if (entry && entry->active && entry_key (entry, sym))
+		return entry;
+
+	if (message_window->view)
+		message_view_key (message_window->view, sym);
+
+	return NULL;
+}
+
+static void
+key_handler (struct window *window, struct input *input, uint32_t time,
+		 uint32_t key, uint32_t sym, enum wl_keyboard_key_state state,
+		 void *data)
+{
+	 /* with -all-outputs, whichever copy has the focus */
+	struct message_window *message_window = ((struct message_window *) data)->keyboard;
+	struct entry *entry;
+
+	if (state == WL_KEYBOARD_KEY_STATE_RELEASED)
+		return;
+
+	if (sym == XKB_KEY_Return || sym == XKB_KEY_KP_Enter) {
+		message_window_finish (message_window, message_window->default_value, 1);
+		return;
+	}
+
+	entry = message_window_key (message_window, sym);
+	if (entry)
+		entry_schedule_redraw (entry);
+}
+
+static void
+subwidget_resize_handler (struct widget *widget, int32_t width, int32_t height, void *data)
+{
+	 /* input stays with the main surface, which still finds the widget */
+	widget_input_region_add (widget, NULL);
+}
+
+ /* the entry and the progress bar change on their own, so they get
+  * desynchronized subsurfaces : updating them commits a small buffer
+  * instead of the whole window */
+static struct widget *
+message_window_add_subwidget (struct message_window *message_window, void *data)
+{
+	struct widget *widget;
+
+	if (!display_has_subcompositor (message_window->display))
+		return widget_add_widget (message_window->widget, data);
+
+	widget = window_add_subsurface (message_window->window, data,
+	                                SUBSURFACE_DESYNCHRONIZED);
+	widget_set_transparent (widget, 0);
+	widget_set_resize_handler (widget, subwidget_resize_handler);
+
+	return widget;
+}
+
+void
+message_window_add_entry (struct message_window *message_window, char *textfield)
+{
+	struct entry *entry;
+
+	entry = xzalloc (sizeof *entry);
+	entry->message_window = message_window;
+	entry->widget = message_window_add_subwidget (message_window, entry);
+	entry_set_text (entry, textfield);
+	entry->last_vkb_len = 0;
+	entry->active = 0;
+
+	message_window->entry = entry;
+
+	widget_set_redraw_handler (entry->widget, entry_redraw_handler);
+	widget_set_motion_handler (entry->widget, entry_motion_handler);
+	widget_set_button_handler (entry->widget, entry_click_handler);
+	widget_set_touch_down_handler (entry->widget, entry_touch_handler);
+}
+
+ /* "desc" is the "label:exitcode" starting "button_desc", "len" bytes
+  * long */
+void
+message_window_add_button (struct message_window *message_window,
+                           const char *button_desc, size_t len)
+{
+	struct button *button;
+	const char *colon;
+
+	colon = memchr (button_desc, ':', len);
+
+	button = arena_alloc (&message_window->button_arena, sizeof *button);
+	memset (button, 0, sizeof *button);
+	button->message_window = message_window;
+	button->widget = widget_add_widget (message_window->widget, button);
+	button->caption = arena_strndup (&message_window->button_arena, button_desc,
+	                                 colon ? (size_t) (colon - button_desc) : len);
+	button->value = colon ? atoi (colon + 1) : 0;
+
+	widget_set_redraw_handler (button->widget, button_redraw_handler);
+	widget_set_enter_handler (button->widget, button_enter_handler);
+	widget_set_leave_handler (button->widget, button_leave_handler);
+	widget_set_button_handler (button->widget, button_click_handler);
+	widget_set_touch_down_handler (button->widget, button_touch_down_handler);
+	widget_set_touch_up_handler (button->widget, button_touch_up_handler);
+
+	wl_list_insert (message_window->button_list.prev, &button->link);
+}
+
+static void
+progress_draw (struct progress *progress, cairo_t *cr,
+               struct rectangle allocation)
+{
+	struct timespec ts;
+	double pos;
+	int t;
+
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_rectangle (cr,
+	                allocation.x,
+	                allocation.y,
+	                allocation.width,
+	                allocation.height);
+	cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
+	cairo_fill_preserve (cr);
+	cairo_set_line_width (cr, 1);
+	cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
+	cairo_stroke (cr);
+
+	cairo_set_source_rgb (cr, 0.2, 0.4, 0.8);
+	if (progress->value >= 0) {
+		cairo_rectangle (cr, allocation.x + 2, allocation.y + 2,
+		                     (allocation.width - 4) * progress->value / 100.0,
+		                     allocation.height - 4);
+	} else {
+		 /* a block bouncing every 2 seconds */
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		t = (ts.tv_sec % 2) * 1000 + ts.tv_nsec / 1000000;
+		pos = t < 1000 ? t / 1000.0 : 2.0 - t / 1000.0;
+		cairo_rectangle (cr, allocation.x + 2 + pos * (allocation.width - 4) * 0.75,
+		                     allocation.y + 2,
+		                     (allocation.width - 4) * 0.25,
+		                     allocation.height - 4);
+	}
+	cairo_fill (cr);
+}
+
+static void
+progress_redraw_handler (struct widget *widget, void *data)
+{
+	struct progress *progress = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+
+	widget_get_allocation (widget, &allocation);
+
+	cr = widget_cairo_create (widget);
+	progress_draw (progress, cr, allocation);
+	cairo_destroy (cr);
+
+	 /* the next frame callback runs the animation ; none come while
+	  * the window is hidden, and then nothing is drawn */
+	if (progress->value < 0)
+		widget_schedule_redraw (widget);
+}
+
+ /* "value" is a percentage, or "pulse" for an indeterminate progress */
+static void
+message_window_set_progress (struct message_window *message_window, const char *value)
+{
+	struct progress *progress = message_window->progress;
+	int percent = -1;
+
+	if (strcmp (value, "pulse")) {
+		percent = atoi (value);
+		if (percent < 0)
+			percent = 0;
+		if (percent > 100)
+			percent = 100;
+	}
+
+	if (!progress) {
+		progress = xzalloc (sizeof *progress);
+		progress->message_window = message_window;
+		progress->widget = message_window_add_subwidget (message_window, progress);
+		widget_set_redraw_handler (progress->widget, progress_redraw_handler);
+		message_window->progress = progress;
+		progress->value = percent;
+		return;
+	}
+
+	if (progress->value == percent)
+		return;
+
+	progress->value = percent;
+	widget_schedule_redraw (progress->widget);
+}
+
+static void
+message_window_add_buttons (struct message_window *message_window, const char *buttons)
+{
+	const char *end;
+
+	if (!*buttons)
+		return;
+
+	 /* at most 3 buttons, the last one takes the rest of the list */
+	for (;;) {
+		end = NULL;
+		if (message_window->buttons_nb < 2)
+			end = strchr (buttons, ',');
+		if (!end)
+			end = buttons + strlen (buttons);
+
+		message_window_add_button (message_window, buttons, end - buttons);
+		message_window->buttons_nb++;
+
+		if (!*end)
+			break;
+		buttons = end + 1;
+	}
+}
+
+static void
+message_window_remove_buttons (struct message_window *message_window)
+{
+	struct button *button, *tmp;
+
+	wl_list_for_each_safe (button, tmp, &message_window->button_list, link) {
+		wl_list_remove (&button->link);
+		widget_destroy (button->widget);
+		button_destroy_sprites (button);
+	}
+	arena_release (&message_window->button_arena);
+	message_window->buttons_nb = 0;
+}
+
+static void
+message_window_remove_view (struct message_window *message_window)
+{
+	if (!message_window->view)
+		return;
+
+	if (message_window->view->cache)
+		cairo_surface_destroy (message_window->view->cache);
+	widget_destroy (message_window->view->widget);
+	free (message_window->view);
+	message_window->view = NULL;
+}
+
+static void
+message_window_add_view (struct message_window *message_window)
+{
+	struct message_view *view;
+	cairo_font_extents_t extents;
+
+	view = xzalloc (sizeof *view);
+	view->message_window = message_window;
+	view->widget = widget_add_widget (message_window->widget, view);
+
+	glyph_font_get_extents (message_window->message_font, &extents);
+	view->line_height = ceil (extents.height);
+	view->ascent = ceil (extents.ascent);
+
+	message_window->view = view;
+
+	widget_set_redraw_handler (view->widget, message_view_redraw_handler);
+	widget_set_axis_handler (view->widget, message_view_axis_handler);
+}
+
+static void
+message_window_timeout (struct task *task, uint32_t events)
+{
+	struct message_window *message_window =
+		container_of (task, struct message_window, timer_task);
+	uint64_t expirations;
+
+	if (read (message_window->timer_fd, &expirations, sizeof expirations) < 0
+	    && errno == EAGAIN)
+		return;
+
+	message_window_finish (message_window, 0, 0);
+}
+
+static void
+close_handler (void *data)
+{
+	struct message_window *message_window = data;
+
+	message_window_finish (message_window, 0, 0);
+}
+
+struct message_window *
+message_window_create (struct display *display, struct dialog_spec *spec,
+                       message_done_func_t done, void *data)
+{
+	struct message_window *message_window;
+	int frame_type = FRAME_ALL;
+	int extended_width = 0;
+
+	if (spec->titlebuttons) {
+		frame_type = FRAME_NONE;
+		if (strstr (spec->titlebuttons, "Min"))
+			frame_type = frame_type | FRAME_MINIMIZE;
+		if (strstr (spec->titlebuttons, "Max"))
+			frame_type = frame_type | FRAME_MAXIMIZE;
+		if (strstr (spec->titlebuttons, "Close"))
+			frame_type = frame_type | FRAME_CLOSE;
+	}
+
+	message_window = xzalloc (sizeof *message_window);
+	message_window->display = display;
+	message_window->done = done;
+	message_window->done_data = data;
+	message_window->timer_fd = -1;
+	message_window->keyboard = message_window;
+
+	 /* decoding the PNG overlaps with window creation and text layout */
+	if (spec->icon) {
+		message_window->icon_pending = 1;
+		message_window->icon_filename = xstrdup (spec->icon);
+		worker_run (&message_window->icon_worker, icon_load_func, message_window);
+	}
+
+	message_window->window = window_create (display);
+	message_window->widget = window_frame_create (message_window->window, frame_type, !spec->noresize,  message_window);
+	message_window->message_font = display_get_font (display, "sans", CAIRO_FONT_WEIGHT_NORMAL, 18);
+	message_window->label_font = display_get_font (display, "sans", CAIRO_FONT_WEIGHT_NORMAL, 14);
+
+	if (spec->file) {
+		message_window->layout = message_layout_create_from_file (message_window->message_font,
+		                                                          spec->file);
+	} else {
+		message_window->message = strdup (spec->message ? spec->message : "");
+		message_window->layout = message_layout_create (message_window->message_font,
+		                                                message_window->message,
+		                                                strlen (message_window->message),
+		                                                NULL);
+	}
+	if (message_window->layout->scroll)
+		message_window_add_view (message_window);
+
+	if (spec->title)
+		message_window->title = strdup (spec->title);
+	else
+		message_window->title = strdup ("wlmessage");
+	window_set_title (message_window->window, message_window->title);
+
+	message_window->buttons_nb = 0;
+	wl_list_init (&message_window->button_list);
+	if (spec->buttons)
+		message_window_add_buttons (message_window, spec->buttons);
+	if (spec->progress)
+		message_window_set_progress (message_window, spec->progress);
+
+	message_window->default_value = 0;
+	if (spec->buttons && spec->deflt) {
+		struct button *button;
+		wl_list_for_each (button, &message_window->button_list, link) {
+			if (!strcmp(button->caption, spec->deflt))
+				message_window->default_value = button->value;
+		}
+	}
+
+	if (spec->textfield) {
+		message_window_add_entry (message_window, spec->textfield);
+	} else {
+		message_window->entry = NULL;
+	}
+
+	if (spec->timeout > 0) {
+		struct itimerspec its = { { 0, 0 }, { spec->timeout, 0 } };
+
+		message_window->timer_fd = timerfd_create (CLOCK_MONOTONIC,
+		                                           TFD_CLOEXEC | TFD_NONBLOCK);
+		if (message_window->timer_fd >= 0) {
+			timerfd_settime (message_window->timer_fd, 0, &its, NULL);
+			message_window->timer_task.run = message_window_timeout;
+			display_watch_fd (display, message_window->timer_fd, EPOLLIN,
+			                  &message_window->timer_task);
+		}
+	}
+
+	 /* the default width fits about 350 pixels of text */
+	extended_width = message_window->layout->width - 350;
+	 if (extended_width < 0) extended_width = 0;
+	 if (message_window->view && extended_width > 800) extended_width = 800;
+
+	window_set_user_data (message_window->window, message_window);
+	window_set_key_handler (message_window->window, key_handler);
+	window_set_close_handler (message_window->window, close_handler);
+	widget_set_redraw_handler (message_window->widget, redraw_handler);
+	widget_set_resize_handler (message_window->widget, resize_handler);
+
+	window_schedule_resize (message_window->window,
+	                        480 + extended_width,
+	                        280 + message_window->layout->lines_nb*16 + (!message_window->entry ? 0 : 1)*32
+	                                          + (!message_window->buttons_nb ? 0 : 1)*32
+	                                          + (!message_window->progress ? 0 : 1)*24);
+
+	return message_window;
+}
+
+void
+message_window_destroy (struct message_window *message_window)
+{
+	int i;
+
+	if (message_window->timer_fd >= 0) {
+		display_unwatch_fd (message_window->display, message_window->timer_fd);
+		close (message_window->timer_fd);
+	}
+
+	if (message_window->surface)
+		cairo_surface_destroy (message_window->surface);
+
+	message_window_join_icon (message_window);
+	for (i = 0; i < ICON_SCALES; i++)
+		if (message_window->icons[i])
+			cairo_surface_destroy (message_window->icons[i]);
+
+	message_window_remove_view (message_window);
+
+	if (message_window->progress) {
+		widget_destroy (message_window->progress->widget);
+		free (message_window->progress);
+	}
+
+	struct entry *entry;
+	if (message_window->entry) {
+		entry = message_window->entry;
+		if (entry->text_input)
+			wl_text_input_destroy (entry->text_input);
+		widget_destroy(entry->widget);
+		free (entry->buffer);
+		free (entry->text);
+		free (entry->glyphs);
+		free (entry->offsets);
+		free (entry);
+	}
+
+	message_window_remove_buttons (message_window);
+
+	widget_destroy (message_window->widget);
+	window_destroy (message_window->window);
+	free (message_window->title);
+	message_layout_destroy (message_window->layout);
+	free (message_window->message);
+	free (message_window);
+}
+
+static void
+global_handler(struct display *display, uint32_t name,
+	       const char *interface, uint32_t version, void *data)
+{
+	if (!strcmp(interface, "wl_text_input_manager")) {
+		text_input_manager = display_bind (display, name, &wl_text_input_manager_interface, 1);
+	}
+}
+
+
+ /* relayouts the existing children after an update */
+static void
+message_window_relayout (struct message_window *message_window)
+{
+	struct rectangle allocation;
+
+	 /* a resize to the same size : besides the widgets, the entry and
+	  * progress subsurfaces get moved and their buffers resized */
+	window_get_allocation (message_window->window, &allocation);
+	window_schedule_resize (message_window->window, allocation.width, allocation.height);
+}
+
+static void
+message_window_set_message (struct message_window *message_window, const char *message)
+{
+	free (message_window->message);
+	message_layout_destroy (message_window->layout);
+
+	message_window->message = strdup (message);
+	message_window->layout = message_layout_create (message_window->message_font,
+	                                                message_window->message,
+	                                                strlen (message_window->message),
+	                                                NULL);
+
+	message_window_remove_view (message_window);
+	if (message_window->layout->scroll)
+		message_window_add_view (message_window);
+
+	message_window_relayout (message_window);
+}
+
+static void
+message_window_set_buttons (struct message_window *message_window, char *buttons)
+{
+	message_window_remove_buttons (message_window);
+	if (*buttons)
+		message_window_add_buttons (message_window, buttons);
+
+	message_window_relayout (message_window);
+}
+
+
+
+ /* -stdin-updates : every stdin line "key:value" changes the dialog.
+  * Changes only schedule redraws, so a burst of lines costs at most
+  * one repaint per frame callback. */
+
+struct stdin_updates {
+	struct display *display;
+	struct message_window *message_window;
+	struct task task;
+	char *buffer;
+	size_t len;
+	size_t size;
+};
+
+ /* turns "\n" into a newline and "\\" into a backslash, in place */
+static void
+unescape (char *text)
+{
+	char *p = text;
+
+	while (*text) {
+		if (text[0] == '\\' && text[1] == 'n') {
+			*p++ = '\n';
+			text += 2;
+		} else if (text[0] == '\\' && text[1] == '\\') {
+			*p++ = '\\';
+			text += 2;
+		} else {
+			*p++ = *text++;
+		}
+	}
+	*p = '\0';
+}
+
+static void
+stdin_updates_apply (struct message_window *message_window, const char *line,
+                     char *value)
+{
+	if (!strcmp (line, "message")) {
+		message_window_set_message (message_window, value);
+	} else if (!strcmp (line, "title")) {
+		free (message_window->title);
+		message_window->title = strdup (value);
+		window_set_title (message_window->window, message_window->title);
+	} else if (!strcmp (line, "progress")) {
+		if (!message_window->progress) {
+			message_window_set_progress (message_window, value);
+			message_window_relayout (message_window);
+		} else {
+			message_window_set_progress (message_window, value);
+		}
+	} else if (!strcmp (line, "buttons")) {
+		message_window_set_buttons (message_window, value);
+	}
+}
+
+static void
+stdin_updates_line (struct stdin_updates *updates, char *line)
+{
+	struct message_window *message_window;
+	char *value;
+
+	value = strchr (line, ':');
+	if (!value) {
+		fprintf (stderr, "ignoring update \"%s\"\n", line);
+		return;
+	}
+	*value++ = '\0';
+
+	if (strcmp (line, "message") && strcmp (line, "title") &&
+	    strcmp (line, "progress") && strcmp (line, "buttons")) {
+		fprintf (stderr, "unknown update \"%s\"\n", line);
+		return;
+	}
+
+	if (!strcmp (line, "message"))
+		unescape (value);
+
+	 /* every copy of the dialog gets the update */
+	for (message_window = updates->message_window; message_window;
+	     message_window = message_window->mirror)
+		stdin_updates_apply (message_window, line, value);
+}
+
+ /* reads once from stdin and applies the complete lines ; returns 0
+  * once the producer is gone */
+static int
+stdin_updates_read (struct stdin_updates *updates)
+{
+	char *line, *end;
+	ssize_t len;
+
+	if (updates->size - updates->len < 4096) {
+		if (updates->size >= MAX_REQUEST_SIZE) {
+			fprintf (stderr, "update line too long, dropped\n");
+			updates->len = 0;
+		} else {
+			updates->size = updates->size ? updates->size * 2 : 8192;
+			updates->buffer = xrealloc (updates->buffer, updates->size);
+		}
+	}
+
+	len = read (STDIN_FILENO, updates->buffer + updates->len,
+	            updates->size - updates->len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+	if (len <= 0)
+		return 0;
+	updates->len += len;
+
+	line = updates->buffer;
+	while ((end = memchr (line, '\n', updates->buffer + updates->len - line))) {
+		*end = '\0';
+		stdin_updates_line (updates, line);
+		line = end + 1;
+	}
+
+	updates->len -= line - updates->buffer;
+	memmove (updates->buffer, line, updates->len);
+
+	return 1;
+}
+
+static void
+stdin_updates_data (struct task *task, uint32_t events)
+{
+	struct stdin_updates *updates = container_of (task, struct stdin_updates, task);
+
+	 /* the producer is gone, keep the last state on screen */
+	if (!stdin_updates_read (updates))
+		display_unwatch_fd (updates->display, STDIN_FILENO);
+}
+
+static void
+stdin_updates_init (struct stdin_updates *updates, struct display *display,
+                    struct message_window *message_window)
+{
+	memset (updates, 0, sizeof *updates);
+	updates->display = display;
+	updates->message_window = message_window;
+	updates->task.run = stdin_updates_data;
+
+	 /* one read() per wakeup, so stdin can stay blocking */
+	if (display_watch_fd (display, STDIN_FILENO, EPOLLIN, &updates->task) == 0)
+		return;
+
+	 /* epoll refuses regular files, which never block anyway : apply
+	  * the whole file now, before the first frame */
+	if (errno == EPERM) {
+		while (stdin_updates_read (updates))
+			;
+		return;
+	}
+
+	fprintf (stderr, "cannot watch stdin for updates : %s\n",
+	         strerror (errno));
+}
+
+
+struct oneshot_result {
+	struct display *display;
+	int value;
+};
+
+static void
+oneshot_done (struct message_window *message_window, int value, const char *text, void *data)
+{
+	struct oneshot_result *result = data;
+
+	if (text)
+		fputs (text, stdout);
+
+	result->value = value;
+	display_exit (result->display);
+}
+
+ /* all the dialogs of a process share its memory profile */
+static struct display *
+wlmessage_display_create (void)
+{
+	struct display *display;
+
+	display = display_create (NULL, NULL);
+	if (!display)
+		return NULL;
+
+	display_set_renderer (display, renderer);
+	if (low_memory)
+		display_use_low_memory (display);
+
+	return display;
+}
+
+ /* -all-outputs : the dialog goes fullscreen on every output. The
+  * first copy draws, the others mirror its buffers while their output
+  * has the same size, scale and transform. */
+struct broadcast {
+	struct display *display;
+	struct dialog_spec *spec;
+	struct message_window *message_window;	/* the first copy */
+	int placed;				/* it has an output */
+	int finished;				/* by any of the copies */
+	struct oneshot_result *result;
+};
+
+static void
+broadcast_done (struct message_window *message_window, int value, const char *text, void *data)
+{
+	struct broadcast *broadcast = data;
+	struct message_window *first = broadcast->message_window;
+
+	if (broadcast->finished)
+		return;
+	broadcast->finished = 1;
+
+	 /* the keyboard only feeds the first copy */
+	if (text && first->entry)
+		text = entry_get_text (first->entry);
+
+	oneshot_done (message_window, value, text, broadcast->result);
+}
+
+ /* a copy goes away with its output */
+static void
+broadcast_output_destroy_handler (struct output *output, void *data)
+{
+	struct message_window *message_window = data;
+	struct message_window *prev = message_window->keyboard;
+
+	while (prev->mirror != message_window)
+		prev = prev->mirror;
+	prev->mirror = message_window->mirror;
+
+	output_set_user_data (output, NULL);
+	message_window_destroy (message_window);
+}
+
+ /* called for each output, including those connected later */
+static void
+broadcast_output_handler (struct output *output, void *data)
+{
+	struct broadcast *broadcast = data;
+	struct message_window *first = broadcast->message_window;
+	struct message_window *message_window;
+
+	 /* a mode change, the window follows it */
+	if (output_get_user_data (output))
+		return;
+
+	if (!broadcast->placed) {
+		message_window = first;
+		broadcast->placed = 1;
+	} else {
+		message_window = message_window_create (broadcast->display, broadcast->spec,
+		                                        broadcast_done, broadcast);
+		 /* keys go to the first copy, which has the text */
+		message_window->keyboard = first;
+		window_set_mirror (message_window->window, first->window);
+		message_window->mirror = first->mirror;
+		first->mirror = message_window;
+		message_window->output = output;
+		output_set_destroy_handler (output, broadcast_output_destroy_handler);
+	}
+
+	output_set_user_data (output, message_window);
+	window_set_output (message_window->window, output);
+	window_set_fullscreen (message_window->window, 1);
+}
+
+int
+wlmessage_run (struct dialog_spec *spec)
+{
+	struct display *display = NULL;
+	struct message_window *message_window, *mirror;
+	struct oneshot_result result;
+	struct stdin_updates updates;
+	struct broadcast broadcast;
+
+	display = wlmessage_display_create ();
+	if (!display) {
+		fprintf (stderr, "Failed to connect to a Wayland compositor !\n");
+		return 1;
+	}
+
+	result.display = display;
+	result.value = 0;
+
+	if (all_outputs) {
+		memset (&broadcast, 0, sizeof broadcast);
+		broadcast.display = display;
+		broadcast.spec = spec;
+		broadcast.result = &result;
+		message_window = message_window_create (display, spec, broadcast_done,
+		                                        &broadcast);
+		broadcast.message_window = message_window;
+		display_set_user_data (display, &broadcast);
+		display_set_output_configure_handler (display, broadcast_output_handler);
+	} else {
+		message_window = message_window_create (display, spec, oneshot_done, &result);
+	}
+	display_set_global_handler (display, global_handler);
+	if (spec->stdin_updates)
+		stdin_updates_init (&updates, display, message_window);
+	display_run (display);
+
+	if (spec->stdin_updates) {
+		display_unwatch_fd (display, STDIN_FILENO);
+		free (updates.buffer);
+	}
+	while ((mirror = message_window->mirror)) {
+		message_window->mirror = mirror->mirror;
+		output_set_destroy_handler (mirror->output, NULL);
+		message_window_destroy (mirror);
+	}
+	message_window_destroy (message_window);
+	display_destroy (display);
+
+	return result.value;
+}
+
+
+ /* parses the dialog option at argv[i], which may also be the
+  * message ; returns the index of the last argument used */
+static int
+dialog_spec_parse_arg (struct dialog_spec *spec, int argc, char *argv[], int i)
+{
+	if (!strcmp (argv[i], "-file")) {
+		if (argc >= i+2)
+			spec->file = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-buttons")) {
+		if (argc >= i+2)
+			spec->buttons = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-default")) {
+		if (argc >= i+2)
+			spec->deflt = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-textfield")) {
+		if (argc >= i+2)
+			spec->textfield = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-title")) {
+		if (argc >= i+2)
+			spec->title = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-titlebuttons")) {
+		if (argc >= i+2)
+			spec->titlebuttons = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-no-resize")) {
+		spec->noresize = 1;
+		return i;
+	}
+
+	if (!strcmp (argv[i], "-icon")) {
+		if (argc >= i+2)
+			spec->icon = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-timeout")) {
+		if (argc >= i+2)
+			spec->timeout = atoi (argv[i+1]);
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-progress")) {
+		if (argc >= i+2)
+			spec->progress = argv[i+1];
+		return i + 1;
+	}
+
+	if (!strcmp (argv[i], "-stdin-updates")) {
+		spec->stdin_updates = 1;
+		return i;
+	}
+
+	if (!spec->message && !spec->file)
+		spec->message = argv[i];
+
+	return i;
+}
+
+ /* batch mode : every line of the input holds the options of one
+  * dialog, as on the command line. The dialogs share the display and
+  * the theme ; one JSON object per answer goes to stdout. */
+
+struct batch {
+	struct display *display;
+	struct wl_list dialog_list;
+	int parallel;
+	int shown;
+	struct task next_task;
+	int next_scheduled;
+};
+
+struct batch_dialog {
+	struct batch *batch;
+	struct wl_list link;
+	int index;
+	struct arena arena;		/* the line, split into "argv" */
+	struct dialog_spec spec;
+	struct message_window *message_window;
+	struct timespec start;
+	int answered;
+};
+
+static void
+json_print_string (FILE *out, const char *text)
+{
+	const unsigned char *p;
+
+	fputc ('"', out);
+	for (p = (const unsigned char *) text; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf (out, "\\%c", *p);
+		else if (*p == '\n')
+			fputs ("\\n", out);
+		else if (*p < 0x20)
+			fprintf (out, "\\u%04x", *p);
+		else
+			fputc (*p, out);
+	}
+	fputc ('"', out);
+}
+
+static void
+batch_dialog_destroy (struct batch_dialog *dialog)
+{
+	if (dialog->message_window)
+		message_window_destroy (dialog->message_window);
+	wl_list_remove (&dialog->link);
+	arena_release (&dialog->arena);
+	free (dialog);
+}
+
+static void batch_dialog_done (struct message_window *message_window,
+                               int value, const char *text, void *data);
+
+static void
+batch_dialog_show (struct batch_dialog *dialog)
+{
+	clock_gettime (CLOCK_MONOTONIC, &dialog->start);
+	dialog->message_window = message_window_create (dialog->batch->display,
+	                                                &dialog->spec,
+	                                                batch_dialog_done, dialog);
+	dialog->batch->shown++;
+}
+
+ /* tears down answered dialogs, shows the next one, and stops once
+  * everything is answered */
+static void
+batch_next (struct task *task, uint32_t events)
+{
+	struct batch *batch = container_of (task, struct batch, next_task);
+	struct batch_dialog *dialog, *tmp;
+
+	batch->next_scheduled = 0;
+
+	wl_list_for_each_safe (dialog, tmp, &batch->dialog_list, link) {
+		if (dialog->answered) {
+			batch_dialog_destroy (dialog);
+			batch->shown--;
+		}
+	}
+
+	if (wl_list_empty (&batch->dialog_list)) {
+		display_exit (batch->display);
+		return;
+	}
+
+	if (!batch->shown) {
+		dialog = container_of (batch->dialog_list.next, struct batch_dialog, link);
+		batch_dialog_show (dialog);
+	}
+}
+
+static void
+batch_dialog_done (struct message_window *message_window,
+                   int value, const char *text, void *data)
+{
+	struct batch_dialog *dialog = data;
+	struct batch *batch = dialog->batch;
+	struct timespec now;
+	long ms;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - dialog->start.tv_sec) * 1000 +
+	     (now.tv_nsec - dialog->start.tv_nsec) / 1000000;
+
+	printf ("{\"index\":%d,\"value\":%d,\"text\":", dialog->index, value);
+	if (text)
+		json_print_string (stdout, text);
+	else
+		fputs ("null", stdout);
+	printf (",\"time_ms\":%ld}\n", ms);
+	fflush (stdout);
+
+	dialog->answered = 1;
+
+	 /* we are called from a widget handler, tear down from the main loop */
+	if (!batch->next_scheduled) {
+		batch->next_scheduled = 1;
+		display_defer (batch->display, &batch->next_task);
+	}
+}
+
+ /* splits "line" in place into words quoted as in a shell : '...' is
+  * literal, "..." only keeps \\ before $ ` " \\ and newlines, \\ quotes
+  * the next character elsewhere and # starts a comment. "argv" must have
+  * room for strlen (line) / 2 + 1 words. Returns the number of words, or
+  * -1 if a quote is left open */
+static int
+shell_split (char *line, char **argv)
+{
+	char *in = line, *out = line;
+	int argc = 0;
+
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+	for (;;) {
+		while (IS_BLANK (*in))
+			in++;
+		if (*in == '\0' || *in == '#')
+			break;
+
+		argv[argc++] = out;
+		while (*in && !IS_BLANK (*in)) {
+			if (*in == '\'') {
+				for (in++; *in && *in != '\''; )
+					*out++ = *in++;
+				if (!*in++)
+					return -1;
+			} else if (*in == '"') {
+				for (in++; *in && *in != '"'; ) {
+					if (in[0] == '\\' && in[1] && strchr ("$`\"\\\n", in[1]))
+						in++;
+					*out++ = *in++;
+				}
+				if (!*in++)
+					return -1;
+			} else if (in[0] == '\\' && in[1]) {
+				in++;
+				*out++ = *in++;
+			} else {
+				*out++ = *in++;
+			}
+		}
+		 /* "out" never passes "in", the word ends before the blank */
+		if (*in)
+			in++;
+		*out++ = '\0';
+	}
+#undef IS_BLANK
+
+	argv[argc] = NULL;
+	return argc;
+}
+
+ /* reads one dialog per non-empty line, "#" starting a comment line */
+static int
+batch_read (struct batch *batch, const char *filename)
+{
+	struct batch_dialog *dialog;
+	FILE *file;
+	char *line = NULL, *words, **argv;
+	size_t size = 0, len;
+	ssize_t read;
+	int argc, i, index = 0, lineno = 0;
+
+	if (!strcmp (filename, "-"))
+		file = stdin;
+	else
+		file = fopen (filename, "r");
+	if (!file) {
+		fprintf (stderr, "could not open %s: %m\n", filename);
+		return -1;
+	}
+
+	while ((read = getline (&line, &size, file)) > 0) {
+		lineno++;
+		len = read;
+
+		dialog = xzalloc (sizeof *dialog);
+		 /* the words stay in the line, which the options point to */
+		words = arena_strndup (&dialog->arena, line, len);
+		argv = arena_alloc (&dialog->arena, (len / 2 + 2) * sizeof *argv);
+
+		argc = shell_split (words, argv);
+		if (argc <= 0) {
+			if (argc < 0)
+				fprintf (stderr, "%s:%d: unterminated quote\n",
+				         filename, lineno);
+			arena_release (&dialog->arena);
+			free (dialog);
+			continue;
+		}
+
+		dialog->batch = batch;
+		dialog->index = index++;
+		for (i = 0; i < argc; i++)
+			i = dialog_spec_parse_arg (&dialog->spec, argc, argv, i);
+		 /* stdin may be the batch itself */
+		dialog->spec.stdin_updates = 0;
+		wl_list_insert (batch->dialog_list.prev, &dialog->link);
+	}
+
+	free (line);
+	if (file != stdin)
+		fclose (file);
+
+	return 0;
+}
+
+int
+wlmessage_batch (const char *filename, int parallel)
+{
+	struct batch batch;
+	struct batch_dialog *dialog, *tmp;
+
+	memset (&batch, 0, sizeof batch);
+	wl_list_init (&batch.dialog_list);
+	batch.parallel = parallel;
+	batch.next_task.run = batch_next;
+
+	if (batch_read (&batch, filename) < 0)
+		return 1;
+	if (wl_list_empty (&batch.dialog_list))
+		return 0;
+
+	batch.display = wlmessage_display_create ();
+	if (!batch.display) {
+		fprintf (stderr, "Failed to connect to a Wayland compositor !\n");
+		wl_list_for_each_safe (dialog, tmp, &batch.dialog_list, link)
+			batch_dialog_destroy (dialog);
+		return 1;
+	}
+	display_set_global_handler (batch.display, global_handler);
+
+	if (parallel) {
+		wl_list_for_each (dialog, &batch.dialog_list, link)
+			batch_dialog_show (dialog);
+	} else {
+		dialog = container_of (batch.dialog_list.next, struct batch_dialog, link);
+		batch_dialog_show (dialog);
+	}
 
-	widget_get_allocation (widget, &allocation);
+	display_run (batch.display);
 
-	x = allocation.x + (width - 240)/2;
+	wl_list_for_each_safe (dialog, tmp, &batch.dialog_list, link)
+		batch_dialog_destroy (dialog);
+	display_destroy (batch.display);
 
-	if (message_window->entry) {
-		entry = message_window->entry;
-		widget_set_allocation (entry->widget, x, allocation.y + height - 16*2 - 32*2,
-		                                      240, 32);
-	}
+	return 0;
+}
 
-	buttons_width = 0;
-	wl_list_for_each (button, &message_window->button_list, link) {
-		extended_width = strlen(button->caption) - 5;
-		if (extended_width < 0) extended_width = 0;
-		buttons_width += 60 + extended_width*10;
-	}
 
-	x = allocation.x + (width - buttons_width)/2
-	                 - (message_window->buttons_nb-1)*10;
+ /* daemon mode : one process keeps the Wayland connection and the theme,
+  * and serves dialogs to thin clients over a Unix socket.
+  * A request is a 32-bit length followed by "key\0value\0" pairs ;
+  * the reply is the 32-bit button value, a 32-bit text length and the text. */
 
-	wl_list_for_each (button, &message_window->button_list, link) {
-		extended_width = strlen(button->caption) - 5;
-		if (extended_width < 0) extended_width = 0;
-		widget_set_allocation (button->widget, x, allocation.y + height - 16 - 32,
-		                                       60 + extended_width*10, 32); 
-		x += 60 + extended_width*10 + 10;
+static char *
+daemon_socket_path (void)
+{
+	const char *runtime_dir = getenv ("XDG_RUNTIME_DIR");
+	const char *wayland_display = getenv ("WAYLAND_DISPLAY");
+	char *path;
+
+	if (!runtime_dir)
+		return NULL;
+	if (!wayland_display)
+		wayland_display = "wayland-0";
+
+	if (asprintf (&path, "%s/wlmessage-%s", runtime_dir, wayland_display) < 0)
+		return NULL;
+
+	if (strlen (path) >= sizeof (((struct sockaddr_un *)0)->sun_path)) {
+		free (path);
+		return NULL;
 	}
+
+	return path;
 }
 
-static void
-redraw_handler (struct widget *widget, void *data)
+static int
+daemon_connect (const char *path)
 {
-	struct message_window *message_window = data;
-	struct rectangle allocation;
-	cairo_surface_t *surface;
-	cairo_t *cr;
-	cairo_text_extents_t extents;
-	int lines_nb;
-	char **lines;
+	struct sockaddr_un addr;
+	int fd;
 
-	widget_get_allocation (message_window->widget, &allocation);
+	fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
 
-	surface = window_get_surface (message_window->window);
-	cr = cairo_create (surface);
-	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-	cairo_rectangle (cr,
-			allocation.x,
-			allocation.y,
-			allocation.width,
-			allocation.height);
-	cairo_set_source_rgba (cr, 0.5, 0.5, 0.5, 1.0);
-	cairo_fill (cr);
+	memset (&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
 
-	if (message_window->icon) {
-			cairo_set_source_surface (cr, message_window->icon,
-			                              allocation.x + (allocation.width - 64.0)/2,
-			                              allocation.y + 10);
-			cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
-			cairo_paint (cr);
-			cairo_set_source_surface (cr, surface, 0.0, 0.0);
+	if (connect (fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+		close (fd);
+		return -1;
 	}
 
-	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 1.0);
-	cairo_select_font_face (cr, "sans",
-	                        CAIRO_FONT_SLANT_NORMAL,
-	                        CAIRO_FONT_WEIGHT_NORMAL);
-	cairo_set_font_size (cr, 18);
+	return fd;
+}
 
-	lines_nb = get_number_of_lines (message_window->message);
-	lines = get_lines (message_window->message);
+static int
+write_all (int fd, const void *data, size_t len)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	const char *p = data;
+	ssize_t ret;
 
-	int i;
-	for (i = 0; i < lines_nb; i++) {
-		cairo_text_extents (cr, lines[i], &extents);
-		cairo_move_to (cr, allocation.x + (allocation.width - extents.width)/2,
-	        	           allocation.y + (allocation.height - lines_nb * extents.height)/2
-		                                + i*(extents.height+10)
-		                                + (!message_window->icon ? 0 : 32)
-                                                - (!message_window->entry ? 0 : 32)
-                                                - (!message_window->buttons_nb ? 0 : 32));
-		cairo_show_text (cr, lines[i]);
+	while (len > 0) {
+		ret = send (fd, p, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN) {
+			 /* replies are tiny, a socket still full after the timeout
+			  * means a stuck client, which then gets dropped */
+			do
+				ret = poll (&pfd, 1, WRITE_TIMEOUT);
+			while (ret < 0 && errno == EINTR);
+			if (ret <= 0 || !(pfd.revents & POLLOUT))
+				return -1;
+			continue;
+		}
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
 	}
 
-	g_strfreev (lines);
+	return 0;
+}
+
+static int
+read_all (int fd, void *data, size_t len)
+{
+	char *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read (fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
 
-	cairo_destroy (cr);
+	return 0;
 }
 
 static void
-key_handler (struct window *window, struct input *input, uint32_t time,
-		 uint32_t key, uint32_t sym, enum wl_keyboard_key_state state,
-		 void *data)
+request_add (char **request, uint32_t *len, const char *key, const char *value)
 {
-	struct message_window *message_window = data;
-	struct entry *entry = message_window->entry;
-	char *new_text;
-	char text[16];
-
-	if (state == WL_KEYBOARD_KEY_STATE_RELEASED)
-		return;
+	size_t key_len = strlen (key) + 1;
+	size_t value_len = strlen (value) + 1;
 
-	if (sym == XKB_KEY_Return || sym == XKB_KEY_KP_Enter) {
-		if (entry)
-			fprintf (stdout, entry->text);
-		message_window_destroy ();
-		exit (default_value);
-	}
-
-	if (entry && entry->active) {
-		switch (sym) {
-			case XKB_KEY_BackSpace:
-				if (entry->cursor_pos == 0)
-					break;
-				new_text = malloc (strlen(entry->text));
-				strncpy (new_text, entry->text, entry->cursor_pos - 1);
-				strcpy (new_text+entry->cursor_pos-1, entry->text+entry->cursor_pos);
-				free (entry->text);
-				entry->text = new_text;
-				entry->cursor_pos--;
-				break;
-			case XKB_KEY_Delete:
-				if (entry->cursor_pos == strlen (entry->text))
-					break;
-				new_text = malloc (strlen(entry->text));
-				strncpy (new_text, entry->text, entry->cursor_pos);
-				strcpy (new_text+entry->cursor_pos, entry->text+entry->cursor_pos+1);
-				free (entry->text);
-				entry->text = new_text;
-				break;
-			case XKB_KEY_Left:
-				if (entry->cursor_pos != 0)
-					entry->cursor_pos--;
-				break;
-			case XKB_KEY_Right:
-				if (entry->cursor_pos != strlen (entry->text))
-					entry->cursor_pos++;
-				break;
-			case XKB_KEY_Tab:
-				break;
-			default:
-				if (strlen(entry->text) >= 18)
-					break;
-				if (xkb_keysym_to_utf8 (sym, text, sizeof(text)) <= 0)
-					break;
-				if (strlen(text) > 1)	/* dismiss non-ASCII characters for now */
-					break;
-				new_text = malloc (strlen(entry->text) + strlen(text) + 1);
-				strncpy (new_text, entry->text, entry->cursor_pos);
-				strcpy (new_text+entry->cursor_pos, text);
-				strcpy (new_text+entry->cursor_pos+strlen(text), entry->text+entry->cursor_pos);
-				free (entry->text);
-				entry->text = new_text;
-				entry->cursor_pos++;
-		}
-		widget_schedule_redraw(entry->widget);
-	}
+	*request = xrealloc (*request, *len + key_len + value_len);
+	memcpy (*request + *len, key, key_len);
+	memcpy (*request + *len + key_len, value, value_len);
+	*len += key_len + value_len;
 }
 
-void
-message_window_add_entry (char *textfield)
+ /* returns -1 if there is no daemon, otherwise stores the exit code
+  * of the remote dialog in "value" */
+int
+daemon_client_run (struct dialog_spec *spec, int *value)
 {
-	struct entry *entry;
+	char *path, *request = NULL, *text;
+	char resolved[PATH_MAX];
+	char number[16];
+	uint32_t len = 0, reply[2];
+	int fd;
+
+	path = daemon_socket_path ();
+	if (!path)
+		return -1;
+	fd = daemon_connect (path);
+	free (path);
+	if (fd < 0)
+		return -1;
+
+	 /* the daemon does not share our working directory */
+	if (spec->message)
+		request_add (&request, &len, "message", spec->message);
+	if (spec->file)
+		request_add (&request, &len, "file",
+		             realpath (spec->file, resolved) ? resolved : spec->file);
+	if (spec->icon)
+		request_add (&request, &len, "icon",
+		             realpath (spec->icon, resolved) ? resolved : spec->icon);
+	if (spec->title)
+		request_add (&request, &len, "title", spec->title);
+	if (spec->titlebuttons)
+		request_add (&request, &len, "titlebuttons", spec->titlebuttons);
+	if (spec->noresize)
+		request_add (&request, &len, "noresize", "1");
+	if (spec->buttons)
+		request_add (&request, &len, "buttons", spec->buttons);
+	if (spec->deflt)
+		request_add (&request, &len, "default", spec->deflt);
+	if (spec->textfield)
+		request_add (&request, &len, "textfield", spec->textfield);
+	if (spec->progress)
+		request_add (&request, &len, "progress", spec->progress);
+	if (spec->timeout) {
+		snprintf (number, sizeof number, "%d", spec->timeout);
+		request_add (&request, &len, "timeout", number);
+	}
 
-	entry = xzalloc (sizeof *entry);
-	entry->widget = widget_add_widget (message_window->widget, entry);
-	entry->text = strdup (textfield);
-	entry->cursor_pos = strlen (entry->text);
-	entry->cursor_anchor = entry->cursor_pos;
-	entry->last_vkb_len = 0;
-	entry->active = 0;
+	if (write_all (fd, &len, sizeof len) < 0 ||
+	    write_all (fd, request, len) < 0 ||
+	    read_all (fd, reply, sizeof reply) < 0) {
+		fprintf (stderr, "Lost connection to the wlmessage daemon !\n");
+		free (request);
+		close (fd);
+		*value = 1;
+		return 0;
+	}
+	free (request);
 
-	message_window->entry = entry;
+	if (reply[1] > 0) {
+		text = xmalloc (reply[1]);
+		if (read_all (fd, text, reply[1]) == 0)
+			fwrite (text, 1, reply[1], stdout);
+		free (text);
+	}
 
-	widget_set_redraw_handler (entry->widget, entry_redraw_handler);
-	widget_set_motion_handler (entry->widget, entry_motion_handler);
-	widget_set_button_handler (entry->widget, entry_click_handler);
-	widget_set_touch_down_handler (entry->widget, entry_touch_handler);
+	close (fd);
+
+	*value = (int32_t) reply[0];
+	return 0;
 }
 
-void
-message_window_add_button (char *button_desc)
+static int
+daemon_client_parse (struct daemon_client *client)
 {
-	struct button *button;
+	struct dialog_spec *spec = &client->spec;
+	char *p = client->request, *end = client->request + client->len;
+	char *key, *value;
+
+	if (client->len == 0 || end[-1] != '\0')
+		return -1;
+
+	while (p < end) {
+		key = p;
+		p += strlen (p) + 1;
+		if (p >= end)
+			return -1;
+		value = p;
+		p += strlen (p) + 1;
+
+		if (!strcmp (key, "message"))
+			spec->message = value;
+		else if (!strcmp (key, "file"))
+			spec->file = value;
+		else if (!strcmp (key, "icon"))
+			spec->icon = value;
+		else if (!strcmp (key, "title"))
+			spec->title = value;
+		else if (!strcmp (key, "titlebuttons"))
+			spec->titlebuttons = value;
+		else if (!strcmp (key, "noresize"))
+			spec->noresize = atoi (value);
+		else if (!strcmp (key, "buttons"))
+			spec->buttons = value;
+		else if (!strcmp (key, "default"))
+			spec->deflt = value;
+		else if (!strcmp (key, "textfield"))
+			spec->textfield = value;
+		else if (!strcmp (key, "timeout"))
+			spec->timeout = atoi (value);
+		else if (!strcmp (key, "progress"))
+			spec->progress = value;
+	}
 
-	gchar **desc = g_strsplit (button_desc, ":", 2);
+	return 0;
+}
 
-	button = xzalloc (sizeof *button);
-	button->widget = widget_add_widget (message_window->widget, button);
-	button->caption = strdup (desc[0]);
-	button->value = atoi (desc[1]);
+static void daemon_process (struct daemon *daemon);
 
-	g_strfreev (desc);
+static void
+daemon_client_destroy (struct daemon_client *client)
+{
+	struct daemon *daemon = client->daemon;
+	int was_current = daemon->current == client;
 
-	widget_set_redraw_handler (button->widget, button_redraw_handler);
-	widget_set_enter_handler (button->widget, button_enter_handler);
-	widget_set_leave_handler (button->widget, button_leave_handler);
-	widget_set_button_handler (button->widget, button_click_handler);
-	widget_set_touch_down_handler (button->widget, button_touch_down_handler);
-	widget_set_touch_up_handler (button->widget, button_touch_up_handler);
+	if (was_current) {
+		daemon->interface->dialog_destroy (client);
+		daemon->current = NULL;
+	}
 
-	wl_list_insert (message_window->button_list.prev, &button->link);
+	daemon->interface->unwatch (client);
+	close (client->fd);
+	wl_list_remove (&client->link);
+	free (client->request);
+	free (client);
+
+	 /* a client gone mid-dialog leaves the screen to the next one */
+	if (was_current && !daemon->closing)
+		daemon_process (daemon);
 }
 
-void
-message_window_create (struct display *display, char *message, char *title, char *titlebuttons, int noresize, char *buttons, char *icon, char *deflt, char *textfield)
+static void daemon_dialog_done (struct message_window *message_window,
+                                int value, const char *text, void *data);
+
+static struct message_window *
+daemon_dialog_create (struct daemon_client *client)
 {
-	int frame_type = FRAME_ALL;
-	int extended_width = 0;
-	int lines_nb = 0;
+	return message_window_create (client->daemon->display, &client->spec,
+	                              daemon_dialog_done, client);
+}
 
-	if (titlebuttons) {
-		frame_type = FRAME_NONE;
-		if (strstr (titlebuttons, "Min"))
-			frame_type = frame_type | FRAME_MINIMIZE;
-		if (strstr (titlebuttons, "Max"))
-			frame_type = frame_type | FRAME_MAXIMIZE;
-		if (strstr (titlebuttons, "Close"))
-			frame_type = frame_type | FRAME_CLOSE;
-	}
+static void
+daemon_dialog_destroy (struct daemon_client *client)
+{
+	message_window_destroy (client->message_window);
+}
 
-	message_window = xzalloc (sizeof *message_window);
-	message_window->window = window_create (display);
-	message_window->widget = window_frame_create (message_window->window, frame_type, !noresize,  message_window);
+static void
+daemon_client_unwatch (struct daemon_client *client)
+{
+	display_unwatch_fd (client->daemon->display, client->fd);
+}
 
-	message_window->message = message;
+static const struct daemon_interface daemon_display_interface = {
+	daemon_dialog_create,
+	daemon_dialog_destroy,
+	daemon_client_unwatch
+};
 
-	if (title)
-		message_window->title = strdup (title);
-	else
-		message_window->title = strdup ("wlmessage");
-	window_set_title (message_window->window, message_window->title);
+static void
+daemon_process (struct daemon *daemon)
+{
+	struct daemon_client *client;
 
-	message_window->buttons_nb = 0;
-	wl_list_init (&message_window->button_list);
-	if (buttons) {
-		gchar **button_list = g_strsplit (buttons, ",", 3);
-		while (button_list[message_window->buttons_nb] != NULL) {
-			message_window_add_button (button_list[message_window->buttons_nb]);
-			message_window->buttons_nb++;
+	if (daemon->current)
+		return;
+
+	wl_list_for_each (client, &daemon->client_list, link) {
+		if (client->ready) {
+			daemon->current = client;
+			client->message_window = daemon->interface->dialog_create (client);
+			return;
 		}
-		g_strfreev (button_list);
 	}
+}
 
-	default_value = 0;
-	if (buttons && deflt) {
-		struct button *button;
-		wl_list_for_each (button, &message_window->button_list, link) {
-			if (!strcmp(button->caption, deflt))
-				default_value = button->value;
-		}
+static void
+daemon_next (struct task *task, uint32_t events)
+{
+	struct daemon *daemon = container_of (task, struct daemon, next_task);
+
+	daemon->next_scheduled = 0;
+	if (daemon->current)
+		daemon_client_destroy (daemon->current);
+	daemon_process (daemon);
+}
+
+static void
+daemon_dialog_done (struct message_window *message_window,
+                    int value, const char *text, void *data)
+{
+	struct daemon_client *client = data;
+	struct daemon *daemon = client->daemon;
+	uint32_t reply[2];
+
+	reply[0] = value;
+	reply[1] = text ? strlen (text) : 0;
+	 /* either way the client is dropped by daemon_next () */
+	if (write_all (client->fd, reply, sizeof reply) < 0 ||
+	    (reply[1] && write_all (client->fd, text, reply[1]) < 0))
+		fprintf (stderr, "wlmessage daemon: client not reading its reply, dropped\n");
+
+	 /* we are called from a widget handler, tear down from the main loop */
+	if (!daemon->next_scheduled) {
+		daemon->next_scheduled = 1;
+		display_defer (daemon->display, &daemon->next_task);
+	}
+}
+
+static void
+daemon_client_data (struct task *task, uint32_t events)
+{
+	struct daemon_client *client =
+		container_of (task, struct daemon_client, task);
+	char *p;
+	size_t want;
+	ssize_t ret;
+
+	if (client->ready) {
+		 /* nothing more is expected : the client went away */
+		if (client->daemon->current != client || !client->daemon->next_scheduled)
+			daemon_client_destroy (client);
+		return;
 	}
 
-	if (textfield) {
-		message_window_add_entry (textfield);
+	if (client->len < sizeof client->size && !client->request) {
+		p = (char *) &client->size + client->len;
+		want = sizeof client->size - client->len;
 	} else {
-		message_window->entry = NULL;
+		p = client->request + client->len;
+		want = client->size - client->len;
 	}
 
-	if (icon) {
-		cairo_surface_t *icon_temp = cairo_image_surface_create_from_png (icon);
-		cairo_status_t status = cairo_surface_status (icon_temp);
-		if (status == CAIRO_STATUS_SUCCESS) {
-			message_window->icon = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 64, 64);
-			cairo_t *icon_cr = cairo_create (message_window->icon);
-			 /* rescale to 64x64 */
-			int width = cairo_image_surface_get_width (icon_temp);
-			int height = cairo_image_surface_get_height (icon_temp);
-			if (width != height != 64) {
-				double ratio = ((64.0/width) < (64.0/height) ? (64.0/width) : (64.0/height));
-				cairo_scale (icon_cr, ratio, ratio);
-			}
-			cairo_set_source_surface (icon_cr, icon_temp, 0.0, 0.0);
-			cairo_paint (icon_cr);
-			cairo_destroy (icon_cr);
-			cairo_surface_destroy (icon_temp);
-		}
+	ret = read (client->fd, p, want);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		daemon_client_destroy (client);
+		return;
 	}
-	else {
-		message_window->icon = NULL;
+
+	client->len += ret;
+
+	if (!client->request) {
+		if (client->len < sizeof client->size)
+			return;
+		if (client->size == 0 || client->size > MAX_REQUEST_SIZE) {
+			daemon_client_destroy (client);
+			return;
+		}
+		client->request = xmalloc (client->size);
+		client->len = 0;
+		return;
 	}
 
-	extended_width = (get_max_length_of_lines (message)) - 35;
-	 if (extended_width < 0) extended_width = 0;
-	lines_nb = get_number_of_lines (message);
+	if (client->len < client->size)
+		return;
 
-	window_set_user_data (message_window->window, message_window);
-	window_set_key_handler (message_window->window, key_handler);
-	widget_set_redraw_handler (message_window->widget, redraw_handler);
-	widget_set_resize_handler (message_window->widget, resize_handler);
+	if (daemon_client_parse (client) < 0) {
+		fprintf (stderr, "wlmessage daemon: malformed request\n");
+		daemon_client_destroy (client);
+		return;
+	}
 
-	window_schedule_resize (message_window->window,
-	                        480 + extended_width*10,
-	                        280 + lines_nb*16 + (!message_window->entry ? 0 : 1)*32
-	                                          + (!message_window->buttons_nb ? 0 : 1)*32);
+	client->ready = 1;
+	daemon_process (client->daemon);
 }
 
-void
-message_window_destroy ()
+static void
+daemon_accept (struct task *task, uint32_t events)
 {
-	if (message_window->surface)
-		cairo_surface_destroy (message_window->surface);
+	struct daemon *daemon = container_of (task, struct daemon, task);
+	struct daemon_client *client;
+	int fd;
 
-	if (message_window->icon)
-		cairo_surface_destroy (message_window->icon);
+	fd = accept4 (daemon->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
 
-	struct entry *entry;
-	if (message_window->entry) {
-		entry = message_window->entry;
-		if (entry->text_input)
-			wl_text_input_destroy (entry->text_input);
-		widget_destroy(entry->widget);
-		free (entry->text);
-		free (entry);
+	client = xzalloc (sizeof *client);
+	client->daemon = daemon;
+	client->fd = fd;
+	client->task.run = daemon_client_data;
+	wl_list_insert (daemon->client_list.prev, &client->link);
+
+	display_watch_fd (daemon->display, fd, EPOLLIN | EPOLLHUP, &client->task);
+}
+
+static int
+daemon_listen (struct daemon *daemon)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	daemon->path = daemon_socket_path ();
+	if (!daemon->path) {
+		fprintf (stderr, "XDG_RUNTIME_DIR is not set or too long !\n");
+		return -1;
 	}
 
-	struct button *button, *tmp;
-	wl_list_for_each_safe (button, tmp, &message_window->button_list, link) {
-		wl_list_remove (&button->link);
-		widget_destroy (button->widget);
-		free (button->caption);
-		free (button);
+	 /* refuse to steal the socket from a running daemon */
+	fd = daemon_connect (daemon->path);
+	if (fd >= 0) {
+		fprintf (stderr, "A wlmessage daemon is already listening on %s !\n", daemon->path);
+		close (fd);
+		return -1;
 	}
+	unlink (daemon->path);
 
-	widget_destroy (message_window->widget);
-	window_destroy (message_window->window);
-	free (message_window->title);
-	free (message_window->message);
-	free (message_window);
-}
+	daemon->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (daemon->fd < 0)
+		return -1;
 
-static void
-global_handler(struct display *display, uint32_t name,
-	       const char *interface, uint32_t version, void *data)
-{
-	if (!strcmp(interface, "wl_text_input_manager")) {
-		text_input_manager = display_bind (display, name, &wl_text_input_manager_interface, 1);
+	memset (&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, daemon->path);
+
+	if (bind (daemon->fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+	    listen (daemon->fd, 16) < 0) {
+		fprintf (stderr, "Failed to listen on %s : %s\n", daemon->path, strerror (errno));
+		close (daemon->fd);
+		return -1;
 	}
+
+	return 0;
 }
 
-void
-wlmessage_run (char *message, char *title, char *titlebuttons, int noresize, char *buttons, char *icon, int timeout, char *deflt, char *textfield)
+int
+wlmessage_daemon (void)
 {
-	struct display *display = NULL;
+	struct daemon daemon;
+	struct daemon_client *client, *tmp;
 
-	display = display_create (NULL, NULL);
-	if (!display) {
+	memset (&daemon, 0, sizeof daemon);
+	daemon.interface = &daemon_display_interface;
+	wl_list_init (&daemon.client_list);
+	daemon.next_task.run = daemon_next;
+
+	if (daemon_listen (&daemon) < 0) {
+		free (daemon.path);
+		return 1;
+	}
+
+	daemon.display = wlmessage_display_create ();
+	if (!daemon.display) {
 		fprintf (stderr, "Failed to connect to a Wayland compositor !\n");
-		return;
+		close (daemon.fd);
+		unlink (daemon.path);
+		free (daemon.path);
+		return 1;
 	}
 
-	if (timeout)
-		display_set_timeout (display, timeout);
+	daemon.task.run = daemon_accept;
+	display_watch_fd (daemon.display, daemon.fd, EPOLLIN, &daemon.task);
+	display_set_global_handler (daemon.display, global_handler);
 
-	message_window_create (display, message, title, titlebuttons, noresize, buttons, icon, deflt, textfield);
-	display_set_global_handler (display, global_handler);
-	display_run (display);
+	display_run (daemon.display);
 
-	message_window_destroy ();
-	display_destroy (display);
-}
+	daemon.closing = 1;
+	wl_list_for_each_safe (client, tmp, &daemon.client_list, link)
+		daemon_client_destroy (client);
 
+	display_unwatch_fd (daemon.display, daemon.fd);
+	close (daemon.fd);
+	unlink (daemon.path);
+	free (daemon.path);
+	display_destroy (daemon.display);
 
-char *
-read_from_file (char *filename)
-{
-	FILE *file = NULL;
-	char *text = NULL;
-	int i, c;
+	return 0;
+}
 
-	file = fopen (filename, "r");
-	if (file) {
-		i = 0;
-		text = malloc (sizeof(char));
-		while (c != EOF) {
-			c = fgetc (file);
-			if (c != EOF) {
-				realloc (text, (i+1)*sizeof(char));
-				text[i] = c;
-				i++;
-			}
-		}
-		realloc (text, (i+1)*sizeof(char));
-		text[i] = '\0';
-		fclose (file);
-	}
 
-	return text;
-}
 
+ /* wlmessage-bench and wlmessage-test include this file for its
+  * drawing and input code */
+#if !defined (WLMESSAGE_BENCH) && !defined (WLMESSAGE_TEST)
 int
 main (int argc, char *argv[])
 {
@@ -922,85 +3375,116 @@ main (int argc, char *argv[])
                         "    -title title                window has this title\n"
                         "    -titlebuttons string        comma-separated list of \"Min, Max, Close, None\"\n"
                         "    -no-resize                  window is not resizable\n"
-                        "    -icon filename              window shows this PNG icon\n"
+                        "    -icon filename              window shows this icon (PNG, JPEG or WebP)\n"
+                        "    -daemon                     serve dialogs to other wlmessage invocations\n"
+                        "    -no-daemon                  do not hand the dialog to a running daemon\n"
+                        "    -progress percent|pulse     show a progress bar, \"pulse\" when indeterminate\n"
+                        "    -batch file                 show the dialogs listed in file (\"-\" for stdin)\n"
+                        "    -parallel                   with -batch, show all the dialogs at once\n"
+                        "    -stdin-updates              update the dialog from \"key:value\" lines on stdin\n"
+                        "    -lowmem                     shadowless, opaque 16-bit buffers, no extra caches\n"
+                        "    -renderer shm|egl|auto      how to draw, auto uses EGL for large windows only\n"
+                        "    -all-outputs                show the dialog fullscreen on every output\n"
+                        "    -trace file                 write a Chrome trace of the process to file on exit\n"
+                        "    -stats                      print startup, frame and latency counters on exit\n"
+                        "    -stats-fd fd                write these counters to fd instead of stderr\n"
                         "\n");
 		return 0;
 	}
 
 
 	int i;
-	char *message = NULL;
-	char *buttons = NULL;
-	char *deflt = NULL;
-	char *textfield = NULL;
-	char *title = NULL;
-	char *titlebuttons = NULL;
-	char *icon = NULL;
-	int timeout = 0;
-	int noresize = 0;
+	struct dialog_spec spec;
+	int daemon = 0;
+	int no_daemon = 0;
+	char *batch = NULL;
+	int parallel = 0;
+	int ret;
+
+	memset (&spec, 0, sizeof spec);
 
 	for (i = 1; i < argc ; i++) {
 
-		if (!strcmp (argv[i], "-file")) {
-			if (argc >= i+2)
-				message = read_from_file (argv[i+1]);
-			i++; continue;
+		if (!strcmp (argv[i], "-daemon")) {
+			daemon = 1;
+			continue;
 		}
 
-		if (!strcmp (argv[i], "-buttons")) {
-			if (argc >= i+2)
-				buttons = argv[i+1];
-			i++; continue;
+		if (!strcmp (argv[i], "-no-daemon")) {
+			no_daemon = 1;
+			continue;
 		}
 
-		if (!strcmp (argv[i], "-default")) {
+		if (!strcmp (argv[i], "-batch")) {
 			if (argc >= i+2)
-				deflt = argv[i+1];
+				batch = argv[i+1];
 			i++; continue;
 		}
 
-		if (!strcmp (argv[i], "-textfield")) {
-			if (argc >= i+2)
-				textfield = argv[i+1];
-			i++; continue;
+		if (!strcmp (argv[i], "-parallel")) {
+			parallel = 1;
+			continue;
 		}
 
-		if (!strcmp (argv[i], "-title")) {
-			if (argc >= i+2)
-				title = argv[i+1];
-			i++; continue;
+		if (!strcmp (argv[i], "-lowmem")) {
+			low_memory = 1;
+			continue;
 		}
 
-		if (!strcmp (argv[i], "-titlebuttons")) {
+		if (!strcmp (argv[i], "-trace")) {
 			if (argc >= i+2)
-				titlebuttons = argv[i+1];
+				trace_open (argv[i+1]);
 			i++; continue;
 		}
 
-		if (!strcmp (argv[i], "-no-resize")) {
-			noresize = 1;
+		if (!strcmp (argv[i], "-stats")) {
+			stats_open (STDERR_FILENO);
 			continue;
 		}
 
-		if (!strcmp (argv[i], "-icon")) {
+		if (!strcmp (argv[i], "-stats-fd")) {
 			if (argc >= i+2)
-				icon = argv[i+1];
+				stats_open (atoi (argv[i+1]));
 			i++; continue;
 		}
 
-		if (!strcmp (argv[i], "-timeout")) {
-			if (argc >= i+2)
-				timeout = atoi (argv[i+1]);
+		if (!strcmp (argv[i], "-all-outputs")) {
+			all_outputs = 1;
+			continue;
+		}
+
+		if (!strcmp (argv[i], "-renderer")) {
+			if (argc >= i+2) {
+				if (!strcmp (argv[i+1], "shm"))
+					renderer = DISPLAY_RENDERER_SHM;
+				else if (!strcmp (argv[i+1], "egl"))
+					renderer = DISPLAY_RENDERER_EGL;
+				else if (!strcmp (argv[i+1], "auto"))
+					renderer = DISPLAY_RENDERER_AUTO;
+				else
+					fprintf (stderr, "Unknown renderer \"%s\", using auto\n", argv[i+1]);
+			}
 			i++; continue;
 		}
 
-		if (!message)
-			message = strdup (argv[i]);
+		i = dialog_spec_parse_arg (&spec, argc, argv, i);
 	}
 
-	wlmessage_run (message, title, titlebuttons, noresize, buttons, icon, timeout, deflt, textfield);
+	if (daemon)
+		return wlmessage_daemon ();
 
+	if (batch)
+		return wlmessage_batch (batch, parallel);
 
-	return 0;
+	 /* stdin belongs to this process, so is the dialog ; the daemon
+	  * shows a single window */
+	if (spec.stdin_updates || all_outputs)
+		no_daemon = 1;
+
+	if (!no_daemon && daemon_client_run (&spec, &ret) == 0)
+		return ret;
+
+	return wlmessage_run (&spec);
 }
+#endif
 